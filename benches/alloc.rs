@@ -0,0 +1,92 @@
+// Heap allocations per file for lexing and declaration extraction, with and without the
+// per-thread `LexerContext`. Run with `cargo bench --bench alloc`.
+//
+// Every file is processed once to warm up, then the counts are taken over a second pass,
+// which is the steady state of gen-headers or the static analysis going through a project.
+#![allow(dead_code, unused_imports)]
+
+#[path = "../src/header_gen/mod.rs"]
+mod header_gen;
+mod common;
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::hint::black_box;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use header_gen::context;
+use header_gen::lexer_c;
+
+struct CountingAlloc;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+static BYTES: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        BYTES.fetch_add(layout.size(), Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        BYTES.fetch_add(new_size, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+/// Runs `f` over every file twice and returns (allocations, bytes) per file on the second pass
+fn count(files: &[(String, String)], mut f: impl FnMut(&str)) -> (f64, f64) {
+    for (_, code) in files {
+        f(code);
+    }
+    let (allocs, bytes) = (ALLOCATIONS.load(Ordering::Relaxed), BYTES.load(Ordering::Relaxed));
+    for (_, code) in files {
+        f(code);
+    }
+    let n = files.len() as f64;
+    (
+        (ALLOCATIONS.load(Ordering::Relaxed) - allocs) as f64 / n,
+        (BYTES.load(Ordering::Relaxed) - bytes) as f64 / n,
+    )
+}
+
+fn main() {
+    // A project's worth of files of varying size
+    let mut files = common::fixtures();
+    for i in 0..64 {
+        files.push((format!("generated-{}", i), common::generate_c_source(20 + 7 * i, i as u64)));
+    }
+
+    let fresh = count(&files, |code| {
+        let tokens = lexer_c::tokenize_compact(code).unwrap();
+        black_box(lexer_c::get_declarations(&tokens));
+    });
+    let reused = count(&files, |code| {
+        let mut ctx = context::thread_context();
+        let tokens = ctx.tokenize(code).unwrap();
+        let decls = ctx.declarations(&tokens);
+        black_box(&decls);
+        ctx.recycle_declarations(decls);
+        ctx.recycle_tokens(tokens);
+    });
+    let generate = count(&files, |code| {
+        black_box(header_gen::generate("bench", code, "", &|_| None, &Default::default()).unwrap());
+    });
+
+    println!("allocations per file, steady state ({} files)", files.len());
+    for (name, (allocs, bytes)) in [
+        ("tokenize + declarations", fresh),
+        ("  with LexerContext", reused),
+        ("generate (whole header)", generate),
+    ] {
+        println!("{:<26} {:>8.1} allocs {:>12.0} B", name, allocs, bytes);
+    }
+}
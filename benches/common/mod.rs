@@ -0,0 +1,146 @@
+// Deterministic generator for large, realistic C sources used by the benchmarks.
+
+use crate::header_gen::lexer_c::{self, Token};
+
+/// Small linear congruential generator so the corpus is identical on every run
+pub struct Lcg(u64);
+
+impl Lcg {
+    pub fn new(seed: u64) -> Self {
+        Self(seed)
+    }
+
+    pub fn next(&mut self, bound: usize) -> usize {
+        self.0 = self
+            .0
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((self.0 >> 33) as usize) % bound.max(1)
+    }
+}
+
+const TYPES: [&str; 8] = [
+    "int", "size_t", "uint64_t", "const char *", "double", "struct Node *", "Vec", "void *",
+];
+
+/// Generates a C file with `num_fns` functions plus the includes, macros, structs
+/// and comments you'd expect around them.
+pub fn generate_c_source(num_fns: usize, seed: u64) -> String {
+    let mut rng = Lcg::new(seed);
+    let mut out = String::with_capacity(num_fns * 400);
+
+    for inc in ["stdio.h", "stdlib.h", "stdint.h", "string.h"] {
+        out.push_str(&format!("#include <{}>\n", inc));
+    }
+    out.push_str("#include \"vec.h\"\n\n");
+
+    for i in 0..(num_fns / 10).max(1) {
+        out.push_str(&format!("#define LIMIT_{} {}\n", i, rng.next(1 << 16)));
+        out.push_str(&format!(
+            "#define CHECK_{i}(x, y) do {{ \\\n    if ((x) > LIMIT_{i}) {{ \\\n        y = (x) * {m} + \\\n            LIMIT_{i}; \\\n    }} \\\n}} while (0)\n\n",
+            i = i,
+            m = rng.next(97),
+        ));
+        // Macros built out of other macros, a few levels deep
+        out.push_str(&format!("#define SCALE_{}_0 (LIMIT_{} + 1)\n", i, i));
+        for depth in 1..4 {
+            out.push_str(&format!(
+                "#define SCALE_{i}_{d} (SCALE_{i}_{p} * {m})\n",
+                i = i,
+                d = depth,
+                p = depth - 1,
+                m = 2 + rng.next(7),
+            ));
+        }
+        out.push_str(&format!(
+            "#define MAX_{i}(a, b) ((a) > (b) ? (a) : (b))\n#define CLAMP_{i}(x) MAX_{i}(0, MAX_{i}((x), SCALE_{i}_3))\n\n",
+            i = i,
+        ));
+        out.push_str(&format!(
+            "/*\n * Record type {i}.\n *\n * {lorem}\n */\ntypedef struct Record{i} {{\n    uint32_t id;\n    char name[{len}];\n    struct Record{i} *next;\n}} Record{i};\n\n",
+            i = i,
+            len = 16 + rng.next(64),
+            lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ".repeat(1 + rng.next(4)),
+        ));
+    }
+
+    for i in 0..num_fns {
+        let ret = TYPES[rng.next(TYPES.len())];
+        let arg = TYPES[rng.next(TYPES.len())];
+        if rng.next(4) == 0 {
+            out.push_str(&format!(
+                "/**\n * Computes step {} of the pipeline.\n *\n * {}\n */\n",
+                i,
+                "Each step folds the running accumulator into the next input value. ".repeat(1 + rng.next(3)),
+            ));
+        } else {
+            out.push_str(&format!("// Computes step {} of the pipeline\n", i));
+        }
+        out.push_str(&format!("{} compute_step_{}({} input, int count) {{\n", ret, i, arg));
+        out.push_str("    int accumulator = 0;\n");
+        out.push_str("    for (int idx = 0; idx < count; idx++) {\n");
+        out.push_str(&format!(
+            "        accumulator += (idx * {}) ^ (accumulator >> {});\n",
+            rng.next(1000),
+            rng.next(31)
+        ));
+        if rng.next(3) == 0 {
+            out.push_str(&format!(
+                "        printf(\"step %d: value=%d \\\"{}\\\"\\n\", idx, accumulator);\n",
+                i
+            ));
+        }
+        out.push_str("    }\n");
+        let group = i % (num_fns / 10).max(1);
+        out.push_str(&format!("    CHECK_{}(accumulator, count);\n", group));
+        out.push_str(&format!("    accumulator = CLAMP_{}(accumulator);\n", group));
+        out.push_str("    return (void)input, accumulator;\n}\n\n");
+    }
+
+    out
+}
+
+/// Generates a comment and string literal heavy file, like generated message tables
+/// or protocol descriptions, with `num_entries` documented entries.
+pub fn generate_string_table(num_entries: usize, seed: u64) -> String {
+    let mut rng = Lcg::new(seed);
+    let mut out = String::with_capacity(num_entries * 300);
+
+    out.push_str("#include <stddef.h>\n\nstatic const char *MESSAGES[] = {\n");
+    for i in 0..num_entries {
+        out.push_str(&format!(
+            "    /* Entry {}: {} */\n",
+            i,
+            "generated from the protocol description, do not edit by hand. ".repeat(1 + rng.next(2)),
+        ));
+        out.push_str(&format!(
+            "    \"{}{}\",\n",
+            "The quick brown fox jumps over the lazy dog, ".repeat(1 + rng.next(3)),
+            i
+        ));
+    }
+    out.push_str("};\n");
+
+    out
+}
+
+/// Tokenizes `code` into a `Vec`, the layout the compact `TokenBuffer` is measured against
+pub fn tokenize(code: &str) -> Vec<Token<'_>> {
+    let mut tokens = Vec::with_capacity(4096);
+    lexer_c::lex(code, &mut tokens).unwrap();
+    tokens
+}
+
+/// The lexer fixtures in `tests/`
+pub fn fixtures() -> Vec<(String, String)> {
+    let mut files = vec![];
+    for entry in std::fs::read_dir("tests").unwrap() {
+        let path = entry.unwrap().path();
+        let name = path.file_name().unwrap().to_str().unwrap().to_string();
+        if name.starts_with("lexer-") && name.ends_with(".c") {
+            files.push((name, std::fs::read_to_string(&path).unwrap()));
+        }
+    }
+    files.sort();
+    files
+}
@@ -0,0 +1,149 @@
+// Criterion benchmarks for the lexer, the declaration extractors and the full header
+// generation pipeline. Run with `cargo bench --bench header_gen`.
+//
+// Every benchmark reports throughput in MB/s of C source, over the lexer fixtures and
+// generated files of 1k and 10k functions.
+#![allow(dead_code, unused_imports)]
+
+#[path = "../src/header_gen/mod.rs"]
+mod header_gen;
+mod common;
+
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+use header_gen::incremental::{self, DeclarationIndex, TextEdit};
+use header_gen::lexer_c::{self, DefineScanner, FnDefScanner};
+
+fn corpus() -> Vec<(String, String)> {
+    let mut files = common::fixtures();
+    files.push(("generated-1k".to_string(), common::generate_c_source(1_000, 7)));
+    files.push(("generated-10k".to_string(), common::generate_c_source(10_000, 7)));
+    files
+}
+
+fn bench_tokenize(c: &mut Criterion) {
+    let mut group = c.benchmark_group("tokenize");
+    for (name, code) in corpus() {
+        group.throughput(Throughput::BytesDecimal(code.len() as u64));
+        group.bench_with_input(BenchmarkId::new("vec", &name), code.as_str(), |b, code| {
+            b.iter(|| common::tokenize(black_box(code)))
+        });
+        group.bench_with_input(BenchmarkId::new("compact", &name), code.as_str(), |b, code| {
+            b.iter(|| lexer_c::tokenize_compact(black_box(code)).unwrap())
+        });
+    }
+    group.finish();
+}
+
+fn bench_extract(c: &mut Criterion) {
+    let mut group = c.benchmark_group("extract");
+    for (name, code) in corpus() {
+        let tokens = common::tokenize(&code);
+        group.throughput(Throughput::BytesDecimal(code.len() as u64));
+
+        group.bench_function(BenchmarkId::new("get_fn_def", &name), |b| {
+            b.iter(|| lexer_c::get_spans::<FnDefScanner, _>(black_box(&tokens[..])).len())
+        });
+        group.bench_function(BenchmarkId::new("get_udts", &name), |b| {
+            b.iter(|| lexer_c::get_udt_spans(black_box(&tokens[..])).len())
+        });
+        group.bench_function(BenchmarkId::new("get_defines", &name), |b| {
+            b.iter(|| lexer_c::get_spans::<DefineScanner, _>(black_box(&tokens[..])).len())
+        });
+        group.bench_function(BenchmarkId::new("get_includes", &name), |b| {
+            b.iter(|| lexer_c::get_include_spans(black_box(&tokens[..])).len())
+        });
+
+        // All four kinds on the compact buffer: one interleaved pass against four scans
+        let compact = lexer_c::tokenize_compact(&code).unwrap();
+        let decls = lexer_c::get_declarations(&compact);
+        assert_eq!(decls.fn_defs, lexer_c::get_spans::<FnDefScanner, _>(&compact));
+        assert_eq!(decls.udts, lexer_c::get_udt_spans(&compact));
+
+        group.bench_function(BenchmarkId::new("all_separately", &name), |b| {
+            b.iter(|| {
+                let compact = black_box(&compact);
+                lexer_c::get_spans::<FnDefScanner, _>(compact).len()
+                    + lexer_c::get_include_spans(compact).len()
+                    + lexer_c::get_spans::<DefineScanner, _>(compact).len()
+                    + lexer_c::get_udt_spans(compact).len()
+            })
+        });
+        group.bench_function(BenchmarkId::new("get_declarations", &name), |b| {
+            b.iter(|| lexer_c::get_declarations(black_box(&compact)))
+        });
+    }
+    group.finish();
+}
+
+fn bench_reconstruct(c: &mut Criterion) {
+    let mut group = c.benchmark_group("reconstruct_source");
+    for (name, code) in corpus() {
+        let tokens = lexer_c::tokenize_compact(&code).unwrap();
+        let mut exclude = lexer_c::get_udt_spans(&tokens);
+        exclude.extend(lexer_c::get_spans::<DefineScanner, _>(&tokens));
+
+        group.throughput(Throughput::BytesDecimal(code.len() as u64));
+        group.bench_function(BenchmarkId::from_parameter(&name), |b| {
+            b.iter(|| lexer_c::reconstruct_source(black_box(&tokens), black_box(&exclude)))
+        });
+    }
+    group.finish();
+}
+
+/// Everything `kiln gen-headers` does for one file, minus the file I/O
+fn bench_gen_headers(c: &mut Criterion) {
+    let mut group = c.benchmark_group("gen_headers");
+    for (name, code) in corpus() {
+        // Also time the second run, where the header already holds the definitions
+        let first = header_gen::generate("bench", &code, "", &|_| None, &Default::default()).unwrap();
+        assert!(first.header.len() > 0 && lexer_c::tokenize_compact(&first.source).unwrap().len() > 0);
+
+        group.throughput(Throughput::BytesDecimal(code.len() as u64));
+        group.bench_function(BenchmarkId::new("fresh", &name), |b| {
+            b.iter(|| header_gen::generate("bench", black_box(&code), "", &|_| None, &Default::default()).unwrap())
+        });
+        group.bench_function(BenchmarkId::new("regenerate", &name), |b| {
+            b.iter(|| header_gen::generate("bench", black_box(&first.source), &first.header, &|_| None, &Default::default()).unwrap())
+        });
+    }
+    group.finish();
+}
+
+/// A one character edit in the middle of the file: re-lexing and re-extracting everything
+/// against `incremental::relex` plus a `DeclarationIndex` update
+fn bench_edit(c: &mut Criterion) {
+    let mut group = c.benchmark_group("edit");
+    for (name, code) in corpus() {
+        // Insert a character at the start of some line near the middle
+        let at = code[..(code.len() / 2)].rfind('\n').map_or(0, |i| i + 1);
+        let mut edited = code.clone();
+        edited.insert(at, 'x');
+        let edit = TextEdit { range: at..at, new_len: 1 };
+
+        let tokens = lexer_c::tokenize_compact(&code).unwrap();
+        let index = DeclarationIndex::new(&tokens);
+
+        group.throughput(Throughput::BytesDecimal(code.len() as u64));
+        group.bench_function(BenchmarkId::new("full", &name), |b| {
+            b.iter(|| {
+                let tokens = lexer_c::tokenize_compact(black_box(&edited)).unwrap();
+                lexer_c::get_declarations(&tokens)
+            })
+        });
+        group.bench_function(BenchmarkId::new("incremental", &name), |b| {
+            b.iter_batched(
+                || (tokens.clone(), index.clone()),
+                |(tokens, mut index)| {
+                    let (tokens, token_edit) = incremental::relex(tokens, black_box(&edited), &edit).unwrap();
+                    index.update(&tokens, &token_edit);
+                    index
+                },
+                BatchSize::LargeInput,
+            )
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_tokenize, bench_extract, bench_reconstruct, bench_gen_headers, bench_edit);
+criterion_main!(benches);
@@ -0,0 +1,119 @@
+// Tokenizer throughput: `lexer_c::tokenize` against the byte-at-a-time reference.
+// Run with `cargo bench --bench lexer`.
+//
+// "tokenize" is the full `Vec<Token>` build; "scan" drives the same lexers into a sink
+// that only counts tokens, which isolates the byte classification from the cost of
+// materializing 24 byte tokens. "compact" builds the struct-of-arrays `TokenBuffer`, and
+// "parallel" does the same with the input split across every core.
+#![allow(dead_code, unused_imports)]
+
+#[path = "../src/header_gen/mod.rs"]
+mod header_gen;
+mod common;
+
+use header_gen::lexer_c::{self, Token, TokenSink, TokenSource};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+struct CountingSink(usize);
+
+impl<'a> TokenSink<'a> for CountingSink {
+    fn push_token(&mut self, tok: Token<'a>, _start: usize) {
+        black_box(tok);
+        self.0 += 1;
+    }
+
+    fn push_run(&mut self, _tok: Token<'a>, _start: usize, count: usize) {
+        self.0 += count;
+    }
+}
+
+/// Runs `f` over `code` for at least `min_time` and returns the throughput in GB/s
+fn throughput(code: &str, min_time: Duration, f: impl Fn(&str) -> usize) -> f64 {
+    let mut iters: u64 = 0;
+    let start = Instant::now();
+    while start.elapsed() < min_time || iters < 3 {
+        black_box(f(black_box(code)));
+        iters += 1;
+    }
+    let secs = start.elapsed().as_secs_f64();
+    (code.len() as f64 * iters as f64) / secs / 1e9
+}
+
+fn bench(name: &str, code: &str) {
+    let min_time = Duration::from_millis(500);
+
+    let tok_scalar = throughput(code, min_time, |c| lexer_c::tokenize_scalar(c).unwrap().len());
+    let tok_simd = throughput(code, min_time, |c| common::tokenize(c).len());
+    let scan_scalar = throughput(code, min_time, |c| {
+        let mut sink = CountingSink(0);
+        lexer_c::lex_scalar(c, &mut sink).unwrap();
+        sink.0
+    });
+    let scan_simd = throughput(code, min_time, |c| {
+        let mut sink = CountingSink(0);
+        lexer_c::lex(c, &mut sink).unwrap();
+        sink.0
+    });
+
+    let compact = throughput(code, min_time, |c| lexer_c::tokenize_compact(c).unwrap().len());
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let parallel = throughput(code, min_time, |c| lexer_c::tokenize_parallel(c, threads).unwrap().len());
+
+    let tokens = common::tokenize(code);
+    let vec_bytes = tokens.len() * std::mem::size_of::<Token>();
+    let compact_bytes = tokens.len() * (std::mem::size_of::<u8>() + std::mem::size_of::<u32>());
+
+    println!(
+        "{:<24} {:>10} B | tokenize {:>6.3} -> {:>6.3} GB/s ({:.2}x) | scan {:>6.3} -> {:>6.3} GB/s ({:.2}x)",
+        name,
+        code.len(),
+        tok_scalar,
+        tok_simd,
+        tok_simd / tok_scalar,
+        scan_scalar,
+        scan_simd,
+        scan_simd / scan_scalar,
+    );
+    println!(
+        "{:<24} {:>10}   | compact  {:>6.3} GB/s, parallel {:>6.3} GB/s ({} threads) | token memory {:>10} B -> {:>10} B ({:.1}x smaller)",
+        "",
+        "",
+        compact,
+        parallel,
+        threads,
+        vec_bytes,
+        compact_bytes,
+        vec_bytes as f64 / compact_bytes as f64,
+    );
+}
+
+fn main() {
+    let corpus: Vec<(String, String)> = common::fixtures()
+        .into_iter()
+        .chain([
+            ("generated (1k fns)".to_string(), common::generate_c_source(1_000, 7)),
+            ("generated (10k fns)".to_string(), common::generate_c_source(10_000, 7)),
+            ("generated (100k fns)".to_string(), common::generate_c_source(100_000, 7)),
+            ("string table (100k)".to_string(), common::generate_string_table(100_000, 7)),
+        ])
+        .collect();
+
+    println!("throughput: scalar reference -> vectorized");
+    for (name, code) in &corpus {
+        assert_eq!(
+            common::tokenize(code),
+            lexer_c::tokenize_scalar(code).unwrap(),
+            "tokenizers disagree on {}",
+            name
+        );
+        let serial = lexer_c::tokenize_compact(code).unwrap();
+        let parallel = lexer_c::tokenize_parallel(code, 8).unwrap();
+        assert!(
+            serial.len() == parallel.len() && (0..serial.len()).all(|i| serial.token_at(i) == parallel.token_at(i)),
+            "parallel lexer disagrees on {}",
+            name
+        );
+        bench(name, code);
+    }
+}
@@ -0,0 +1,160 @@
+use std::collections::{BTreeMap, HashSet};
+use std::fs;
+use std::path::Path;
+
+use serde::{Deserialize, Serialize};
+
+use crate::testing::safety::{self, Warning};
+
+/// The static analysis warnings of the last run, per project file (by content hash) and
+/// per pot version, persisted in `build/`. A build only checks the files that changed
+/// since, and replays the rest. Warnings found by another version of kiln or another set
+/// of rules are thrown away.
+///
+/// Pot warnings are the ones found with the built-in rules when the pot was analyzed,
+/// filtered by the project's rules when they're shown.
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct AnalysisCache {
+    version: String,
+    files: BTreeMap<String, CachedFile>,
+    /// Warnings of each pot by `owner/repo@version`, with file names relative to the pot
+    pots: BTreeMap<String, Vec<Warning>>,
+}
+
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+struct CachedFile {
+    hash: u64,
+    warnings: Vec<Warning>,
+}
+
+impl AnalysisCache {
+    /// Loads the cache at `path`, for the rules with the given fingerprint. A missing,
+    /// unreadable or outdated cache is empty, so everything gets checked again.
+    pub fn load(path: &Path, rules: u64) -> Self {
+        let cache = fs::read_to_string(path)
+            .ok()
+            .and_then(|s| serde_json::from_str::<AnalysisCache>(&s).ok());
+
+        match cache {
+            Some(c) if c.version == Self::current_version(rules) => c,
+            _ => Self::new(rules),
+        }
+    }
+
+    pub fn new(rules: u64) -> Self {
+        Self {
+            version: Self::current_version(rules),
+            ..Self::default()
+        }
+    }
+
+    pub fn to_json(&self) -> String {
+        serde_json::to_string(self).unwrap()
+    }
+
+    /// The files of `files` (name and content hash) without cached warnings for their
+    /// current content
+    pub fn stale<'a>(&self, files: &[(&'a str, u64)]) -> Vec<&'a str> {
+        files
+            .iter()
+            .filter(|(name, hash)| self.files.get(*name).map_or(true, |f| f.hash != *hash))
+            .map(|(name, _)| *name)
+            .collect()
+    }
+
+    /// The pots of `pots` without cached warnings
+    pub fn missing_pots<'a>(&self, pots: &'a [String]) -> Vec<&'a str> {
+        pots.iter().filter(|id| !self.pots.contains_key(*id)).map(|id| id.as_str()).collect()
+    }
+
+    /// Makes `files` the project's files. The ones in `checked` get the warnings of
+    /// `warnings` with their name, the others keep theirs, and files that are gone are
+    /// dropped.
+    pub fn set_files(&mut self, files: &[(&str, u64)], checked: &[&str], warnings: Vec<Warning>) {
+        let checked: HashSet<&str> = checked.iter().copied().collect();
+        let mut old = std::mem::take(&mut self.files);
+
+        for &(name, hash) in files {
+            let cached = match checked.contains(name) {
+                true => CachedFile { hash, warnings: vec![] },
+                false => match old.remove(name) {
+                    Some(cached) => cached,
+                    None => continue,
+                },
+            };
+            self.files.insert(name.to_string(), cached);
+        }
+        for w in warnings {
+            if let Some(file) = self.files.get_mut(&w.filename) {
+                file.warnings.push(w);
+            }
+        }
+    }
+
+    /// Makes `pots` the project's pots, with the warnings in `checked` for the ones that
+    /// were missing
+    pub fn set_pots(&mut self, pots: &[String], checked: Vec<(String, Vec<Warning>)>) {
+        let mut old = std::mem::take(&mut self.pots);
+        old.extend(checked);
+        self.pots = pots.iter().filter_map(|id| Some((id.clone(), old.remove(id)?))).collect();
+    }
+
+    /// Warnings of the project's files, by file name and line
+    pub fn file_warnings(&self) -> impl Iterator<Item = &Warning> {
+        self.files.values().flat_map(|f| &f.warnings)
+    }
+
+    /// Warnings of the pots with the pot they're in, by pot and then file name and line
+    pub fn pot_warnings(&self) -> impl Iterator<Item = (&str, &Warning)> {
+        self.pots.iter().flat_map(|(id, warnings)| warnings.iter().map(move |w| (id.as_str(), w)))
+    }
+
+    fn current_version(rules: u64) -> String {
+        format!("{}+{}+{:x}", env!("CARGO_PKG_VERSION"), safety::RULES_VERSION, rules)
+    }
+}
+
+#[cfg(test)]
+mod analysis_cache_tests {
+    use super::*;
+    use crate::testing::safety::WarningType;
+
+    fn warning(file: &str, line: usize) -> Warning {
+        Warning {
+            msg: "gets() is an unsafe function".to_string(),
+            filename: file.to_string(),
+            line,
+            warning_type: WarningType::UnsafeFunction,
+            subject: "gets".to_string(),
+        }
+    }
+
+    #[test]
+    fn test_only_changed_files_are_stale() {
+        let mut cache = AnalysisCache::new(0);
+        let files = [("a.c", 1), ("b.c", 2)];
+        assert_eq!(cache.stale(&files), vec!["a.c", "b.c"]);
+        cache.set_files(&files, &["a.c", "b.c"], vec![warning("b.c", 3), warning("a.c", 7)]);
+        assert_eq!(cache.stale(&files), Vec::<&str>::new());
+
+        // b.c changed and lost its warning, a.c keeps its own, c.c is new
+        let files = [("a.c", 1), ("b.c", 5), ("c.c", 4)];
+        assert_eq!(cache.stale(&files), vec!["b.c", "c.c"]);
+        cache.set_files(&files, &["b.c", "c.c"], vec![warning("c.c", 1)]);
+        let lines: Vec<_> = cache.file_warnings().map(|w| (w.filename.as_str(), w.line)).collect();
+        assert_eq!(lines, vec![("a.c", 7), ("c.c", 1)]);
+
+        // Deleted files and pots that aren't used anymore are dropped
+        cache.set_files(&[("c.c", 4)], &[], vec![]);
+        assert_eq!(cache.file_warnings().count(), 1);
+        let pots = vec!["acme/str@v1".to_string()];
+        cache.set_pots(&pots, vec![("acme/str@v1".to_string(), vec![warning("src/s.c", 2)])]);
+        assert_eq!(cache.missing_pots(&pots), Vec::<&str>::new());
+        assert_eq!(cache.pot_warnings().next().map(|(id, w)| (id, w.line)), Some(("acme/str@v1", 2)));
+        cache.set_pots(&[], vec![]);
+        assert_eq!(cache.pot_warnings().count(), 0);
+
+        let json = cache.to_json();
+        assert_eq!(serde_json::from_str::<AnalysisCache>(&json).unwrap(), cache);
+    }
+}
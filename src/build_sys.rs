@@ -1,5 +1,5 @@
 use crate::config::{self, KilnPot};
-use crate::utils;
+use crate::source_index::SourceIndex;
 use crate::utils::Language;
 use crate::{config::Config, constants::CONFIG_FILE};
 
@@ -76,7 +76,7 @@ pub fn link_proj_files(
     Ok(())
 }
 
-pub fn link_sys_lib(path: &Path) -> Vec<String> {
+pub fn link_sys_lib(index: &SourceIndex) -> Vec<String> {
     let c_lib_mappings = [
         ("<math.h>", "-lm"),                // Math library
         ("<omp.h>", "-fopenmp"),            // OpenMP library
@@ -96,11 +96,11 @@ pub fn link_sys_lib(path: &Path) -> Vec<String> {
         ("<arm_neon.h>", "-mfpu=neon"),     // NEON support for ARM
     ];
 
-    let includes = utils::extract_include_statements(path);
+    let includes = index.system_includes();
 
     let mut libs = vec![];
     for (incl, link) in c_lib_mappings {
-        if includes.contains(&incl.to_string()) {
+        if includes.contains(incl) {
             libs.push(link.to_string())
         }
     }
@@ -131,6 +131,29 @@ pub fn link_dep_files(
     Ok(())
 }
 
+/// Extensions of the source files a project in `language` compiles
+pub fn source_extensions(language: Language) -> &'static [&'static str] {
+    match language {
+        Language::C => &[".c"],
+        Language::Cpp => &[".c", ".cpp"],
+        Language::Cuda => &[".c", ".cpp", ".cu"],
+    }
+}
+
+/// Every pot the project depends on, directly or through another pot, each once
+pub fn dep_pots(config: &Config) -> Result<Vec<KilnPot>> {
+    let mut pots = vec![];
+    let mut packages: HashSet<String> = HashSet::new();
+
+    if let Some(deps) = &config.dependency {
+        for dep in deps {
+            dep_pots_h(dep, &mut pots, &mut packages)?;
+        }
+    }
+
+    Ok(pots)
+}
+
 pub fn link_dep_headers(config: &Config) -> Result<Vec<String>> {
     let mut header_dirs = vec![];
 
@@ -311,11 +334,7 @@ fn link_dep_files_h(
 
     packages.insert(dep_id, dep.version.clone());
 
-    let valid_ext = match language {
-        Language::C => [".c"].as_slice(),
-        Language::Cpp => [".c", ".cpp"].as_slice(),
-        Language::Cuda => [".c", ".cpp", ".cu"].as_slice(),
-    };
+    let valid_ext = source_extensions(language);
 
     for file in source_dir.read_dir()? {
         let file = match file {
@@ -363,6 +382,25 @@ fn link_dep_files_h(
     Ok(())
 }
 
+fn dep_pots_h(dep: &KilnPot, out_buffer: &mut Vec<KilnPot>, packages: &mut HashSet<String>) -> Result<()> {
+    let dep_id = format!("{}/{}", dep.owner(), dep.repo_name());
+    if !packages.insert(dep_id) {
+        return Ok(());
+    }
+    out_buffer.push(dep.clone());
+
+    // Recursivley handle chain dependnecies
+    if let Some(kiln_cfg) = dep.get_kiln_cfg()? {
+        if let Some(chain_deps) = kiln_cfg.dependency {
+            for cd in &chain_deps {
+                dep_pots_h(cd, out_buffer, packages)?;
+            }
+        }
+    }
+
+    Ok(())
+}
+
 /// Helper function that recursivly links all the header file directories
 fn link_dep_headers_h(
     dep: &KilnPot,
@@ -1,3 +1,5 @@
+use crate::include_graph::GraphFormat;
+use crate::layout;
 use crate::utils::{self, Language};
 
 use clap::{Parser, Subcommand};
@@ -27,6 +29,46 @@ pub enum Commands {
         #[arg()]
         args: Option<Vec<String>>
     },
+    /// Ranks headers by how much preprocessed text they add to the build
+    IncludeGraph {
+        #[arg(value_enum, long, default_value = "table")]
+        format: GraphFormat,
+
+        /// Also follow system headers through the compiler's built-in search path
+        #[arg(long)]
+        system: bool,
+
+        /// Only show the N most expensive headers (table format)
+        #[arg(long)]
+        top: Option<usize>,
+    },
+    /// Looks up functions, types and macros in the project's symbol index
+    Symbols {
+        /// Where this symbol is defined and called
+        name: Option<String>,
+
+        /// List the project's functions that nothing calls
+        #[arg(long)]
+        unused: bool,
+
+        /// Print JSON, for editors and other tools
+        #[arg(long)]
+        json: bool,
+    },
+    /// Suggests changes that help the compiler optimize
+    Advise {
+        #[command(subcommand)]
+        subcommand: AdviseSubCmd,
+    },
+    /// Shows how the compiler lays out the project's structs: holes, padding and cache lines
+    Layout {
+        /// Only these structs (tag or typedef name)
+        types: Vec<String>,
+
+        /// Cache line size in bytes
+        #[arg(long, default_value_t = layout::CACHE_LINE)]
+        cache_line: usize,
+    },
     Add {
         dep_uri: String,
     },
@@ -75,6 +117,16 @@ impl Commands {
     }
 }
 
+#[derive(Subcommand, Debug)]
+pub enum AdviseSubCmd {
+    /// Lists functions only called from their own file, which could be `static`
+    Linkage {
+        /// Mark them `static` and regenerate their headers without them
+        #[arg(long)]
+        apply: bool,
+    },
+}
+
 #[derive(Subcommand, Debug)]
 pub enum LocalDevSubCmd {
     SetEditor,
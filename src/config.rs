@@ -7,6 +7,7 @@ use std::{
 use toml;
 
 use crate::packaging::pot::PotConfig;
+use crate::testing::rules::StaticAnalysisConfig;
 use crate::{
     constants::{CONFIG_FILE, PACKAGE_CONFIG_FILE, PACKAGE_DIR},
     package_manager, utils,
@@ -17,6 +18,7 @@ pub struct Config {
     pub project: Project,
     pub build_options: BuildOptions,
     pub dependency: Option<Vec<KilnPot>>,
+    pub static_analysis: Option<StaticAnalysisConfig>,
 }
 
 impl Config {
@@ -35,6 +37,7 @@ impl Config {
             project,
             build_options,
             dependency: None,
+            static_analysis: None,
         }
     }
 
@@ -83,6 +86,23 @@ impl Config {
         self.build_options.kiln_static_analysis.unwrap_or(true)
     }
 
+    /// gen-headers moves functions of at most this many lines into their header as
+    /// `static inline`. Off unless set.
+    pub fn get_header_inline_max_lines(&self) -> Option<usize> {
+        self.build_options.header_inline_max_lines
+    }
+
+    /// The `[static_analysis]` section: rule sets to turn off and the project's own rules
+    pub fn get_static_analysis(&self) -> StaticAnalysisConfig {
+        self.static_analysis.clone().unwrap_or_default()
+    }
+
+    /// Warn about structs that would shrink with their members reordered. It compiles
+    /// every file defining a struct, so it's off unless set.
+    pub fn get_layout_warnings(&self) -> bool {
+        self.build_options.layout_warnings.unwrap_or(false)
+    }
+
     pub fn get_standard(&self) -> Option<String> {
         self.build_options.standard.clone()
     }
@@ -139,6 +159,8 @@ pub struct BuildOptions {
     standard: Option<String>,
     kiln_static_analysis: Option<bool>,
     main_filepath: Option<String>,
+    header_inline_max_lines: Option<usize>,
+    layout_warnings: Option<bool>,
 }
 
 impl BuildOptions {
@@ -160,6 +182,8 @@ impl BuildOptions {
             include_dir: None,
             kiln_static_analysis: None,
             main_filepath: None,
+            header_inline_max_lines: None,
+            layout_warnings: None,
         };
 
         match project.language.as_str() {
@@ -208,6 +232,11 @@ impl KilnPot {
         repo
     }
 
+    /// `owner/repo@version`
+    pub fn id(&self) -> String {
+        format!("{}/{}@{}", self.owner(), self.repo_name(), self.version)
+    }
+
     pub fn get_global_path(&self) -> PathBuf {
         let (owner, repo) = package_manager::parse_github_uri(&self.uri).unwrap();
 
@@ -9,6 +9,12 @@ use std::{
 pub const CONFIG_FILE: &str = "Kiln.toml";
 pub const DEV_ENV_CFG_FILE: &str = "kiln-dev-env-config.toml";
 pub const PACKAGE_CONFIG_FILE: &str = "kiln-package.toml";
+pub const HEADER_MANIFEST_FILE: &str = "gen-headers.json";
+pub const SOURCE_INDEX_FILE: &str = "source-index.json";
+pub const SYMBOL_SOURCES_FILE: &str = "symbol-sources.json";
+pub const SYMBOL_INDEX_FILE: &str = "symbols.idx";
+pub const POT_ANALYSIS_FILE: &str = "kiln-analysis.json";
+pub const ANALYSIS_CACHE_FILE: &str = "analysis-cache.json";
 
 pub static DATA_DIR: Lazy<PathBuf> = Lazy::new(|| {
     let paths = [
@@ -0,0 +1,130 @@
+// Per-thread buffers for the lexer and the declaration scanners.
+//
+// Lexing a file needs two token arrays, and extracting its declarations needs four
+// span lists plus a window of decoded tokens. Allocating those afresh for every file
+// churns the allocator when gen-headers or the static analysis goes through thousands
+// of files, so each thread keeps one set around and reuses it.
+
+use std::cell::Cell;
+use std::ops::{Deref, DerefMut};
+
+use anyhow::Result;
+
+use super::lexer_c::{self, Declarations, Token, TokenBuffer, TokenSource};
+
+// A file needs at most two token buffers and declaration lists alive at once (the
+// source and its header), anything past that is dropped rather than kept
+const MAX_POOLED: usize = 2;
+
+/// Buffers recycled from earlier files. Everything a context hands out can be given
+/// back with the matching `recycle_*` method; anything that isn't is simply freed.
+#[derive(Default)]
+pub struct LexerContext {
+    token_arrays: Vec<(Vec<u8>, Vec<u32>)>,
+    declarations: Vec<Declarations>,
+    // Always empty between calls, it's only kept for its capacity
+    decoded: Vec<Token<'static>>,
+}
+
+impl LexerContext {
+    /// Same as `lexer_c::tokenize_compact`
+    pub fn tokenize<'a>(&mut self, code: &'a str) -> Result<TokenBuffer<'a>> {
+        let (kinds, starts) = self.token_arrays.pop().unwrap_or_default();
+        lexer_c::tokenize_into(TokenBuffer::with_arrays(code, kinds, starts))
+    }
+
+    /// Same as `lexer_c::get_declarations`
+    pub fn declarations<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) -> Declarations {
+        let out = self.declarations.pop().unwrap_or_default();
+        let decoded = reuse_vec(std::mem::take(&mut self.decoded));
+        let (decls, decoded) = lexer_c::get_declarations_into(tokens, decoded, out);
+        self.decoded = reuse_vec(decoded);
+        decls
+    }
+
+    pub fn recycle_tokens(&mut self, tokens: TokenBuffer) {
+        if self.token_arrays.len() < MAX_POOLED {
+            self.token_arrays.push(tokens.into_arrays());
+        }
+    }
+
+    pub fn recycle_declarations(&mut self, decls: Declarations) {
+        if self.declarations.len() < MAX_POOLED {
+            self.declarations.push(decls);
+        }
+    }
+}
+
+/// Empties `v` and reuses its allocation for a vector of another type with the same
+/// layout (here `Token<'a>` and `Token<'static>`, which only differ in lifetime).
+/// `collect` on a by-value iterator of a `Vec` writes into the source buffer in place.
+fn reuse_vec<T, U>(mut v: Vec<T>) -> Vec<U> {
+    v.clear();
+    v.into_iter().map(|_| unreachable!()).collect()
+}
+
+thread_local! {
+    static THREAD_CONTEXT: Cell<LexerContext> = Cell::new(LexerContext::default());
+}
+
+/// This thread's `LexerContext`, returned to the thread when the guard is dropped. A
+/// nested call gets an empty context of its own rather than a borrow error.
+pub fn thread_context() -> ThreadContext {
+    ThreadContext(THREAD_CONTEXT.with(Cell::take))
+}
+
+pub struct ThreadContext(LexerContext);
+
+impl Deref for ThreadContext {
+    type Target = LexerContext;
+
+    fn deref(&self) -> &LexerContext {
+        &self.0
+    }
+}
+
+impl DerefMut for ThreadContext {
+    fn deref_mut(&mut self) -> &mut LexerContext {
+        &mut self.0
+    }
+}
+
+impl Drop for ThreadContext {
+    fn drop(&mut self) {
+        let ctx = std::mem::take(&mut self.0);
+        // Fails only while the thread is shutting down, when there's no one left to reuse it
+        let _ = THREAD_CONTEXT.try_with(|c| c.set(ctx));
+    }
+}
+
+#[cfg(test)]
+mod context_tests {
+    use std::fs;
+
+    use super::*;
+
+    #[test]
+    fn test_buffers_are_reused() {
+        let big = fs::read_to_string("tests/lexer-UDT.c").unwrap();
+        let small = fs::read_to_string("tests/lexer-define.c").unwrap();
+        let mut ctx = LexerContext::default();
+
+        let tokens = ctx.tokenize(&big).unwrap();
+        let decls = ctx.declarations(&tokens);
+        let (kinds_ptr, decoded_capacity) = (tokens.kinds.as_ptr(), ctx.decoded.capacity());
+        let fn_defs_ptr = decls.fn_defs.as_ptr();
+        assert!(decoded_capacity > 0);
+        ctx.recycle_declarations(decls);
+        ctx.recycle_tokens(tokens);
+
+        let tokens = ctx.tokenize(&small).unwrap();
+        let decls = ctx.declarations(&tokens);
+        assert_eq!(tokens.kinds.as_ptr(), kinds_ptr);
+        assert_eq!(decls.fn_defs.as_ptr(), fn_defs_ptr);
+        assert_eq!(ctx.decoded.capacity(), decoded_capacity);
+
+        let expected = lexer_c::tokenize_compact(&small).unwrap();
+        assert_eq!((&tokens.kinds, &tokens.starts), (&expected.kinds, &expected.starts));
+        assert_eq!(decls, lexer_c::get_declarations(&expected));
+    }
+}
@@ -0,0 +1,586 @@
+// Works out which of a source file's includes its generated header needs (a small
+// include-what-you-use). The header only needs the includes that provide the types in
+// its prototypes and UDT members and the names its macros use; everything else stays
+// in the `.c` file only.
+//
+// This works on tokens, not a real parse, so it errs on the side of keeping includes:
+// an include is only dropped when we know what it provides (the common names of a
+// standard header in `std_header_names`, or a project header we can read), none of that
+// is used, and every name the header uses is accounted for. The standard header tables
+// are partial, so while some name is unresolved, nothing is dropped.
+
+use std::collections::HashSet;
+
+use super::lexer_c::{self, Token, TokenSource};
+
+/// The includes a generated header should keep, plus forward declarations that stand in
+/// for dropped includes whose structs are only used through pointers
+#[derive(Debug)]
+pub struct IncludeSelection<T> {
+    pub includes: Vec<T>,
+    pub forward_decls: Vec<String>,
+}
+
+/// What an `#include` refers to
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum IncludeTarget {
+    /// `#include <name>`
+    System(String),
+    /// `#include "name"`
+    Local(String),
+}
+
+pub fn include_target<'a, T: TokenSource<'a>>(include: &T) -> Option<IncludeTarget> {
+    let mut open = None;
+    for i in 0..include.len() {
+        match include.token_at(i) {
+            Token::Literal(s) if s.len() >= 2 => {
+                return Some(IncludeTarget::Local(s[1..(s.len() - 1)].to_string()));
+            }
+            Token::LessThan => open = Some(i),
+            Token::GreaterThan => {
+                let name = include.text((open? + 1)..i);
+                return Some(IncludeTarget::System(name.trim().to_string()));
+            }
+            _ => {}
+        }
+    }
+    None
+}
+
+/// Picks the includes (from `includes`, in order) needed by a header made of `defines`,
+/// `udts` and the function prototypes `fn_defs`. `resolve_local` returns the text that
+/// declares what a `#include "..."` provides, or `None` if it can't be found.
+pub fn select_includes<'a, T>(
+    includes: &[T],
+    defines: &[T],
+    udts: &[T],
+    fn_defs: &[T],
+    resolve_local: &dyn Fn(&str) -> Option<String>,
+) -> IncludeSelection<T>
+where
+    T: TokenSource<'a> + Copy,
+{
+    // What the header declares itself doesn't need an include
+    let mut declared = Names::default();
+    for decl in defines.iter().chain(udts).chain(fn_defs) {
+        collect_declared(decl, &mut declared);
+    }
+
+    let mut uses = Uses::default();
+    for def in defines {
+        collect_define_uses(def, &mut uses);
+    }
+    for udt in udts {
+        collect_decl_uses(udt, &mut uses);
+    }
+    for func in fn_defs {
+        collect_decl_uses(func, &mut uses);
+    }
+
+    let mut needed: HashSet<&str> = uses
+        .idents
+        .iter()
+        .copied()
+        .filter(|name| !declared.idents.contains(*name) && !is_keyword(name))
+        .collect();
+    let mut needed_tags: HashSet<(&str, &str)> = uses
+        .tags
+        .iter()
+        .copied()
+        .filter(|tag| !declared.tags.contains(&owned_tag(*tag)))
+        .collect();
+    let pointer_tags: Vec<(&str, &str)> = uses
+        .pointer_tags
+        .iter()
+        .copied()
+        .filter(|tag| !uses.tags.contains(tag) && !declared.tags.contains(&owned_tag(*tag)))
+        .collect();
+
+    // Keep each include that provides something not already covered by an earlier one
+    let mut keep = vec![false; includes.len()];
+    let mut dropped = vec![];
+    for (i, include) in includes.iter().enumerate() {
+        let provided = include_target(include).and_then(|target| match target {
+            IncludeTarget::System(name) => std_header_names(&name),
+            IncludeTarget::Local(path) => resolve_local(&path).and_then(|text| {
+                let tokens = lexer_c::tokenize_compact(&text).ok()?;
+                let mut names = Names::default();
+                collect_declared(&tokens, &mut names);
+                Some(names)
+            }),
+        });
+
+        let Some(provided) = provided else {
+            keep[i] = true;
+            continue;
+        };
+
+        let before = needed.len() + needed_tags.len();
+        needed.retain(|name| !provided.idents.contains(*name));
+        needed_tags.retain(|tag| !provided.tags.contains(&owned_tag(*tag)));
+
+        if needed.len() + needed_tags.len() < before {
+            keep[i] = true;
+        } else {
+            dropped.push((i, provided));
+        }
+    }
+
+    let mut forward_decls = vec![];
+    if !needed.is_empty() || !needed_tags.is_empty() {
+        // Something we couldn't account for may come from a standard header beyond what its
+        // table lists, or through a project header's own includes, so don't drop any
+        for (i, _) in dropped.drain(..) {
+            keep[i] = true;
+        }
+    }
+
+    for tag in pointer_tags {
+        let from_dropped = dropped
+            .iter()
+            .any(|(_, provided)| provided.tags.contains(&owned_tag(tag)));
+        if from_dropped && tag.0 != "enum" {
+            forward_decls.push(format!("{} {};", tag.0, tag.1));
+        }
+    }
+    forward_decls.sort();
+    forward_decls.dedup();
+
+    IncludeSelection {
+        includes: (0..includes.len())
+            .filter(|&i| keep[i])
+            .map(|i| includes[i])
+            .collect(),
+        forward_decls,
+    }
+}
+
+/// Names made available by a header: ordinary identifiers (types, macros, functions,
+/// enum constants, variables) and struct/union/enum tags
+#[derive(Debug, Default)]
+pub struct Names {
+    idents: HashSet<String>,
+    tags: HashSet<(String, String)>,
+}
+
+#[derive(Debug, Default)]
+struct Uses<'a> {
+    idents: HashSet<&'a str>,
+    // Tags that need the complete type
+    tags: HashSet<(&'a str, &'a str)>,
+    // Tags only used as `struct X *`
+    pointer_tags: HashSet<(&'a str, &'a str)>,
+}
+
+fn owned_tag(tag: (&str, &str)) -> (String, String) {
+    (tag.0.to_string(), tag.1.to_string())
+}
+
+fn is_identifier(s: &str) -> bool {
+    s.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_')
+}
+
+/// Index of the next token after `idx` that isn't whitespace or a comment
+fn next_significant<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, idx: usize) -> Option<usize> {
+    ((idx + 1)..tokens.len()).find(|&i| !is_trivia(tokens.token_at(i)))
+}
+
+fn prev_significant<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, idx: usize) -> Option<usize> {
+    (0..idx).rev().find(|&i| !is_trivia(tokens.token_at(i)))
+}
+
+pub(super) fn is_trivia(tok: Token) -> bool {
+    matches!(
+        tok,
+        Token::Space | Token::Tab | Token::NewLine | Token::BackSlash | Token::Comment(_)
+    )
+}
+
+/// Collects what a run of declarations (a whole header, or a single declaration)
+/// declares: macro names, tags, typedef names, enum constants, functions and variables
+fn collect_declared<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, names: &mut Names) {
+    let mut depth = 0usize;
+    let mut enum_body_depth = None;
+    let mut pending_enum = false;
+    let mut idx = 0;
+
+    while idx < tokens.len() {
+        let tok = tokens.token_at(idx);
+        match tok {
+            Token::HashTag => {
+                // `#define NAME`; skip the rest of any directive
+                let next = next_significant(tokens, idx);
+                if let Some(next) = next {
+                    if tokens.token_at(next) == Token::Object("define") {
+                        if let Some(name) = next_significant(tokens, next) {
+                            if let Token::Object(name) = tokens.token_at(name) {
+                                names.idents.insert(name.to_string());
+                            }
+                        }
+                    }
+                }
+                idx = skip_directive(tokens, idx);
+                continue;
+            }
+            Token::Object(kw @ ("struct" | "union" | "enum")) => {
+                // Only definitions (`struct X {`) and forward declarations (`struct X;`)
+                // declare a tag, `struct X *x` just refers to one
+                if let Some(next) = next_significant(tokens, idx) {
+                    if let Token::Object(tag) = tokens.token_at(next) {
+                        let after = next_significant(tokens, next).map(|i| tokens.token_at(i));
+                        if is_identifier(tag) && matches!(after, Some(Token::OpenCurlyBrace | Token::Semicolon)) {
+                            names.tags.insert((kw.to_string(), tag.to_string()));
+                        }
+                    }
+                }
+                pending_enum = kw == "enum";
+            }
+            Token::OpenCurlyBrace => {
+                depth += 1;
+                if pending_enum && enum_body_depth.is_none() {
+                    enum_body_depth = Some(depth);
+                }
+                pending_enum = false;
+            }
+            Token::CloseCurlyBrace => {
+                if enum_body_depth == Some(depth) {
+                    enum_body_depth = None;
+                }
+                depth = depth.saturating_sub(1);
+            }
+            Token::Semicolon => pending_enum = false,
+            Token::Object(name) if is_identifier(name) && !is_keyword(name) => {
+                let next = next_significant(tokens, idx).map(|i| tokens.token_at(i));
+                if enum_body_depth == Some(depth) {
+                    // Enum constants: `A,` `A = 1` `A }`
+                    let prev = prev_significant(tokens, idx).map(|i| tokens.token_at(i));
+                    if matches!(prev, Some(Token::OpenCurlyBrace | Token::Comma)) {
+                        names.idents.insert(name.to_string());
+                    }
+                } else if depth == 0 {
+                    // File scope declarators: functions, variables and typedef names
+                    let declarator = matches!(
+                        next,
+                        Some(Token::OpenParen | Token::Semicolon | Token::Comma
+                            | Token::OpenSquareBracket | Token::Equal | Token::CloseParen)
+                    );
+                    let prev = prev_significant(tokens, idx).map(|i| tokens.token_at(i));
+                    let after_type = matches!(
+                        prev,
+                        Some(Token::Object(_) | Token::Asterisk | Token::CloseCurlyBrace)
+                    );
+                    if declarator && after_type {
+                        names.idents.insert(name.to_string());
+                    }
+                }
+            }
+            _ => {}
+        }
+        idx += 1;
+    }
+}
+
+/// Returns the index just past a preprocessor directive starting at `idx` (a `#`),
+/// following `\` line continuations
+fn skip_directive<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, mut idx: usize) -> usize {
+    while idx < tokens.len() {
+        if tokens.token_at(idx) == Token::NewLine
+            && !(idx > 0 && tokens.token_at(idx - 1) == Token::BackSlash)
+        {
+            return idx + 1;
+        }
+        idx += 1;
+    }
+    idx
+}
+
+/// Names used by a `#define`: everything in its body other than its own parameters
+fn collect_define_uses<'a, T: TokenSource<'a> + ?Sized>(define: &T, uses: &mut Uses<'a>) {
+    let Some(hash) = (0..define.len()).find(|&i| define.token_at(i) == Token::HashTag) else {
+        return;
+    };
+    let Some(kw) = next_significant(define, hash) else {
+        return;
+    };
+    let Some(name) = next_significant(define, kw) else {
+        return;
+    };
+
+    let mut params = HashSet::new();
+    let mut body = name + 1;
+    // Function-like macros have their `(` right after the name
+    if name + 1 < define.len() && define.token_at(name + 1) == Token::OpenParen {
+        let mut i = name + 2;
+        while i < define.len() && define.token_at(i) != Token::CloseParen {
+            if let Token::Object(p) = define.token_at(i) {
+                params.insert(p);
+            }
+            i += 1;
+        }
+        body = i + 1;
+    }
+
+    let mut idx = body;
+    while idx < define.len() {
+        match define.token_at(idx) {
+            Token::Object(kw @ ("struct" | "union" | "enum")) => {
+                if let Some(next) = next_significant(define, idx) {
+                    if let Token::Object(tag) = define.token_at(next) {
+                        uses.tags.insert((kw, tag));
+                        idx = next;
+                    }
+                }
+            }
+            Token::Object(obj) if is_identifier(obj) && !params.contains(obj) => {
+                uses.idents.insert(obj);
+            }
+            _ => {}
+        }
+        idx += 1;
+    }
+}
+
+/// Names used by a prototype, UDT or function definition: the types and array sizes (and
+/// whatever a body uses), but not the names being declared (parameters, members, the
+/// function itself)
+fn collect_decl_uses<'a, T: TokenSource<'a> + ?Sized>(decl: &T, uses: &mut Uses<'a>) {
+    let mut idx = 0;
+    while idx < decl.len() {
+        match decl.token_at(idx) {
+            Token::Object(kw @ ("struct" | "union" | "enum")) => {
+                if let Some(next) = next_significant(decl, idx) {
+                    if let Token::Object(tag) = decl.token_at(next) {
+                        let after = next_significant(decl, next).map(|i| decl.token_at(i));
+                        match after {
+                            // A definition, not a use
+                            Some(Token::OpenCurlyBrace) => {}
+                            Some(Token::Asterisk) => {
+                                uses.pointer_tags.insert((kw, tag));
+                            }
+                            _ => {
+                                uses.tags.insert((kw, tag));
+                            }
+                        }
+                        idx = next;
+                    }
+                }
+            }
+            Token::Object(obj) if is_identifier(obj) && !is_keyword(obj) => {
+                let next = next_significant(decl, idx).map(|i| decl.token_at(i));
+                let prev = prev_significant(decl, idx).map(|i| decl.token_at(i));
+
+                // `T name;`, `T *name,`, `T name[N]`, `T name)`, `T name(`: declarators
+                // follow a type (an identifier, keyword or `*`). In a function body (a
+                // `static inline` definition) `return name(` is a call, not a declarator.
+                let after_type = match prev {
+                    Some(Token::Object(p)) => !matches!(p, "return" | "else" | "case" | "do" | "goto" | "sizeof"),
+                    Some(Token::Asterisk | Token::CloseCurlyBrace) => true,
+                    _ => false,
+                };
+                let declarator = matches!(
+                    next,
+                    Some(Token::Semicolon | Token::Comma | Token::CloseParen | Token::OpenParen
+                        | Token::OpenSquareBracket | Token::Colon | Token::Equal
+                        | Token::CloseCurlyBrace)
+                ) && after_type;
+
+                if !declarator {
+                    uses.idents.insert(obj);
+                }
+            }
+            _ => {}
+        }
+        idx += 1;
+    }
+}
+
+pub fn is_keyword(s: &str) -> bool {
+    matches!(
+        s,
+        "auto" | "break" | "case" | "char" | "const" | "continue" | "default" | "do"
+            | "double" | "else" | "enum" | "extern" | "float" | "for" | "goto" | "if"
+            | "inline" | "int" | "long" | "register" | "restrict" | "return" | "short"
+            | "signed" | "sizeof" | "static" | "struct" | "switch" | "typedef" | "union"
+            | "unsigned" | "void" | "volatile" | "while" | "_Bool" | "_Complex"
+            | "_Imaginary" | "_Alignas" | "_Alignof" | "_Atomic" | "_Generic" | "_Noreturn"
+            | "_Static_assert" | "_Thread_local" | "__attribute__" | "__inline"
+            | "__restrict" | "defined" | "__VA_ARGS__" | "__FILE__" | "__LINE__"
+            | "__func__"
+    )
+}
+
+/// What the common standard headers provide. Returns `None` for headers we don't know,
+/// which are then always kept.
+pub fn std_header_names(header: &str) -> Option<Names> {
+    let (idents, tags): (&[&str], &[&str]) = match header {
+        "stddef.h" => (
+            &["size_t", "ptrdiff_t", "wchar_t", "max_align_t", "NULL", "offsetof"],
+            &[],
+        ),
+        "stdint.h" => (STDINT, &[]),
+        "inttypes.h" => (STDINT, &[]),
+        "stdbool.h" => (&["bool", "true", "false"], &[]),
+        "stdarg.h" => (&["va_list", "va_start", "va_arg", "va_end", "va_copy"], &[]),
+        "stdio.h" => (
+            &[
+                "FILE", "fpos_t", "size_t", "NULL", "EOF", "BUFSIZ", "FILENAME_MAX",
+                "SEEK_SET", "SEEK_CUR", "SEEK_END", "stdin", "stdout", "stderr", "printf",
+                "fprintf", "sprintf", "snprintf", "vprintf", "vfprintf", "vsnprintf",
+                "puts", "fputs", "putchar", "fputc", "fopen", "fclose", "fread", "fwrite",
+                "fflush", "perror", "scanf", "sscanf", "fscanf", "fgets", "getchar",
+            ],
+            &[],
+        ),
+        "stdlib.h" => (
+            &[
+                "size_t", "NULL", "div_t", "ldiv_t", "lldiv_t", "EXIT_SUCCESS",
+                "EXIT_FAILURE", "RAND_MAX", "malloc", "calloc", "realloc", "free",
+                "abort", "exit", "atexit", "abs", "labs", "rand", "srand", "qsort",
+                "bsearch", "strtol", "strtoul", "strtoll", "strtoull", "strtod", "getenv",
+            ],
+            &[],
+        ),
+        "string.h" => (
+            &[
+                "size_t", "NULL", "memcpy", "memmove", "memset", "memcmp", "memchr",
+                "strlen", "strcmp", "strncmp", "strcpy", "strncpy", "strcat", "strncat",
+                "strchr", "strrchr", "strstr", "strdup", "strerror",
+            ],
+            &[],
+        ),
+        "time.h" => (
+            &["time_t", "clock_t", "size_t", "NULL", "CLOCKS_PER_SEC", "time", "clock"],
+            &["struct tm", "struct timespec"],
+        ),
+        "limits.h" => (
+            &[
+                "CHAR_BIT", "CHAR_MIN", "CHAR_MAX", "SCHAR_MIN", "SCHAR_MAX", "UCHAR_MAX",
+                "SHRT_MIN", "SHRT_MAX", "USHRT_MAX", "INT_MIN", "INT_MAX", "UINT_MAX",
+                "LONG_MIN", "LONG_MAX", "ULONG_MAX", "LLONG_MIN", "LLONG_MAX", "ULLONG_MAX",
+            ],
+            &[],
+        ),
+        "float.h" => (
+            &[
+                "FLT_MAX", "FLT_MIN", "FLT_EPSILON", "DBL_MAX", "DBL_MIN", "DBL_EPSILON",
+                "LDBL_MAX", "LDBL_MIN", "LDBL_EPSILON",
+            ],
+            &[],
+        ),
+        "math.h" => (
+            &[
+                "float_t", "double_t", "HUGE_VAL", "INFINITY", "NAN", "M_PI", "M_E",
+                "sqrt", "pow", "fabs", "floor", "ceil", "round", "fmin", "fmax", "sin",
+                "cos", "tan", "exp", "log", "isnan", "isinf",
+            ],
+            &[],
+        ),
+        "ctype.h" => (
+            &[
+                "isalpha", "isdigit", "isalnum", "isspace", "isupper", "islower",
+                "toupper", "tolower", "isprint", "ispunct", "isxdigit",
+            ],
+            &[],
+        ),
+        "assert.h" => (&["assert", "static_assert"], &[]),
+        "errno.h" => (&["errno", "EINVAL", "ENOMEM", "ERANGE", "EDOM", "EAGAIN", "ENOENT"], &[]),
+        "signal.h" => (&["sig_atomic_t", "SIGINT", "SIGTERM", "SIGSEGV", "signal", "raise"], &[]),
+        "setjmp.h" => (&["jmp_buf", "setjmp", "longjmp"], &[]),
+        "wchar.h" => (&["wchar_t", "wint_t", "mbstate_t", "size_t", "WEOF"], &[]),
+        "stdatomic.h" => (
+            &[
+                "atomic_bool", "atomic_int", "atomic_uint", "atomic_long", "atomic_ulong",
+                "atomic_size_t", "atomic_flag", "memory_order",
+            ],
+            &[],
+        ),
+        "pthread.h" => (
+            &[
+                "pthread_t", "pthread_attr_t", "pthread_mutex_t", "pthread_mutexattr_t",
+                "pthread_cond_t", "pthread_condattr_t", "pthread_rwlock_t", "pthread_key_t",
+                "pthread_once_t", "PTHREAD_MUTEX_INITIALIZER", "PTHREAD_COND_INITIALIZER",
+            ],
+            &[],
+        ),
+        "sys/types.h" => (
+            &["size_t", "ssize_t", "off_t", "pid_t", "mode_t", "uid_t", "gid_t", "dev_t", "ino_t"],
+            &[],
+        ),
+        "unistd.h" => (&["size_t", "ssize_t", "off_t", "pid_t", "NULL"], &[]),
+        _ => return None,
+    };
+
+    Some(Names {
+        idents: idents.iter().map(|s| s.to_string()).collect(),
+        tags: tags
+            .iter()
+            .map(|t| {
+                let (kw, tag) = t.split_once(' ').unwrap();
+                (kw.to_string(), tag.to_string())
+            })
+            .collect(),
+    })
+}
+
+const STDINT: &[&str] = &[
+    "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t",
+    "int_least8_t", "int_least16_t", "int_least32_t", "int_least64_t", "uint_least8_t",
+    "uint_least16_t", "uint_least32_t", "uint_least64_t", "int_fast8_t", "int_fast16_t",
+    "int_fast32_t", "int_fast64_t", "uint_fast8_t", "uint_fast16_t", "uint_fast32_t",
+    "uint_fast64_t", "intptr_t", "uintptr_t", "intmax_t", "uintmax_t", "INT8_MIN",
+    "INT8_MAX", "INT16_MIN", "INT16_MAX", "INT32_MIN", "INT32_MAX", "INT64_MIN", "INT64_MAX",
+    "UINT8_MAX", "UINT16_MAX", "UINT32_MAX", "UINT64_MAX", "SIZE_MAX", "INTPTR_MAX",
+    "UINTPTR_MAX", "PRId8", "PRId16", "PRId32", "PRId64", "PRIu8", "PRIu16", "PRIu32",
+    "PRIu64", "PRIx32", "PRIx64",
+];
+
+#[cfg(test)]
+mod includes_tests {
+    use super::*;
+
+    fn select(source: &str, resolve: &dyn Fn(&str) -> Option<String>) -> (Vec<String>, Vec<String>) {
+        let tokens = lexer_c::tokenize_compact(source).unwrap();
+        let decls = lexer_c::get_declarations(&tokens);
+        let selection = select_includes(
+            &tokens.views(&decls.includes),
+            &tokens.views(&decls.defines),
+            &tokens.views(&decls.udts),
+            &tokens.views(&decls.fn_defs),
+            resolve,
+        );
+        let includes = selection
+            .includes
+            .iter()
+            .map(|inc| inc.text(0..inc.len()).trim().to_string())
+            .collect();
+        (includes, selection.forward_decls)
+    }
+
+    #[test]
+    fn test_select_includes() {
+        let source = "#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n#include \"node.h\"\n#include <SDL2/SDL.h>\n\n\
+            typedef struct Buf {\n    uint8_t *data;\n    size_t len;\n} Buf;\n\n\
+            int buf_write(Buf *b, FILE *out, struct Node *n) {\n    memcpy(b->data, n, 1);\n    return 0;\n}\n";
+
+        let resolve = |path: &str| {
+            (path == "node.h").then(|| "struct Node { int x; };\nint node_count;\n".to_string())
+        };
+
+        let (includes, forward_decls) = select(source, &resolve);
+        assert_eq!(
+            includes,
+            ["#include <stdio.h>", "#include <stdint.h>", "#include <SDL2/SDL.h>"]
+        );
+        assert_eq!(forward_decls, ["struct Node;"]);
+
+        // A project header we can't read might provide anything
+        let (includes, _) = select(source, &|_| None);
+        assert!(includes.contains(&"#include \"node.h\"".to_string()));
+
+        // The standard header tables aren't complete: `wchar_t` comes from `<stdlib.h>` here
+        let source = "#include <stdio.h>\n#include <stdlib.h>\n\nwchar_t widen(char c) {\n    return c;\n}\n";
+        let (includes, _) = select(source, &|_| None);
+        assert_eq!(includes, ["#include <stdio.h>", "#include <stdlib.h>"]);
+    }
+}
@@ -0,0 +1,320 @@
+// Incremental re-lexing for long-running sessions (watch mode, editor integration),
+// where re-tokenizing a whole file after every keystroke would dominate the cost.
+// Nothing in the CLI feeds edits in yet.
+#![allow(dead_code)]
+
+use std::ops::Range;
+
+use anyhow::{anyhow, Result};
+
+use super::lexer_c::{
+    self, Declarations, DefineScanner, FnDefScanner, IncludeScanner, Scanner, Token, TokenBuffer, TokenSink,
+    TokenSource, UdtScanner,
+};
+
+/// A text edit: the bytes in `range` of the old source were replaced by `new_len` bytes
+#[derive(Debug, Clone, PartialEq)]
+pub struct TextEdit {
+    pub range: Range<usize>,
+    pub new_len: usize,
+}
+
+/// The tokens a re-lex replaced: `old` in the previous buffer became `new` in the new one.
+/// Both ranges start at the same index; tokens past them only moved.
+#[derive(Debug, Clone, PartialEq)]
+pub struct TokenEdit {
+    pub old: Range<usize>,
+    pub new: Range<usize>,
+}
+
+/// Updates `old` (the tokens of the previous source) for `new_src`, which is the previous
+/// source with `edit` applied, and returns the new tokens along with what changed.
+///
+/// Lexing restarts at the start of the line the edit begins on. A token boundary right
+/// after a newline is never inside a comment or literal, and the lexer carries no state
+/// across boundaries, so the tokens from there on are the same as a full `tokenize_compact`.
+/// It stops at the first boundary past the edit that was also a boundary in the old
+/// stream, since everything after it is unchanged apart from its offset.
+/// The token arrays of `old` are reused.
+pub fn relex<'b>(old: TokenBuffer<'_>, new_src: &'b str, edit: &TextEdit) -> Result<(TokenBuffer<'b>, TokenEdit)> {
+    let old_len = old.src.len();
+    if edit.range.start > edit.range.end
+        || edit.range.end > old_len
+        || old_len - edit.range.len() + edit.new_len != new_src.len()
+    {
+        return Err(anyhow!(
+            "Edit {:?} (+{} bytes) doesn't turn a {} byte source into a {} byte one",
+            edit.range,
+            edit.new_len,
+            old_len,
+            new_src.len()
+        ));
+    }
+    if new_src.len() > u32::MAX as usize {
+        return Err(anyhow!("Source file is too large to tokenize ({} bytes)", new_src.len()));
+    }
+
+    // Restart after the last newline token that lies entirely before the edit
+    let before_edit = old.starts.partition_point(|&s| (s as usize) < edit.range.start);
+    let first = (0..before_edit)
+        .rev()
+        .find(|&i| old.kinds[i] == b'\n')
+        .map_or(0, |i| i + 1);
+    let restart = if first == 0 { 0 } else { old.starts[first - 1] as usize + 1 };
+
+    let mut sink = RelexSink {
+        tokens: TokenBuffer {
+            src: new_src,
+            kinds: vec![],
+            starts: vec![],
+        },
+        old_starts: &old.starts,
+        old_idx: first,
+        unchanged_from: edit.range.start + edit.new_len,
+        delta: edit.new_len as isize - edit.range.len() as isize,
+        joined: None,
+    };
+    lexer_c::lex_from(new_src, restart, &mut sink)?;
+
+    let last = sink.joined.unwrap_or(old.starts.len());
+    let delta = sink.delta;
+    let relexed = sink.tokens;
+    let new_end = first + relexed.kinds.len();
+
+    let TokenBuffer { mut kinds, mut starts, .. } = old;
+    kinds.splice(first..last, relexed.kinds);
+    starts.splice(first..last, relexed.starts);
+    for start in &mut starts[new_end..] {
+        *start = (*start as isize + delta) as u32;
+    }
+
+    let tokens = TokenBuffer {
+        src: new_src,
+        kinds,
+        starts,
+    };
+    Ok((tokens, TokenEdit { old: first..last, new: first..new_end }))
+}
+
+/// Collects the re-lexed tokens and stops the lexer once it lines up with the old stream
+struct RelexSink<'o, 'b> {
+    tokens: TokenBuffer<'b>,
+    old_starts: &'o [u32],
+    old_idx: usize,
+    /// New offsets from here on hold the same bytes as the old source did (shifted by `delta`)
+    unchanged_from: usize,
+    delta: isize,
+    joined: Option<usize>,
+}
+
+impl<'o, 'b> TokenSink<'b> for RelexSink<'o, 'b> {
+    #[inline]
+    fn push_token(&mut self, tok: Token<'b>, start: usize) {
+        self.tokens.push_token(tok, start);
+    }
+
+    #[inline]
+    fn push_run(&mut self, tok: Token<'b>, start: usize, count: usize) {
+        self.tokens.push_run(tok, start, count);
+    }
+
+    fn stop_at(&mut self, offset: usize) -> bool {
+        if offset < self.unchanged_from {
+            return false;
+        }
+        let old_offset = (offset as isize - self.delta) as u32;
+        while self.old_idx < self.old_starts.len() && self.old_starts[self.old_idx] < old_offset {
+            self.old_idx += 1;
+        }
+        if self.old_starts.get(self.old_idx) == Some(&old_offset) {
+            self.joined = Some(self.old_idx);
+            return true;
+        }
+        false
+    }
+}
+
+// A scanner cursor is recorded about this often (in tokens), as a place to restart from
+const CHECKPOINT_INTERVAL: usize = 256;
+
+/// The `Declarations` of a token stream, kept up to date across `relex` edits.
+///
+/// Every scanner (functions, includes, defines, UDTs) is a cursor that hops through the
+/// tokens, and its position after each hop depends only on the tokens ahead of it. The
+/// index keeps a sparse list of positions each cursor visited (its checkpoints). After an
+/// edit, a scanner is restarted from its last checkpoint before the edit and run until it
+/// lands on one of its old checkpoints past the edit; from there on its old results are
+/// still valid (shifted), so only the declarations around the edit are scanned again.
+#[derive(Debug, Clone)]
+pub struct DeclarationIndex {
+    declarations: Declarations,
+    checkpoints: [Vec<usize>; 4],
+}
+
+impl DeclarationIndex {
+    pub fn new<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Self {
+        let (fn_defs, fn_checkpoints) = scan_range::<FnDefScanner, T>(tokens, 0, |_| false);
+        let (includes, include_checkpoints) = scan_range::<IncludeScanner, T>(tokens, 0, |_| false);
+        let (defines, define_checkpoints) = scan_range::<DefineScanner, T>(tokens, 0, |_| false);
+        let (udts, udt_checkpoints) = scan_range::<UdtScanner, T>(tokens, 0, |_| false);
+
+        Self {
+            declarations: Declarations {
+                fn_defs,
+                includes,
+                defines,
+                udts,
+            },
+            checkpoints: [fn_checkpoints, include_checkpoints, define_checkpoints, udt_checkpoints],
+        }
+    }
+
+    pub fn declarations(&self) -> &Declarations {
+        &self.declarations
+    }
+
+    /// Brings the index up to date with `tokens`, which `edit` (from `relex`) was applied to
+    pub fn update<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T, edit: &TokenEdit) {
+        let [fn_checkpoints, include_checkpoints, define_checkpoints, udt_checkpoints] = &mut self.checkpoints;
+        let decls = &mut self.declarations;
+        update_kind::<FnDefScanner, T>(tokens, edit, &mut decls.fn_defs, fn_checkpoints);
+        update_kind::<IncludeScanner, T>(tokens, edit, &mut decls.includes, include_checkpoints);
+        update_kind::<DefineScanner, T>(tokens, edit, &mut decls.defines, define_checkpoints);
+        update_kind::<UdtScanner, T>(tokens, edit, &mut decls.udts, udt_checkpoints);
+    }
+}
+
+/// Runs a scanner from `start` until it reaches the end of `tokens` or `stop` returns true
+/// for its cursor. Returns the spans it found and the checkpoints it recorded (always
+/// including `start`); a stopping position is not recorded.
+fn scan_range<'a, S: Scanner, T: TokenSource<'a> + ?Sized>(
+    tokens: &T,
+    start: usize,
+    mut stop: impl FnMut(usize) -> bool,
+) -> (Vec<Range<usize>>, Vec<usize>) {
+    let mut scanner = S::starting_at(start);
+    let mut checkpoints = vec![start];
+    while scanner.position(tokens).is_some() {
+        scanner.step(tokens);
+        let cursor = scanner.cursor();
+        if stop(cursor) {
+            break;
+        }
+        if cursor >= checkpoints.last().unwrap() + CHECKPOINT_INTERVAL {
+            checkpoints.push(cursor);
+        }
+    }
+    (scanner.into_spans(), checkpoints)
+}
+
+fn update_kind<'a, S: Scanner, T: TokenSource<'a> + ?Sized>(
+    tokens: &T,
+    edit: &TokenEdit,
+    spans: &mut Vec<Range<usize>>,
+    checkpoints: &mut Vec<usize>,
+) {
+    let shift = |idx: usize| idx + edit.new.end - edit.old.end;
+
+    // A scanner step can peek one token past where it leaves the cursor, so the restart
+    // point must be at least two tokens before the edit to have seen only unchanged tokens
+    let restart_before = edit.old.start.saturating_sub(1);
+    let restart_idx = checkpoints.partition_point(|&c| c < restart_before).saturating_sub(1);
+    let restart = checkpoints.get(restart_idx).copied().filter(|&c| c < restart_before).unwrap_or(0);
+
+    // Rejoin at an old checkpoint past the edit (everything from there on is unchanged)
+    let mut join = None;
+    let old_checkpoints = &checkpoints[..];
+    let (new_spans, new_checkpoints) = scan_range::<S, T>(tokens, restart, |cursor| {
+        if cursor < edit.new.end {
+            return false;
+        }
+        let old_cursor = cursor - edit.new.end + edit.old.end;
+        if old_checkpoints.binary_search(&old_cursor).is_ok() {
+            join = Some(old_cursor);
+            return true;
+        }
+        false
+    });
+
+    let (kept_spans, kept_checkpoints) = match join {
+        Some(old_join) => (
+            spans.partition_point(|s| s.start < old_join),
+            checkpoints.partition_point(|&c| c < old_join),
+        ),
+        None => (spans.len(), checkpoints.len()),
+    };
+
+    let tail_spans: Vec<_> = spans[kept_spans..].iter().map(|s| shift(s.start)..shift(s.end)).collect();
+    let tail_checkpoints: Vec<_> = checkpoints[kept_checkpoints..].iter().map(|&c| shift(c)).collect();
+
+    spans.truncate(spans.partition_point(|s| s.start < restart));
+    spans.extend(new_spans);
+    spans.extend(tail_spans);
+
+    checkpoints.truncate(checkpoints.partition_point(|&c| c < restart));
+    checkpoints.extend(new_checkpoints);
+    checkpoints.extend(tail_checkpoints);
+}
+
+#[cfg(test)]
+mod incremental_tests {
+    use std::fs;
+
+    use super::*;
+    use crate::header_gen::lexer_c::{get_declarations, tokenize_compact};
+
+    #[test]
+    fn test_relex_matches_full() {
+        let inserts = [
+            "x", " ", "\n", "\t", "int y;", "/* c */", "// line\n", "\"s\"", "#define Z 1\n",
+            "struct S { int a; };\n", "void f(int a) { return; }\n", "#include <stdio.h>\n",
+        ];
+
+        for path in ["tests/lexer-define.c", "tests/lexer-UDT.c"] {
+            let mut seed = 0x2545_f491_u64;
+            let mut rand = |n: usize| {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                (seed % n as u64) as usize
+            };
+
+            // Every version of the source has to outlive the buffer over it
+            let mut src: &'static str = fs::read_to_string(path).unwrap().leak();
+            let mut tokens = tokenize_compact(src).unwrap();
+            let mut index = DeclarationIndex::new(&tokens);
+
+            for _ in 0..300 {
+                let at = rand(src.len() + 1);
+                let (range, text) = if rand(3) == 0 {
+                    // Only delete plain words and spaces so braces stay balanced
+                    let len = src[at..].bytes().take_while(|b| b.is_ascii_alphanumeric() || *b == b' ').count();
+                    (at..(at + len.min(1 + rand(8))), "")
+                } else {
+                    (at..at, inserts[rand(inserts.len())])
+                };
+
+                let mut next_src = src.to_string();
+                next_src.replace_range(range.clone(), text);
+                let next_src: &'static str = next_src.leak();
+                let Ok(expected) = tokenize_compact(next_src) else {
+                    continue;
+                };
+
+                let edit = TextEdit {
+                    range,
+                    new_len: text.len(),
+                };
+                let (relexed, token_edit) = relex(tokens, next_src, &edit).unwrap();
+                assert_eq!(relexed.kinds, expected.kinds);
+                assert_eq!(relexed.starts, expected.starts);
+
+                index.update(&relexed, &token_edit);
+                assert_eq!(index.declarations(), &get_declarations(&expected));
+
+                src = next_src;
+                tokens = relexed;
+            }
+        }
+    }
+}
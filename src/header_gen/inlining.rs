@@ -0,0 +1,364 @@
+// Moves small functions into the generated header as `static inline` definitions.
+//
+// A prototype in the header means callers in other files can't inline the function
+// without LTO. With its body in the header as `static inline`, every file that includes
+// it can. This is opt-in: a function is moved when a comment right above it contains
+// `KILN_HEADER_INLINE`, or when its definition is at most `max_lines` lines long. The
+// body is compiled in every file including the header, so it can only use what the header
+// declares or includes: a function that uses the file-scope variables of its source file,
+// its `static` functions or the functions it only has a prototype for, or has `static`
+// locals of its own (which would get a copy per file), stays where it is.
+
+use std::ops::Range;
+
+use super::includes::is_trivia;
+use super::lexer_c::{self, Token, TokenBuffer, TokenSource};
+
+pub const INLINE_MARKER: &str = "KILN_HEADER_INLINE";
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct InlineOptions {
+    /// Move every function whose definition spans at most this many lines
+    pub max_lines: Option<usize>,
+}
+
+/// A function definition of the source that moves to the header
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Inlined {
+    /// Index of the definition in the source's `fn_defs`
+    pub fn_def: usize,
+    /// Tokens of the whole definition, from its first token through the closing brace
+    pub definition: Range<usize>,
+    /// Tokens to remove from the source: the definition and the marker comment, if any
+    pub remove: Range<usize>,
+}
+
+/// Picks the definitions in `fn_defs` (signature spans, as from `get_declarations`)
+/// that move to the header
+pub fn select<'a>(tokens: &TokenBuffer<'a>, fn_defs: &[Range<usize>], options: &InlineOptions) -> Vec<Inlined> {
+    let mut inlined = vec![];
+    let defined: Vec<_> = fn_defs.iter().filter_map(|span| lexer_c::get_fn_name(&tokens.view(span.clone()))).collect();
+    let file_scope = file_scope_names(tokens, &defined);
+    let (mut depth, mut scanned) = (0usize, 0);
+
+    for (i, span) in fn_defs.iter().enumerate() {
+        let Some(first) = span.clone().find(|&t| !is_trivia(tokens.token_at(t))) else {
+            continue;
+        };
+        // Only definitions at the top level, not something in a body that looks like one
+        for t in scanned..first.max(scanned) {
+            match tokens.token_at(t) {
+                Token::OpenCurlyBrace => depth += 1,
+                Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+                _ => {}
+            }
+        }
+        scanned = scanned.max(first);
+        if depth != 0 {
+            continue;
+        }
+        let Some(close) = matching_brace(tokens, span.end) else {
+            continue;
+        };
+        let needs_source = (first..close).any(|t| match tokens.token_at(t) {
+            Token::Object("static") => true,
+            Token::Object(name) => file_scope.contains(&name) && !is_member(tokens, t),
+            _ => false,
+        });
+        if needs_source {
+            continue;
+        }
+
+        // Comments between the previous declaration and this one
+        let marker = (0..first)
+            .rev()
+            .take_while(|&t| is_trivia(tokens.token_at(t)))
+            .find(|&t| matches!(tokens.token_at(t), Token::Comment(c) if c.contains(INLINE_MARKER)));
+
+        let definition = first..close + 1;
+        let text = &tokens.src()[tokens.byte_range(definition.clone())];
+        let small = options.max_lines.is_some_and(|max| text.lines().count() <= max);
+
+        if marker.is_some() || small {
+            inlined.push(Inlined {
+                fn_def: i,
+                definition,
+                remove: marker.unwrap_or(first)..close + 1,
+            });
+        }
+    }
+
+    inlined
+}
+
+/// The `static inline` definitions in a generated header, from `static` through the
+/// closing brace
+pub fn header_definitions<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Vec<Range<usize>> {
+    let mut defs = vec![];
+    let mut depth = 0usize;
+    let mut idx = 0;
+
+    while idx < tokens.len() {
+        match tokens.token_at(idx) {
+            Token::OpenCurlyBrace => depth += 1,
+            Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+            Token::Object("static") if depth == 0 => {
+                let next = (idx + 1..tokens.len()).find(|&t| !is_trivia(tokens.token_at(t)));
+                let body = (idx + 1..tokens.len())
+                    .find(|&t| matches!(tokens.token_at(t), Token::OpenCurlyBrace | Token::Semicolon | Token::Equal));
+
+                if let (Some(next), Some(body)) = (next, body) {
+                    if tokens.token_at(next) == Token::Object("inline") && tokens.token_at(body) == Token::OpenCurlyBrace {
+                        if let Some(close) = matching_brace(tokens, body) {
+                            defs.push(idx..close + 1);
+                            idx = close + 1;
+                            continue;
+                        }
+                    }
+                }
+            }
+            _ => {}
+        }
+        idx += 1;
+    }
+
+    defs
+}
+
+/// The header text of a moved definition: `static inline` followed by the definition
+/// without its own `inline`/`extern`
+pub fn static_inline_text<'a, T: TokenSource<'a> + ?Sized>(definition: &T) -> String {
+    let mut text = String::from("static inline ");
+    let mut skip_space = false;
+
+    for i in 0..definition.len() {
+        let tok = definition.token_at(i);
+        if matches!(tok, Token::Object("inline" | "extern")) {
+            skip_space = true;
+            continue;
+        }
+        if skip_space && matches!(tok, Token::Space | Token::Tab) {
+            continue;
+        }
+        skip_space = false;
+        text.push_str(&definition.text(i..i + 1));
+    }
+
+    text
+}
+
+/// Names declared at the top level that the header doesn't declare: the file's variables,
+/// its `static` functions and prototypes of functions that aren't in `defined` (the
+/// non-static definitions, which the header declares), and typedefs of other types.
+/// Macros and struct, union and enum definitions go to the header.
+fn file_scope_names<'a>(tokens: &TokenBuffer<'a>, defined: &[&'a str]) -> Vec<&'a str> {
+    let mut names = vec![];
+    let mut depth = 0usize;
+    let mut idx = 0;
+
+    while idx < tokens.len() {
+        match tokens.token_at(idx) {
+            Token::OpenCurlyBrace => depth += 1,
+            Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+            // A directive runs to the end of its line, unless the line ends with `\`
+            Token::HashTag if depth == 0 => {
+                while idx < tokens.len()
+                    && (tokens.token_at(idx) != Token::NewLine || tokens.token_at(idx - 1) == Token::BackSlash)
+                {
+                    idx += 1;
+                }
+                continue;
+            }
+            // Only the typedefs of a struct, union or enum body go to the header
+            Token::Object("typedef") if depth == 0 => {
+                let mut declared = vec![];
+                let end = declaration(tokens, idx + 1, &mut declared);
+                if !(idx..end).any(|t| tokens.token_at(t) == Token::OpenCurlyBrace) {
+                    names.extend(declared);
+                }
+                idx = end;
+                continue;
+            }
+            tok if depth == 0 && !is_trivia(tok) && tok != Token::Semicolon => {
+                idx = declaration(tokens, idx, &mut names);
+                continue;
+            }
+            _ => {}
+        }
+        idx += 1;
+    }
+    names.retain(|name| !defined.contains(name));
+    names
+}
+
+/// Adds the names declared by the declaration at `start` to `names`, and returns where it
+/// ends: after its `;`, or at the body of a function definition
+fn declaration<'a>(tokens: &TokenBuffer<'a>, start: usize, names: &mut Vec<&'a str>) -> usize {
+    // Nesting of `(`/`[`/`{` inside the declaration, and whether an initializer is being skipped
+    let (mut nesting, mut initializer) = (0usize, false);
+    let mut prev = None;
+
+    for idx in start..tokens.len() {
+        let tok = tokens.token_at(idx);
+        if is_trivia(tok) {
+            continue;
+        }
+        if let (Some(Token::Object(name)), 0, false) = (prev, nesting, initializer) {
+            let declares = matches!(
+                tok,
+                Token::OpenParen | Token::OpenSquareBracket | Token::Equal | Token::Semicolon | Token::Comma
+            );
+            if declares && name.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_') {
+                names.push(name);
+            }
+        }
+        match tok {
+            Token::OpenCurlyBrace if nesting == 0 && prev == Some(Token::CloseParen) => return idx,
+            Token::OpenParen | Token::OpenSquareBracket | Token::OpenCurlyBrace => nesting += 1,
+            Token::CloseParen | Token::CloseSquareBracket | Token::CloseCurlyBrace => nesting = nesting.saturating_sub(1),
+            Token::Semicolon if nesting == 0 => return idx + 1,
+            Token::Comma if nesting == 0 => initializer = false,
+            Token::Equal if nesting == 0 => initializer = true,
+            _ => {}
+        }
+        prev = Some(tok);
+    }
+    tokens.len()
+}
+
+/// Whether the name at `idx` is a member access (`a.name`, `a->name`)
+fn is_member<'a>(tokens: &TokenBuffer<'a>, idx: usize) -> bool {
+    let prev = (0..idx).rev().find(|&t| !is_trivia(tokens.token_at(t)));
+    match prev.map(|t| tokens.token_at(t)) {
+        Some(Token::Period) => true,
+        Some(Token::GreaterThan) => prev.is_some_and(|t| t > 0 && tokens.token_at(t - 1) == Token::Minus),
+        _ => false,
+    }
+}
+
+/// Index of the `}` closing the `{` at `open`
+fn matching_brace<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, open: usize) -> Option<usize> {
+    if open >= tokens.len() || tokens.token_at(open) != Token::OpenCurlyBrace {
+        return None;
+    }
+    let mut depth = 0usize;
+    for i in open..tokens.len() {
+        match tokens.token_at(i) {
+            Token::OpenCurlyBrace => depth += 1,
+            Token::CloseCurlyBrace => {
+                depth -= 1;
+                if depth == 0 {
+                    return Some(i);
+                }
+            }
+            _ => {}
+        }
+    }
+    None
+}
+
+#[cfg(test)]
+mod inlining_tests {
+    use super::super::generate;
+    use super::*;
+
+    #[test]
+    fn test_moves_bodies_to_header() {
+        let code = "#include <string.h>\n\n\
+                    // KILN_HEADER_INLINE\n\
+                    inline int vec_len(const char *s) {\n    return strlen(s);\n}\n\n\
+                    int twice(int x) { return x * 2; }\n\n\
+                    int big(int x) {\n    int y = x;\n    y += 1;\n    return y;\n}\n";
+
+        let by_marker = generate("vec", code, "", &|_| None, &InlineOptions::default()).unwrap();
+        assert!(by_marker.header.contains("static inline int vec_len(const char *s) {\n    return strlen(s);\n}"));
+        assert!(by_marker.header.contains("#include <string.h>"));
+        assert!(by_marker.header.contains("int twice(int x);"));
+        assert!(!by_marker.source.contains("vec_len") && !by_marker.source.contains(INLINE_MARKER));
+
+        let options = InlineOptions { max_lines: Some(3) };
+        let by_size = generate("vec", code, "", &|_| None, &options).unwrap();
+        assert!(by_size.header.contains("static inline int twice(int x) { return x * 2; }"));
+        assert!(by_size.header.contains("int big(int x);"));
+        assert!(by_size.source.contains("int big(int x) {") && !by_size.source.contains("twice"));
+
+        // The moved bodies survive regenerating from the new source and header
+        let again = generate("vec", &by_size.source, &by_size.header, &|_| None, &options).unwrap();
+        assert_eq!(again, by_size);
+    }
+
+    #[test]
+    fn test_keeps_what_needs_its_source_file() {
+        let code = "static int counter = 0, limit;\n\
+                    static const char *names[] = { \"a\", \"b\" };\n\
+                    static int helper(int x) { return x + 1; }\n\n\
+                    int kind(int x) {\n    switch (x) {\n    case 0: return 1;\n    }\n    \
+                    FOR_EACH(item, list) { x++; }\n    return 0;\n}\n\n\
+                    int bump(void) { return ++counter; }\n\
+                    int first(void) { return names[0][0]; }\n\
+                    int next(int x) { return helper(x); }\n\
+                    typedef int count_t;\n\
+                    count_t step(count_t x) { return x + 1; }\n\
+                    int field(struct P *p) { return p->limit; }\n\
+                    int once(void) { static int n; return n++; }\n";
+
+        let options = InlineOptions { max_lines: Some(3) };
+        let generated = generate("vec", code, "", &|_| None, &options).unwrap();
+        // Blocks in a body aren't definitions, they stay in their function
+        assert!(!generated.header.contains("switch") && generated.source.contains("switch (x) {"));
+        assert!(!generated.header.contains("{ x++; }") && generated.source.contains("FOR_EACH(item, list) { x++; }"));
+        assert!(generated.header.contains("int kind(int x);"));
+        // File statics (even as a member name elsewhere) and static locals keep a function in its file
+        for name in ["bump", "first", "next", "once"] {
+            assert!(generated.header.contains(&format!("int {}(", name)), "{}", name);
+            assert!(!generated.header.contains(&format!("static inline int {}(", name)), "{}", name);
+            assert!(generated.source.contains(&format!("int {}(", name)), "{}", name);
+        }
+        assert!(generated.header.contains("static inline int field(struct P *p) { return p->limit; }"));
+        // A typedef that stays in the source
+        assert!(!generated.header.contains("static inline count_t step("));
+    }
+
+    #[test]
+    fn test_moved_bodies_compile() {
+        let code = "#define STEP 2\n\n\
+                    typedef struct { int x; } point_t;\n\
+                    int counter = 0;\n\
+                    extern int total;\n\
+                    int elsewhere(int x);\n\n\
+                    int bump(void) { return ++counter; }\n\
+                    int add(int x) { return total + x; }\n\
+                    int call(int x) { return elsewhere(x); }\n\
+                    int twice(int x) { return x * STEP; }\n\
+                    int norm(point_t p) { return p.x * STEP; }\n";
+
+        let options = InlineOptions { max_lines: Some(3) };
+        let generated = generate("vec", code, "", &|_| None, &options).unwrap();
+        // Globals and functions the header doesn't declare keep a function in its file
+        for name in ["bump", "add", "call"] {
+            assert!(!generated.header.contains(&format!("static inline int {}(", name)), "{}", name);
+        }
+        assert!(generated.header.contains("static inline int norm(point_t p)"));
+
+        // Only where there's a C compiler
+        let Ok(dir) = tempfile::tempdir() else {
+            return;
+        };
+        if std::process::Command::new("cc").arg("--version").output().is_err() {
+            return;
+        }
+        let (include, src) = (dir.path().join("include"), dir.path().join("src"));
+        std::fs::create_dir_all(&include).unwrap();
+        std::fs::create_dir_all(&src).unwrap();
+        std::fs::write(include.join("vec.h"), &generated.header).unwrap();
+        std::fs::write(src.join("vec.c"), &generated.source).unwrap();
+        let user = "#include \"../include/vec.h\"\nint use(point_t p) { return norm(p) + twice(bump()); }\n";
+        std::fs::write(src.join("user.c"), user).unwrap();
+        let output = std::process::Command::new("cc")
+            .args(["-fsyntax-only", "-Werror=implicit-function-declaration", "vec.c", "user.c"])
+            .current_dir(&src)
+            .output()
+            .unwrap();
+        assert!(output.status.success(), "{}", String::from_utf8_lossy(&output.stderr));
+    }
+}
@@ -1,7 +1,10 @@
-use std::collections::HashMap;
+use std::borrow::Cow;
+use std::ops::Range;
 
 use anyhow::{anyhow, Result};
 
+use super::scan;
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 pub enum Token<'a> {
     Object(&'a str),
@@ -42,69 +45,647 @@ pub enum Token<'a> {
 }
 
 impl<'a> Token<'a> {
+    /// The ascii character of a single byte token. `None` for objects, literals and comments
+    pub fn symbol_byte(&self) -> Option<u8> {
+        let byte = match self {
+            Token::Object(_) | Token::Literal(_) | Token::Comment(_) => return None,
+            Token::HashTag => b'#',
+            Token::GreaterThan => b'>',
+            Token::LessThan => b'<',
+            Token::Equal => b'=',
+            Token::Exclamation => b'!',
+            Token::Period => b'.',
+            Token::OpenParen => b'(',
+            Token::CloseParen => b')',
+            Token::OpenCurlyBrace => b'{',
+            Token::CloseCurlyBrace => b'}',
+            Token::OpenSquareBracket => b'[',
+            Token::CloseSquareBracket => b']',
+            Token::Semicolon => b';',
+            Token::Comma => b',',
+            Token::Asterisk => b'*',
+            Token::Plus => b'+',
+            Token::Minus => b'-',
+            Token::ForwardSlash => b'/',
+            Token::BackSlash => b'\\',
+            Token::Pipe => b'|',
+            Token::Ampersand => b'&',
+            Token::ModOperator => b'%',
+            Token::Carrot => b'^',
+            Token::Colon => b':',
+            Token::At => b'@',
+            Token::DollarSign => b'$',
+            Token::Tilda => b'~',
+            Token::Tick => b'`',
+            Token::QuestionMark => b'?',
+            Token::NewLine => b'\n',
+            Token::Space => b' ',
+            Token::Tab => b'\t',
+        };
+        Some(byte)
+    }
+
+    #[cfg(test)]
     pub fn tokens_to_string(tokens: &[Token]) -> String {
-        let mut string = String::new();
+        let len = tokens.iter().map(|t| t.text_len()).sum();
+        let mut string = String::with_capacity(len);
 
         for &t in tokens.iter() {
-            if let Token::Object(s) = t {
-                string.push_str(s);
-            }
-            else if let Token::Literal(s) = t {
-                string.push_str(s);
+            push_token_str(&mut string, t);
+        }
+        string
+    }
+
+    /// Length in bytes of the source text this token was lexed from
+    #[inline]
+    #[cfg(test)]
+    fn text_len(&self) -> usize {
+        match self {
+            Token::Object(s) | Token::Literal(s) | Token::Comment(s) => s.len(),
+            _ => 1,
+        }
+    }
+}
+
+#[inline]
+fn push_token_str(string: &mut String, tok: Token) {
+    match tok {
+        Token::Object(s) | Token::Literal(s) | Token::Comment(s) => string.push_str(s),
+        _ => string.push(tok.symbol_byte().unwrap() as char),
+    }
+}
+
+/// Random access to a token stream. Implemented by plain token slices and by the
+/// compact `TokenBuffer`, so the extractors below work on either.
+pub trait TokenSource<'a> {
+    fn len(&self) -> usize;
+
+    fn token_at(&self, idx: usize) -> Token<'a>;
+
+    /// The source text covered by the tokens in `range`
+    fn text(&self, range: Range<usize>) -> Cow<'a, str> {
+        let mut string = String::new();
+        for i in range {
+            push_token_str(&mut string, self.token_at(i));
+        }
+        Cow::Owned(string)
+    }
+}
+
+impl<'a, T: TokenSource<'a> + ?Sized> TokenSource<'a> for &T {
+    #[inline]
+    fn len(&self) -> usize {
+        (**self).len()
+    }
+
+    #[inline]
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        (**self).token_at(idx)
+    }
+
+    fn text(&self, range: Range<usize>) -> Cow<'a, str> {
+        (**self).text(range)
+    }
+}
+
+impl<'a> TokenSource<'a> for [Token<'a>] {
+    #[inline]
+    fn len(&self) -> usize {
+        <[Token]>::len(self)
+    }
+
+    #[inline]
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        self[idx]
+    }
+}
+
+// Token kinds in a `TokenBuffer`. Single byte tokens are stored as their ascii
+// code, which never collides with these.
+const KIND_OBJECT: u8 = 0;
+const KIND_LITERAL: u8 = 1;
+const KIND_COMMENT: u8 = 2;
+
+/// Struct-of-arrays token stream: one kind byte and one `u32` start offset per token
+/// (5 bytes, against 24 for a `Token`). Token lengths aren't stored because tokens
+/// tile the source, so each token ends where the next one starts.
+#[derive(Debug, Clone)]
+pub struct TokenBuffer<'a> {
+    pub(super) src: &'a str,
+    pub(super) kinds: Vec<u8>,
+    pub(super) starts: Vec<u32>,
+}
+
+impl<'a> TokenBuffer<'a> {
+    pub fn new(src: &'a str) -> Self {
+        Self::with_arrays(src, Vec::new(), Vec::new())
+    }
+
+    /// An empty buffer over `src` that stores its tokens in the (cleared) arrays of a
+    /// previous buffer, so their allocations are reused
+    pub(super) fn with_arrays(src: &'a str, mut kinds: Vec<u8>, mut starts: Vec<u32>) -> Self {
+        // C averages a little over 3 bytes per token, so this rarely reallocates
+        let capacity = src.len() / 3 + 16;
+        kinds.clear();
+        starts.clear();
+        kinds.reserve(capacity);
+        starts.reserve(capacity);
+        Self { src, kinds, starts }
+    }
+
+    /// Hands back the token arrays for reuse
+    pub(super) fn into_arrays(self) -> (Vec<u8>, Vec<u32>) {
+        (self.kinds, self.starts)
+    }
+
+    pub fn src(&self) -> &'a str {
+        self.src
+    }
+
+    pub fn len(&self) -> usize {
+        self.kinds.len()
+    }
+
+    /// Byte range of token `idx` in the source
+    #[inline]
+    pub fn span(&self, idx: usize) -> Range<usize> {
+        let end = match self.starts.get(idx + 1) {
+            Some(&end) => end as usize,
+            None => self.src.len(),
+        };
+        (self.starts[idx] as usize)..end
+    }
+
+    /// Byte range in the source covered by the tokens in `range`
+    pub fn byte_range(&self, range: Range<usize>) -> Range<usize> {
+        if range.start >= range.end {
+            let at = self.starts.get(range.start).map_or(self.src.len(), |&s| s as usize);
+            return at..at;
+        }
+        (self.starts[range.start] as usize)..self.span(range.end - 1).end
+    }
+
+    /// A window over the tokens in `range`, indexed from 0 like a slice would be
+    pub fn view(&self, range: Range<usize>) -> TokenView<'_, 'a> {
+        assert!(range.start <= range.end && range.end <= self.len());
+        TokenView {
+            buf: self,
+            start: range.start,
+            end: range.end,
+        }
+    }
+
+    /// One view per token range, typically the output of one of the `get_*_spans` functions
+    pub fn views(&self, spans: &[Range<usize>]) -> Vec<TokenView<'_, 'a>> {
+        spans.iter().map(|r| self.view(r.clone())).collect()
+    }
+
+    /// Bytes of heap memory held by the token arrays
+    #[cfg(test)]
+    pub fn heap_size(&self) -> usize {
+        self.kinds.capacity() * std::mem::size_of::<u8>()
+            + self.starts.capacity() * std::mem::size_of::<u32>()
+    }
+}
+
+impl<'a> TokenSource<'a> for TokenBuffer<'a> {
+    #[inline]
+    fn len(&self) -> usize {
+        self.kinds.len()
+    }
+
+    #[inline]
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        match self.kinds[idx] {
+            KIND_OBJECT => Token::Object(self.text_of(idx)),
+            KIND_LITERAL => Token::Literal(self.text_of(idx)),
+            KIND_COMMENT => Token::Comment(self.text_of(idx)),
+            byte => TOKEN_MAPPING[byte as usize].unwrap(),
+        }
+    }
+
+    /// Zero-copy: the tokens are contiguous in the source
+    fn text(&self, range: Range<usize>) -> Cow<'a, str> {
+        Cow::Borrowed(&self.src[self.byte_range(range)])
+    }
+}
+
+impl<'a> TokenBuffer<'a> {
+    #[inline]
+    fn text_of(&self, idx: usize) -> &'a str {
+        let span = self.span(idx);
+        token_str(self.src, span.start, span.end)
+    }
+}
+
+impl<'a> TokenSink<'a> for TokenBuffer<'a> {
+    #[inline]
+    fn push_token(&mut self, tok: Token<'a>, start: usize) {
+        let kind = match tok {
+            Token::Object(_) => KIND_OBJECT,
+            Token::Literal(_) => KIND_LITERAL,
+            Token::Comment(_) => KIND_COMMENT,
+            _ => tok.symbol_byte().unwrap(),
+        };
+        self.kinds.push(kind);
+        self.starts.push(start as u32);
+    }
+
+    #[inline]
+    fn push_run(&mut self, tok: Token<'a>, start: usize, count: usize) {
+        let kind = tok.symbol_byte().unwrap();
+        self.kinds.extend(std::iter::repeat(kind).take(count));
+        self.starts.extend((start as u32)..((start + count) as u32));
+    }
+}
+
+/// A sub-range of a `TokenBuffer`. See `TokenBuffer::view`
+#[derive(Debug, Clone, Copy)]
+pub struct TokenView<'t, 'a> {
+    buf: &'t TokenBuffer<'a>,
+    start: usize,
+    end: usize,
+}
+
+impl<'t, 'a> TokenView<'t, 'a> {
+    /// Byte range in the source covered by this view
+    pub fn byte_range(&self) -> Range<usize> {
+        self.buf.byte_range(self.start..self.end)
+    }
+
+    /// The token index range this view covers in its buffer
+    pub fn token_range(&self) -> Range<usize> {
+        self.start..self.end
+    }
+}
+
+impl<'t, 'a> TokenSource<'a> for TokenView<'t, 'a> {
+    #[inline]
+    fn len(&self) -> usize {
+        self.end - self.start
+    }
+
+    #[inline]
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        assert!(idx < self.len(), "token index {} out of range for view of length {}", idx, self.len());
+        self.buf.token_at(self.start + idx)
+    }
+
+    fn text(&self, range: Range<usize>) -> Cow<'a, str> {
+        assert!(range.end <= self.len());
+        self.buf.text((self.start + range.start)..(self.start + range.end))
+    }
+}
+
+/// Tokenizes `code` into a compact `TokenBuffer`
+pub fn tokenize_compact(code: &str) -> Result<TokenBuffer<'_>> {
+    tokenize_into(TokenBuffer::new(code))
+}
+
+/// Lexes the source of an empty `tokens` into it
+pub(super) fn tokenize_into(mut tokens: TokenBuffer<'_>) -> Result<TokenBuffer<'_>> {
+    let code = tokens.src;
+    if code.len() > u32::MAX as usize {
+        return Err(anyhow!("Source file is too large to tokenize ({} bytes)", code.len()));
+    }
+
+    let pieces = parallel_pieces(code.len());
+    if pieces > 1 {
+        return tokenize_parallel_into(tokens, pieces);
+    }
+
+    lex(code, &mut tokens)?;
+    Ok(tokens)
+}
+
+/// Inputs are lexed in parallel once each thread gets at least this many bytes
+pub const PARALLEL_LEX_PIECE: usize = 2 << 20;
+
+fn parallel_pieces(len: usize) -> usize {
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    threads.min(len / PARALLEL_LEX_PIECE).max(1)
+}
+
+/// Same as `tokenize_compact`, but splits the input into `pieces` at newlines and lexes
+/// them on as many threads.
+///
+/// Each piece is lexed on the guess that it starts at a token boundary, which a newline
+/// byte only fails to be inside a block comment. The guesses are checked in order: a piece
+/// is right when the piece before it (as corrected) stops exactly where it starts.
+/// Otherwise its real first token starts where the previous piece stopped, and as the
+/// lexer carries no state between tokens, the guess is right from the first token they
+/// agree on. Only a piece with no such token (or that failed before it) is lexed again.
+#[allow(unused)]
+pub fn tokenize_parallel(code: &str, pieces: usize) -> Result<TokenBuffer<'_>> {
+    if code.len() > u32::MAX as usize {
+        return Err(anyhow!("Source file is too large to tokenize ({} bytes)", code.len()));
+    }
+    tokenize_parallel_into(TokenBuffer::new(code), pieces)
+}
+
+fn tokenize_parallel_into(mut tokens: TokenBuffer<'_>, pieces: usize) -> Result<TokenBuffer<'_>> {
+    let code = tokens.src;
+    if pieces <= 1 {
+        lex(code, &mut tokens)?;
+        return Ok(tokens);
+    }
+
+    let mut bounds = vec![0];
+    for k in 1..pieces {
+        let from = (code.len() / pieces * k).max(*bounds.last().unwrap());
+        match scan::find_byte(code.as_bytes(), from, b'\n') {
+            Some(nl) if nl + 1 < code.len() => bounds.push(nl + 1),
+            _ => break,
+        }
+    }
+    bounds.dedup();
+    bounds.push(code.len());
+
+    let guesses: Vec<LexedPiece> = std::thread::scope(|s| {
+        let handles: Vec<_> = bounds
+            .windows(2)
+            .map(|w| s.spawn(move || LexedPiece::lex(code, w[0], w[1])))
+            .collect();
+        handles.into_iter().map(|h| h.join().unwrap()).collect()
+    });
+
+    let mut lexed = Vec::with_capacity(guesses.len());
+    let mut next = 0;
+    for (guess, piece) in guesses.into_iter().zip(bounds.windows(2)) {
+        let piece = if next == piece[0] {
+            guess
+        } else {
+            // The last token of the previous piece (a block comment) ran into this one
+            match guess.tokens.starts.binary_search(&(next as u32)) {
+                Ok(first) => guess.from_token(first),
+                Err(_) => LexedPiece::lex(code, next, piece[1]),
             }
-            else if let Token::Comment(c) = t {
-                string.push_str(c);
-            } 
-            else {
-                for i in 0..TOKEN_MAPPING.len() {
-                    if let Some(c) = TOKEN_MAPPING[i] {
-                        if c == t {
-                            string.push((i as u8) as char);
-                        }
-                    }
+        };
+
+        if let Some(e) = piece.error {
+            return Err(e);
+        }
+        next = piece.next;
+        lexed.push(piece.tokens);
+    }
+
+    // Copying the pieces together costs about as much as lexing them, so that's split
+    // across the threads too
+    let total = lexed.iter().map(|t| t.len()).sum();
+    tokens.kinds.clear();
+    tokens.kinds.resize(total, 0);
+    tokens.starts.clear();
+    tokens.starts.resize(total, 0);
+    std::thread::scope(|s| {
+        let (mut kinds, mut starts) = (&mut tokens.kinds[..], &mut tokens.starts[..]);
+        for piece in &lexed {
+            let (piece_kinds, rest_kinds) = std::mem::take(&mut kinds).split_at_mut(piece.len());
+            let (piece_starts, rest_starts) = std::mem::take(&mut starts).split_at_mut(piece.len());
+            (kinds, starts) = (rest_kinds, rest_starts);
+            s.spawn(move || {
+                piece_kinds.copy_from_slice(&piece.kinds);
+                piece_starts.copy_from_slice(&piece.starts);
+            });
+        }
+    });
+
+    Ok(tokens)
+}
+
+/// The tokens starting in one piece of the input, where lexing stopped (the end of the
+/// last of them) and the error it stopped on, if any
+struct LexedPiece<'a> {
+    tokens: TokenBuffer<'a>,
+    next: usize,
+    error: Option<anyhow::Error>,
+}
+
+impl<'a> LexedPiece<'a> {
+    /// Lexes the tokens of `code` that start in `start..end`, as if `start` was a token
+    /// boundary
+    fn lex(code: &'a str, start: usize, end: usize) -> Self {
+        let capacity = end.saturating_sub(start) / 3 + 16;
+        let mut sink = PieceSink {
+            tokens: TokenBuffer {
+                src: code,
+                kinds: Vec::with_capacity(capacity),
+                starts: Vec::with_capacity(capacity),
+            },
+            end,
+            stopped: None,
+        };
+        let error = lex_from(code, start, &mut sink).err();
+
+        Self {
+            tokens: sink.tokens,
+            next: sink.stopped.unwrap_or(code.len()),
+            error,
+        }
+    }
+
+    /// The same piece without the tokens before `first`
+    fn from_token(mut self, first: usize) -> Self {
+        self.tokens.kinds.drain(..first);
+        self.tokens.starts.drain(..first);
+        self
+    }
+}
+
+struct PieceSink<'a> {
+    tokens: TokenBuffer<'a>,
+    end: usize,
+    stopped: Option<usize>,
+}
+
+impl<'a> TokenSink<'a> for PieceSink<'a> {
+    #[inline]
+    fn push_token(&mut self, tok: Token<'a>, start: usize) {
+        self.tokens.push_token(tok, start);
+    }
+
+    #[inline]
+    fn push_run(&mut self, tok: Token<'a>, start: usize, count: usize) {
+        self.tokens.push_run(tok, start, count);
+    }
+
+    #[inline]
+    fn stop_at(&mut self, offset: usize) -> bool {
+        if offset >= self.end {
+            self.stopped = Some(offset);
+            return true;
+        }
+        false
+    }
+}
+
+/// Receives tokens from the lexer as they're recognized, along with the byte offset
+/// each one starts at
+pub trait TokenSink<'a> {
+    fn push_token(&mut self, tok: Token<'a>, start: usize);
+
+    /// Pushes `count` consecutive copies of a single byte token (whitespace runs)
+    #[inline]
+    fn push_run(&mut self, tok: Token<'a>, start: usize, count: usize) {
+        for i in 0..count {
+            self.push_token(tok, start + i);
+        }
+    }
+
+    /// Called before each token with the offset it would start at. Returning true
+    /// stops the lexer there, which lets an incremental re-lex end early.
+    #[inline]
+    fn stop_at(&mut self, _offset: usize) -> bool {
+        false
+    }
+}
+
+impl<'a> TokenSink<'a> for Vec<Token<'a>> {
+    #[inline]
+    fn push_token(&mut self, tok: Token<'a>, _start: usize) {
+        self.push(tok);
+    }
+
+    #[inline]
+    fn push_run(&mut self, tok: Token<'a>, _start: usize, count: usize) {
+        self.extend(std::iter::repeat(tok).take(count));
+    }
+}
+
+/// Tokenizes `code` into a `Vec`, to check the other tokenizers against
+#[cfg(test)]
+pub fn tokenize(code: &str) -> Result<Vec<Token<'_>>> {
+    let mut tokens = Vec::with_capacity(4096);
+    lex(code, &mut tokens)?;
+    Ok(tokens)
+}
+
+/// Tokenizes `code` into `sink`. Identifier, whitespace, comment and string literal
+/// scanning goes through the vectorized routines in `scan`.
+pub fn lex<'a, S: TokenSink<'a>>(code: &'a str, sink: &mut S) -> Result<()> {
+    lex_from(code, 0, sink)
+}
+
+/// Same as `lex`, but starts at byte `start`, which must be a token boundary. The lexer
+/// carries no state from one token to the next, so this yields the same tokens `lex`
+/// would from that point on.
+pub(super) fn lex_from<'a, S: TokenSink<'a>>(code: &'a str, start: usize, sink: &mut S) -> Result<()> {
+    let code_bytes = code.as_bytes();
+    let mut classes = scan::ByteClasses::new(code_bytes);
+
+    let mut idx: usize = start;
+    while idx < code_bytes.len() {
+        if sink.stop_at(idx) {
+            break;
+        }
+        match code_bytes[idx] {
+            b' ' => {
+                // Indentation and alignment come in runs, so count them in bulk. Lone
+                // spaces between words are far more common though, so check for those first.
+                if idx + 1 < code_bytes.len() && code_bytes[idx + 1] == b' ' {
+                    let run = classes.count_spaces(idx);
+                    sink.push_run(Token::Space, idx, run);
+                    idx += run;
+                } else {
+                    sink.push_token(Token::Space, idx);
+                    idx += 1;
                 }
+                continue;
+            }
+            b'\t' => {
+                sink.push_token(Token::Tab, idx);
+                idx += 1;
+                continue;
             }
+            b'\n' => {
+                sink.push_token(Token::NewLine, idx);
+                idx += 1;
+                continue;
+            }
+            b'"' => {
+                let len = find_len_string_literal(&code_bytes[idx..])?;
+                let val = token_str(code, idx, idx + len);
+                sink.push_token(Token::Literal(val), idx);
+                idx += len;
+                continue;
+            }
+            b'/' if idx + 1 < code_bytes.len() && matches!(code_bytes[idx + 1], b'*' | b'/') => {
+                let len = find_len_comment(&code_bytes[idx..]);
+                let val = token_str(code, idx, idx + len);
+                sink.push_token(Token::Comment(val), idx);
+                idx += len;
+                continue;
+            }
+            _ => {}
         }
-        string
+
+        let byte = code_bytes[idx];
+        if (byte as usize) < TOKEN_MAPPING.len() {
+            if let Some(sym) = TOKEN_MAPPING[byte as usize] {
+                sink.push_token(sym, idx);
+                idx += 1;
+                continue;
+            }
+        }
+        let new_idx = classes.find_object_end(idx + 1);
+        let val = token_str(code, idx, new_idx);
+        sink.push_token(Token::Object(val), idx);
+        idx = new_idx;
     }
+
+    Ok(())
 }
 
-pub fn tokenize(code: &str) -> Result<Vec<Token>> {
-    let code_bytes = code.as_bytes();
+/// Token boundaries always sit next to an ASCII byte (or the ends of the input), so they're
+/// always char boundaries and the checks `&code[start..end]` would do can be skipped.
+#[inline(always)]
+fn token_str(code: &str, start: usize, end: usize) -> &str {
+    debug_assert!(code.is_char_boundary(start) && code.is_char_boundary(end));
+    unsafe { code.get_unchecked(start..end) }
+}
+
+/// Byte-at-a-time tokenizer that `tokenize` replaced. It's kept as the reference
+/// implementation for differential tests and as the baseline in `benches/lexer.rs`.
+#[allow(unused)]
+pub fn tokenize_scalar(code: &str) -> Result<Vec<Token<'_>>> {
     let mut tokens = Vec::with_capacity(4096);
+    lex_scalar(code, &mut tokens)?;
+    Ok(tokens)
+}
+
+#[allow(unused)]
+pub fn lex_scalar<'a, S: TokenSink<'a>>(code: &'a str, sink: &mut S) -> Result<()> {
+    let code_bytes = code.as_bytes();
 
     let mut idx: usize = 0;
     while idx < code.len() {
         match code_bytes[idx] as char {
             ' ' => {
-                tokens.push(Token::Space);
+                sink.push_token(Token::Space, idx);
                 idx += 1;
                 continue;
             }
             '\t' => {
-                tokens.push(Token::Tab);
+                sink.push_token(Token::Tab, idx);
                 idx += 1;
                 continue;
             }
             '\n' => {
-                tokens.push(Token::NewLine);
+                sink.push_token(Token::NewLine, idx);
                 idx += 1;
                 continue;
             }
             '"' => {
-                let len = find_len_string_literal(&code_bytes[idx..])?;
+                let len = find_len_string_literal_scalar(&code_bytes[idx..])?;
                 let val = &code[idx..(idx + len)];
-                let tok = Token::Literal(val);
-                tokens.push(tok);
+                sink.push_token(Token::Literal(val), idx);
                 idx += len;
                 continue;
             }
             '/' => {
                 if matches!(code_bytes[idx+1] as char, '*' | '/') {
-                    let len = find_len_comment(&code_bytes[idx..]);
+                    let len = find_len_comment_scalar(&code_bytes[idx..]);
                     let val = &code[idx..(idx + len)];
-                    let tok = Token::Comment(val);
-                    tokens.push(tok);
+                    sink.push_token(Token::Comment(val), idx);
                     idx += len;
                     continue;
                 }
@@ -113,26 +694,25 @@ pub fn tokenize(code: &str) -> Result<Vec<Token>> {
         }
 
         if let Some(sym) = is_symbol(&code[idx..]) {
-            tokens.push(sym);
+            sink.push_token(sym, idx);
             idx += 1;
             continue;
         }
         let new_idx = find_len_object(code_bytes, idx);
         let val = &code[idx..new_idx];
-        let tok = Token::Object(val);
-        tokens.push(tok);
+        sink.push_token(Token::Object(val), idx);
         idx = new_idx;
     }
 
-    Ok(tokens)
+    Ok(())
 }
 
 #[inline]
-fn is_symbol(code: &str) -> Option<Token> {
+fn is_symbol(code: &str) -> Option<Token<'_>> {
     let char = code.chars().next();
     if let Some(char) = char {
         let char_code = char as usize;
-        if char_code > TOKEN_MAPPING.len() {
+        if char_code >= TOKEN_MAPPING.len() {
             return None;
         }
         return TOKEN_MAPPING[char_code];
@@ -156,6 +736,13 @@ fn find_len_object(code_bytes: &[u8], mut curr_idx: usize) -> usize {
 
 /// `code_bytes` must be a slice such that the start of the slice is the same as the start of the string (first character must be a `"`)
 fn find_len_string_literal(code_bytes: &[u8]) -> Result<usize> {
+    match scan::find_either(code_bytes, 1, b'"', b'\n') {
+        Some(idx) if code_bytes[idx] == b'"' => Ok(idx + 1),
+        _ => Err(anyhow!("String literal not closed")),
+    }
+}
+
+fn find_len_string_literal_scalar(code_bytes: &[u8]) -> Result<usize> {
     let mut idx: usize = 1;
     while idx < code_bytes.len() {
         if code_bytes[idx] == '\n' as u8 {
@@ -180,6 +767,13 @@ fn find_len_comment(code_bytes: &[u8]) -> usize {
         }    
     }
 
+    match code_bytes[1] {
+        b'*' => scan::find_block_comment_end(code_bytes, 2),
+        _ => scan::find_byte(code_bytes, 2, b'\n').unwrap_or(code_bytes.len()),
+    }
+}
+
+fn find_len_comment_scalar(code_bytes: &[u8]) -> usize {
     let mut idx = 2;
     match code_bytes[1] as char {
         '*' => {
@@ -203,60 +797,43 @@ fn find_len_comment(code_bytes: &[u8]) -> usize {
 }
 
 
-/// Reconstructs the soruce code excluding the ranges specified 
-pub fn reconstruct_source(tokens: &[Token], exclude_ranges: &[&[Token]]) -> String {
-    let mut new_tokens = vec![];
-    
-    let mut exlcude_map: HashMap<&[Token], Vec<&[Token]>> = HashMap::new();
-    
-    for &range in exclude_ranges {
-        if range.len() < 3 {
-            unreachable!();
+/// Reconstructs the source code excluding the token ranges specified.
+/// Tokens are slices of the source, so this copies the source bytes between the
+/// excluded spans straight into an exactly sized buffer.
+pub fn reconstruct_source(tokens: &TokenBuffer, exclude_ranges: &[Range<usize>]) -> String {
+    let src = tokens.src();
+
+    let mut gaps: Vec<Range<usize>> = exclude_ranges
+        .iter()
+        .map(|r| tokens.byte_range(r.clone()))
+        .filter(|r| r.start < r.end)
+        .collect();
+    gaps.sort_unstable_by_key(|r| r.start);
+
+    // Merge overlapping spans so every byte is either copied once or skipped
+    let mut merged: Vec<Range<usize>> = Vec::with_capacity(gaps.len());
+    for gap in gaps {
+        match merged.last_mut() {
+            Some(last) if gap.start <= last.end => last.end = last.end.max(gap.end),
+            _ => merged.push(gap),
         }
-
-        let entry = exlcude_map.entry(&range[0..3]).or_default();
-        entry.push(range);
     }
 
+    let excluded: usize = merged.iter().map(|r| r.len()).sum();
+    let mut code = String::with_capacity(src.len() - excluded);
 
-    let mut idx = 0;
-    
-    while idx < tokens.len() {
-        if idx + 3 >= tokens.len() {
-            new_tokens.push(tokens[idx]);
-            idx += 1;
-            continue;
-        }
-
-        if let Some(vec) = exlcude_map.get(&tokens[idx..(idx+3)]) {
-            let mut skip_len = 0;
-
-            for &range in vec {
-                if range.len() > tokens[idx..].len() {
-                    continue;
-                }
-                if range == &tokens[idx..(idx+range.len())] {
-                    skip_len = range.len();
-                    break;
-                }
-            }
-
-            if skip_len > 0 {
-                idx += skip_len;
-                continue;
-            }
-        }
-
-        new_tokens.push(tokens[idx]);
-        idx += 1;
-    
+    let mut copied_to = 0;
+    for gap in merged {
+        code.push_str(&src[copied_to..gap.start]);
+        copied_to = gap.end;
     }
+    code.push_str(&src[copied_to..]);
 
-    Token::tokens_to_string(&new_tokens)
+    code
 }
 
 // Maps character's ascii codes to their token
-const TOKEN_MAPPING: [Option<Token>; 128] = [
+static TOKEN_MAPPING: [Option<Token>; 128] = [
     None,
     None,
     None,
@@ -387,101 +964,125 @@ const TOKEN_MAPPING: [Option<Token>; 128] = [
     None,
 ];
 
-// Extracts the function definitions of all non-static functions
-pub fn get_fn_def<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
-    let mut fn_defs = vec![];
+// Each declaration kind is recognized by a scanner that moves a cursor forward through the
+// token stream one step at a time. `get_declarations` interleaves all four window by window
+// so they move through the stream together; `get_spans` runs one to completion.
 
-    let mut conditions: [bool; 3];
+/// Finds the function definitions of all non-static functions
+#[derive(Default)]
+pub struct FnDefScanner {
+    idx: usize,
+    spans: Vec<Range<usize>>,
+}
 
-    let mut idx: usize = 0;
-    while idx < tokens.len() {
-        conditions = [
+impl FnDefScanner {
+    fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize> {
+        (self.idx < tokens.len()).then_some(self.idx)
+    }
+
+    fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) {
+        let idx = self.idx;
+        let mut conditions = [
             false, // Starts with at least two objects
             false, // Has open paren
             false, // Has close paren
         ];
 
         let mut next_idx = idx;
-        if let Token::Comment(_) = tokens[idx] {
+        if let Token::Comment(_) = tokens.token_at(idx) {
             skip_to_end_comment(tokens, &mut next_idx);
         }
 
-        if let Token::Object(obj) = tokens[next_idx] {
-            if matches!(obj, "for" | "while" | "if") {
+        if next_idx >= tokens.len() {
+            self.idx = tokens.len();
+            return;
+        }
+
+        if let Token::Object(obj) = tokens.token_at(next_idx) {
+            if matches!(obj, "for" | "while" | "if" | "switch") {
                 skip_to(tokens, Token::CloseParen, &mut next_idx);
-                idx = next_idx;
-                continue;
+                self.idx = next_idx;
+                return;
             } else if obj == "include" {
                 skip_to_oneof(tokens, &[Token::GreaterThan, Token::Literal("\"")], &mut next_idx);
-                idx = next_idx;
-                continue;
+                self.idx = next_idx;
+                return;
             } else if obj == "define" {
                 skip_to(tokens, Token::NewLine, &mut next_idx);
-                idx = next_idx;
-                continue;
+                self.idx = next_idx;
+                return;
             } else if obj == "static" {
                 skip_to_oneof(tokens, &[Token::OpenParen, Token::OpenCurlyBrace], &mut next_idx);
-                idx = next_idx;
-                continue;
-            } else if matches!(obj, "return" | "if") {
-                idx = next_idx + 1;
-                continue;
+                self.idx = next_idx;
+                return;
+            } else if matches!(obj, "return" | "else" | "do" | "case") {
+                self.idx = next_idx + 1;
+                return;
             }
 
             let mut j = next_idx + 1;
             while j < tokens.len() {
-                if let Token::Object(obj_2) = tokens[j] {
-                    if matches!(obj_2, "for" | "while" | "if" | "main") {
+                let tok = tokens.token_at(j);
+                if let Token::Object(obj_2) = tok {
+                    if matches!(obj_2, "for" | "while" | "if" | "switch" | "main") {
                         break;
                     }
                     conditions[0] = true;
-                } else if let Token::OpenParen = tokens[j] {
+                } else if let Token::OpenParen = tok {
                     conditions[1] = true;
-                } else if let Token::CloseParen = tokens[j] {
+                } else if let Token::CloseParen = tok {
                     conditions[2] = true;
-                } else if let Token::OpenCurlyBrace = tokens[j] {
+                } else if let Token::OpenCurlyBrace = tok {
                     if conditions.iter().all(|&i| i) {
-                        fn_defs.push(&tokens[idx..j]);
+                        self.spans.push(idx..j);
                     }
                     break;
-                } else if let Token::Semicolon = tokens[j] {
+                } else if let Token::Semicolon = tok {
                     break;
-                } else if let Token::Equal = tokens[j] {
+                } else if let Token::Equal = tok {
                     break;
                 }
                 j += 1;
             }
-            idx = j + 1;
-            continue;
+            self.idx = j + 1;
+            return;
         }
-        idx += 1;
+        self.idx = idx + 1;
     }
+}
 
-    fn_defs
+pub fn get_include_spans<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Vec<Range<usize>> {
+    get_spans::<IncludeScanner, T>(tokens)
 }
 
-pub fn get_includes<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
-    let mut includes = vec![];
+#[derive(Default)]
+pub struct IncludeScanner {
+    idx: usize,
+    spans: Vec<Range<usize>>,
+}
 
-    let mut idx: usize = 0;
-    while idx < tokens.len() {
+impl IncludeScanner {
+    fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize> {
+        (self.idx < tokens.len()).then_some(self.idx)
+    }
+
+    fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) {
+        let idx = self.idx;
         let mut next_idx = idx;
-        if let Token::Comment(_) = tokens[next_idx] {
+        if let Token::Comment(_) = tokens.token_at(next_idx) {
             skip_to_end_comment(tokens, &mut next_idx);
-            if next_idx >= tokens.len() {
-                break
-            }
         }
 
         if next_idx >= tokens.len() {
-            break;
+            self.idx = tokens.len();
+            return;
         }
 
-        if let Token::HashTag = tokens[next_idx] {
-            let next_nwt = next_non_whitespace_token(&tokens[next_idx..]);
-            if tokens[next_idx+next_nwt] != Token::Object("include") {
-                idx += next_nwt;
-                continue;
+        if let Token::HashTag = tokens.token_at(next_idx) {
+            let next_nwt = next_non_whitespace_token(tokens, next_idx);
+            if tokens.token_at(next_idx + next_nwt) != Token::Object("include") {
+                self.idx = idx + next_nwt;
+                return;
             }
 
             let mut end = next_idx + next_nwt;
@@ -491,40 +1092,52 @@ pub fn get_includes<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
                 &mut end,
             );
 
-            includes.push(&tokens[idx..(end + 1)]);
-            idx = end + 1;
+            self.spans.push(idx..(end + 1));
+            self.idx = end + 1;
         }
         else {
-            idx += 1;
+            self.idx = idx + 1;
         }
     }
-
-    includes
 }
 
 /// Extracts the user defined types (UDTs)
-pub fn get_udts<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
-    let mut udts = vec![];
-    if tokens.len() < 3 {
-        return udts;
+pub fn get_udt_spans<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Vec<Range<usize>> {
+    get_spans::<UdtScanner, T>(tokens)
+}
+
+#[derive(Default)]
+pub struct UdtScanner {
+    idx: usize,
+    spans: Vec<Range<usize>>,
+}
+
+impl UdtScanner {
+    fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize> {
+        (tokens.len() >= 3 && self.idx < tokens.len() - 2).then_some(self.idx)
     }
 
-    let mut idx: usize = 0;
-    while idx < tokens.len() - 2 {
+    fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) {
+        let mut idx = self.idx;
         let start_idx = idx;
 
-        if let Token::Comment(_) = tokens[idx] {
+        if let Token::Comment(_) = tokens.token_at(idx) {
             skip_to_end_comment(tokens, &mut idx);
         }
 
-        if let Token::Object(obj) = tokens[idx] {
+        if idx >= tokens.len() {
+            self.idx = tokens.len();
+            return;
+        }
+
+        if let Token::Object(obj) = tokens.token_at(idx) {
             if !matches!(obj, "typedef" | "struct" | "union" | "enum") {
-                idx += 1;
-                continue;
+                self.idx = idx + 1;
+                return;
             } 
 
             let next_idx = if obj == "typedef" {
-                let x = idx + next_non_whitespace_token(&tokens[idx..]);
+                let x = idx + next_non_whitespace_token(tokens, idx);
                 if x >= tokens.len() {
                     unreachable!();
                 }
@@ -538,7 +1151,7 @@ pub fn get_udts<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
                 false, // Contains at least one set of curly braces
                 true,  // Contains no `=` characters
             ];
-            match tokens[next_idx] {
+            match tokens.token_at(next_idx) {
                 Token::Object("struct") |
                 Token::Object("enum") |
                 Token::Object("union") => {
@@ -546,7 +1159,7 @@ pub fn get_udts<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
                     let mut curlybrace_stack = 0;
 
                     while idx < tokens.len() {
-                        match tokens[idx] {
+                        match tokens.token_at(idx) {
                             Token::OpenCurlyBrace => curlybrace_stack += 1,
                             Token::CloseCurlyBrace => {
                                 if curlybrace_stack == 0 {
@@ -559,8 +1172,7 @@ pub fn get_udts<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
                             Token::Semicolon => {
                                 if curlybrace_stack == 0 {
                                     if conditions.iter().all(|&i| i) {
-                                        let x = &tokens[start_idx..=idx];
-                                        udts.push(x);
+                                        self.spans.push(start_idx..(idx + 1));
                                     }
                                     break;
                                 }
@@ -575,24 +1187,31 @@ pub fn get_udts<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
                     idx = next_idx;
                 }
             }
+            self.idx = idx;
         }
         else {
-            idx += 1;
+            self.idx = idx + 1;
         }
     }
-
-    udts
 }
 
-pub fn get_defines<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
-    let mut defines = vec![];
+#[derive(Default)]
+pub struct DefineScanner {
+    idx: usize,
+    spans: Vec<Range<usize>>,
+}
 
-    let mut idx: usize = 0;
+impl DefineScanner {
+    fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize> {
+        (self.idx < tokens.len()).then_some(self.idx)
+    }
 
-    while idx < tokens.len() {
+    fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) {
+        let mut idx = self.idx;
+        let tok = tokens.token_at(idx);
         if 
-            tokens[idx] != Token::HashTag &&
-            std::mem::discriminant(&tokens[idx]) != std::mem::discriminant(&Token::Comment(""))
+            tok != Token::HashTag &&
+            std::mem::discriminant(&tok) != std::mem::discriminant(&Token::Comment(""))
         {
             let valid_prefixes = &[Token::HashTag, Token::Comment("")];
             skip_to_oneof(tokens, valid_prefixes, &mut idx);
@@ -600,30 +1219,185 @@ pub fn get_defines<'a>(tokens: &'a Vec<Token>) -> Vec<&'a [Token<'a>]> {
 
         let start_idx = idx;
 
-        if let Token::Comment(_) = tokens[idx] {
+        if let Token::Comment(_) = tokens.token_at(idx) {
             skip_to_end_comment(tokens, &mut idx);
         }
 
-        if idx + 1 >= tokens.len() || tokens[idx + 1] != Token::Object("define") {
-            idx += 2;
-            continue;
+        if idx + 1 >= tokens.len() || tokens.token_at(idx + 1) != Token::Object("define") {
+            self.idx = idx + 2;
+            return;
         }
         idx += 1;
 
         skip_to(tokens, Token::NewLine, &mut idx);
-        while idx < tokens.len() && tokens[idx - 1] == Token::BackSlash {
+        while idx < tokens.len() && tokens.token_at(idx - 1) == Token::BackSlash {
             skip_to(tokens, Token::NewLine, &mut idx);
         }
 
-        defines.push(&tokens[start_idx..idx]);
+        self.spans.push(start_idx..idx);
+        self.idx = idx;
+    }
+}
+
+/// Common interface over the declaration scanners, so they can be restarted from any
+/// cursor position (see `incremental::DeclarationIndex`)
+pub trait Scanner {
+    fn starting_at(idx: usize) -> Self;
+    fn cursor(&self) -> usize;
+    fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize>;
+    fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T);
+    fn into_spans(self) -> Vec<Range<usize>>;
+}
+
+macro_rules! impl_scanner {
+    ($($scanner:ident),*) => {$(
+        impl Scanner for $scanner {
+            fn starting_at(idx: usize) -> Self {
+                Self { idx, spans: vec![] }
+            }
+
+            #[inline]
+            fn cursor(&self) -> usize {
+                self.idx
+            }
+
+            #[inline]
+            fn position<'a, T: TokenSource<'a> + ?Sized>(&self, tokens: &T) -> Option<usize> {
+                $scanner::position(self, tokens)
+            }
+
+            #[inline]
+            fn step<'a, T: TokenSource<'a> + ?Sized>(&mut self, tokens: &T) {
+                $scanner::step(self, tokens)
+            }
+
+            fn into_spans(self) -> Vec<Range<usize>> {
+                self.spans
+            }
+        }
+    )*};
+}
+
+impl_scanner!(FnDefScanner, IncludeScanner, UdtScanner, DefineScanner);
+
+/// Runs the scanner `S` over the whole stream, e.g. `get_spans::<DefineScanner, _>` for
+/// the `#define`s
+pub fn get_spans<'a, S: Scanner, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Vec<Range<usize>> {
+    let mut scanner = S::starting_at(0);
+    while scanner.position(tokens).is_some() {
+        scanner.step(tokens);
     }
+    scanner.into_spans()
+}
 
-    defines
+// Tokens per `get_declarations` window (96KB decoded)
+const DECLARATION_WINDOW: usize = 4096;
+
+/// A token stream with one window of it decoded ahead of time. Scanners can still read
+/// past the window (a declaration may straddle it), those tokens are decoded on demand.
+struct DecodedWindow<'w, 'a, T: TokenSource<'a> + ?Sized> {
+    tokens: &'w T,
+    base: usize,
+    decoded: Vec<Token<'a>>,
+}
+
+impl<'w, 'a, T: TokenSource<'a> + ?Sized> TokenSource<'a> for DecodedWindow<'w, 'a, T> {
+    #[inline]
+    fn len(&self) -> usize {
+        self.tokens.len()
+    }
+
+    #[inline]
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        match self.decoded.get(idx.wrapping_sub(self.base)) {
+            Some(&tok) => tok,
+            None => self.tokens.token_at(idx),
+        }
+    }
+}
+
+/// Token ranges of every declaration `kiln gen-headers` cares about
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct Declarations {
+    pub fn_defs: Vec<Range<usize>>,
+    pub includes: Vec<Range<usize>>,
+    pub defines: Vec<Range<usize>>,
+    pub udts: Vec<Range<usize>>,
+}
+
+/// Extracts all declaration kinds in one traversal of the token stream. Gives the same
+/// result as running each scanner with `get_spans` separately, but the recognizers share
+/// one pass over the tokens, so the stream is only pulled through the cache once.
+pub fn get_declarations<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Declarations {
+    get_declarations_into(tokens, Vec::new(), Declarations::default()).0
+}
+
+/// Same as `get_declarations`, but reuses allocations: the span lists of `out` (cleared
+/// first) and `decoded`, the scratch space for a window of decoded tokens, which is
+/// handed back for the next call
+pub(super) fn get_declarations_into<'a, T: TokenSource<'a> + ?Sized>(
+    tokens: &T,
+    mut decoded: Vec<Token<'a>>,
+    out: Declarations,
+) -> (Declarations, Vec<Token<'a>>) {
+    let Declarations {
+        fn_defs: mut fn_def_spans,
+        includes: mut include_spans,
+        defines: mut define_spans,
+        udts: mut udt_spans,
+    } = out;
+    for spans in [&mut fn_def_spans, &mut include_spans, &mut define_spans, &mut udt_spans] {
+        spans.clear();
+    }
+
+    let mut fn_defs = FnDefScanner { idx: 0, spans: fn_def_spans };
+    let mut includes = IncludeScanner { idx: 0, spans: include_spans };
+    let mut defines = DefineScanner { idx: 0, spans: define_spans };
+    let mut udts = UdtScanner { idx: 0, spans: udt_spans };
+
+    // Advance every scanner through one window of tokens before moving on to the next.
+    // The window is decoded into `Token`s once and shared, rather than each scanner
+    // decoding every token again (which is most of the cost on a `TokenBuffer`).
+    decoded.clear();
+    decoded.reserve(DECLARATION_WINDOW);
+    let mut window = DecodedWindow {
+        tokens,
+        base: 0,
+        decoded,
+    };
+    while window.base < tokens.len() {
+        let window_end = (window.base + DECLARATION_WINDOW).min(tokens.len());
+        window.decoded.clear();
+        window.decoded.extend((window.base..window_end).map(|i| tokens.token_at(i)));
+
+        while fn_defs.position(&window).is_some_and(|p| p < window_end) {
+            fn_defs.step(&window);
+        }
+        while includes.position(&window).is_some_and(|p| p < window_end) {
+            includes.step(&window);
+        }
+        while defines.position(&window).is_some_and(|p| p < window_end) {
+            defines.step(&window);
+        }
+        while udts.position(&window).is_some_and(|p| p < window_end) {
+            udts.step(&window);
+        }
+
+        window.base = window_end;
+    }
+
+    let decls = Declarations {
+        fn_defs: fn_defs.spans,
+        includes: includes.spans,
+        defines: defines.spans,
+        udts: udts.spans,
+    };
+    (decls, window.decoded)
 }
 
 /// Gets the name of the struct
 /// Ex) for `struct Point {...}`, this would return "Point"
-pub fn get_udt_name<'a>(tokens: &'a [Token]) -> &'a str {
+pub fn get_udt_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> &'a str {
     if tokens.len() < 3 {
         unreachable!("Token string is not a valid user defined type definition");
     }
@@ -632,16 +1406,16 @@ pub fn get_udt_name<'a>(tokens: &'a [Token]) -> &'a str {
     let mut num_unclosed_braces = 0;
     
     while idx < tokens.len() {
-        match tokens[idx] {
+        match tokens.token_at(idx) {
             Token::Object("struct") |
             Token::Object("enum") |
             Token::Object("union") => {
-                let next_idx = idx + next_non_whitespace_token(&tokens[idx..]);
+                let next_idx = idx + next_non_whitespace_token(tokens, idx);
 
                 if next_idx + 1 >= tokens.len() {
                     unreachable!("Invalid UDT (1)");
                 }
-                if let Token::Object(obj) = tokens[next_idx] {
+                if let Token::Object(obj) = tokens.token_at(next_idx) {
                     return obj;
                 }
             }
@@ -654,12 +1428,12 @@ pub fn get_udt_name<'a>(tokens: &'a [Token]) -> &'a str {
                 num_unclosed_braces -= 1;
 
                 if num_unclosed_braces == 0 {
-                    let next_idx = idx + next_non_whitespace_token(&tokens[idx..]);
+                    let next_idx = idx + next_non_whitespace_token(tokens, idx);
                     if next_idx + 1 >= tokens.len() {
                         unreachable!("Invalid UDT (2)");
                     }
 
-                    if let Token::Object(obj) = tokens[next_idx] {
+                    if let Token::Object(obj) = tokens.token_at(next_idx) {
                         return obj;
                     }
                 }
@@ -674,20 +1448,20 @@ pub fn get_udt_name<'a>(tokens: &'a [Token]) -> &'a str {
 
 /// Gets the name of the define statement
 /// Ex) for `#define FOO 42`, this would return "FOO"
-pub fn get_define_name<'a>(tokens: &'a [Token]) -> &'a str {
+pub fn get_define_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> &'a str {
     let mut idx = 0;
-    if let Token::Comment(_) = tokens[idx] {
+    if let Token::Comment(_) = tokens.token_at(idx) {
         skip_to_end_comment(tokens, &mut idx);
     }
 
-    if tokens.len() < 5 || tokens[idx] != Token::HashTag {
+    if tokens.len() < 5 || tokens.token_at(idx) != Token::HashTag {
         unreachable!("Token string is not a valid define macro (1)");
     }
 
     let mut define_seen = false;
 
-    for &t in &tokens[(idx+1)..] {
-        match t {
+    for i in (idx + 1)..tokens.len() {
+        match tokens.token_at(i) {
             Token::Object("define") => {
                 if define_seen {
                     unreachable!("Token string is not a valid define macro (2)");
@@ -710,23 +1484,38 @@ pub fn get_define_name<'a>(tokens: &'a [Token]) -> &'a str {
     unreachable!("Token string is not a valid define macro (4)");
 }
 
-pub fn get_include_name<'a>(tokens: &'a [Token]) -> String {
+/// Gets the name of a function from its definition or prototype: the last identifier
+/// before the parameter list
+/// Ex) for `char *foo(int a) {`, this would return "foo"
+pub fn get_fn_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Option<&'a str> {
+    let mut name = None;
+    for i in 0..tokens.len() {
+        match tokens.token_at(i) {
+            Token::OpenParen => return name,
+            Token::Object(obj) if obj.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_') => name = Some(obj),
+            _ => {}
+        }
+    }
+    None
+}
+
+pub fn get_include_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> String {
     let mut idx = 0;
-    if let Token::Comment(_) = tokens[idx] {
+    if let Token::Comment(_) = tokens.token_at(idx) {
         skip_to_end_comment(tokens, &mut idx);
     }
 
-    assert!(tokens[0] == Token::HashTag);
+    assert!(tokens.token_at(0) == Token::HashTag);
 
     let target_tok = [Token::LessThan, Token::Literal("")];
     skip_to_oneof(tokens, &target_tok, &mut idx);
 
-    match tokens[idx] {
+    match tokens.token_at(idx) {
         Token::LessThan => {
             let mut end_idx = idx;
             skip_to(tokens, Token::GreaterThan, &mut end_idx);
 
-            return Token::tokens_to_string(&tokens[(idx+1)..end_idx]);
+            return tokens.text((idx+1)..end_idx).into_owned();
         }
         Token::Literal(s) => {
             return s.trim_end_matches('"').to_string();
@@ -737,10 +1526,10 @@ pub fn get_include_name<'a>(tokens: &'a [Token]) -> String {
 
 /// Updates `idx` to point to the next token specified. If the
 /// token does not exist, `idx` will be set equal to tokens.len()
-fn skip_to(tokens: &[Token], target: Token, idx: &mut usize) {
+fn skip_to<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, target: Token, idx: &mut usize) {
     for i in (*idx + 1)..tokens.len() {
         *idx = i;
-        if tokens[i] == target {
+        if tokens.token_at(i) == target {
             return;
         }
     }
@@ -751,11 +1540,12 @@ fn skip_to(tokens: &[Token], target: Token, idx: &mut usize) {
 
 /// Ignores values inside the targets, it just skips to the next token
 /// that's one of the target variants
-fn skip_to_oneof(tokens: &[Token], targets: &[Token], idx: &mut usize) {
+fn skip_to_oneof<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, targets: &[Token], idx: &mut usize) {
     for i in (*idx + 1)..tokens.len() {
         *idx = i;
+        let tok = tokens.token_at(i);
         for target in targets {
-            if std::mem::discriminant(&tokens[i]) == std::mem::discriminant(target) {
+            if std::mem::discriminant(&tok) == std::mem::discriminant(target) {
                 return;
             }
         }
@@ -764,19 +1554,19 @@ fn skip_to_oneof(tokens: &[Token], targets: &[Token], idx: &mut usize) {
 
 /// If we have a block commant (or multiple single line comments seperated by no more than a single \n character),
 /// this function will skip to the end of all of them (including the trailing newline if it exists). 
-fn skip_to_end_comment(tokens: &[Token], idx: &mut usize) {
+fn skip_to_end_comment<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, idx: &mut usize) {
     assert_eq!(
-        std::mem::discriminant(&tokens[*idx]), 
+        std::mem::discriminant(&tokens.token_at(*idx)), 
         std::mem::discriminant(&Token::Comment(""))
     );
 
     while
         *idx < tokens.len() && (
-            std::mem::discriminant(&tokens[*idx]) == std::mem::discriminant(&Token::Comment("")) ||
-            tokens[*idx] == Token::NewLine
+            std::mem::discriminant(&tokens.token_at(*idx)) == std::mem::discriminant(&Token::Comment("")) ||
+            tokens.token_at(*idx) == Token::NewLine
         )
     {
-        if tokens[*idx] == Token::NewLine && tokens[*idx + 1] == Token::NewLine {
+        if tokens.token_at(*idx) == Token::NewLine && *idx + 1 < tokens.len() && tokens.token_at(*idx + 1) == Token::NewLine {
             break;
         }
         *idx += 1;
@@ -786,10 +1576,14 @@ fn skip_to_end_comment(tokens: &[Token], idx: &mut usize) {
 
 /// Passing the below list to this function would return `3` (gets the next token, not the current token)
 /// `[object-token-curr, whitespace, whitespace, object-token-next]`
+/// The offset is relative to `from`.
 #[inline]
-fn next_non_whitespace_token(tokens: &[Token]) -> usize {
+fn next_non_whitespace_token<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, from: usize) -> usize {
     let mut idx = 1;
-    while idx < tokens.len() && matches!(tokens[idx], Token::Space | Token::Tab | Token::NewLine | Token::Comment(_)) {
+    while
+        from + idx < tokens.len() &&
+        matches!(tokens.token_at(from + idx), Token::Space | Token::Tab | Token::NewLine | Token::Comment(_))
+    {
         idx += 1;
     }
 
@@ -802,12 +1596,143 @@ mod lexer_tests {
 
     use super::*;
 
+    #[test]
+    fn test_tokenize_matches_scalar() {
+        let mut corpus = vec![
+            fs::read_to_string("tests/lexer-define.c").unwrap(),
+            fs::read_to_string("tests/lexer-UDT.c").unwrap(),
+        ];
+
+        let mut edge_cases = String::new();
+        for i in 0..64 {
+            edge_cases.push_str(&format!(
+                "{indent}unsigned long long very_long_identifier_name_number_{i}_é = 0x{i:x}ULL;{pad}// note {i} ✦\n",
+                indent = "\t".repeat(i % 3) + &" ".repeat(i % 41),
+                pad = " ".repeat(i % 7),
+            ));
+            edge_cases.push_str(&format!("/* block {} ** with * stars */ char *s{} = \"a\\\"b\";\n", i, i));
+        }
+        edge_cases.push_str("int tail = 1;");
+        corpus.push(edge_cases);
+
+        for code in &corpus {
+            assert_eq!(tokenize(code).unwrap(), tokenize_scalar(code).unwrap());
+        }
+
+        assert!(tokenize("char *s = \"unterminated\n\";").is_err());
+        assert_eq!(tokenize("a /").unwrap(), [Token::Object("a"), Token::Space, Token::ForwardSlash]);
+    }
+
+    #[test]
+    fn test_parallel_matches_serial() {
+        let mut corpus = vec![
+            fs::read_to_string("tests/lexer-define.c").unwrap(),
+            fs::read_to_string("tests/lexer-UDT.c").unwrap(),
+        ];
+
+        // Block comments over many lines (with quotes that would fail to lex if a piece
+        // started inside them), long string tables and plain code, in pseudo-random order
+        let mut generated = String::new();
+        let mut seed = 7u64;
+        for i in 0..400 {
+            seed = seed.wrapping_mul(6364136223846793005).wrapping_add(1442695040888963407);
+            match (seed >> 33) % 4 {
+                0 => {
+                    generated.push_str("/* comment\n");
+                    for j in 0..(seed >> 40) % 12 {
+                        generated.push_str(&format!(" * line {} with an \" unmatched quote {{ }}\n", j));
+                    }
+                    generated.push_str(" */\n");
+                }
+                1 => generated.push_str(&format!("static const char *s{}[] = {{ \"a, b\", \"c\" }};\n", i)),
+                2 => generated.push_str(&format!("// line comment {} \"\n\n", i)),
+                _ => generated.push_str(&format!("int f{}(int x) {{\n    return x * {};\n}}\n", i, i)),
+            }
+        }
+        corpus.push(generated);
+
+        for code in &corpus {
+            let serial = tokenize_compact(code).unwrap();
+            for pieces in 1..=16 {
+                let parallel = tokenize_parallel(code, pieces).unwrap();
+                assert_eq!((&parallel.kinds, &parallel.starts), (&serial.kinds, &serial.starts), "{} pieces", pieces);
+            }
+        }
+
+        // A real error is still reported, one that only a wrong guess would hit isn't
+        let broken = "int a;\nchar *s = \"unterminated\n\";\nint b;\n".repeat(8);
+        assert!(tokenize_parallel(&broken, 4).is_err());
+        let hidden = format!("/*\n{}*/\nint c;\n", "\"\n".repeat(64));
+        assert_eq!(tokenize_parallel(&hidden, 8).unwrap().starts, tokenize_compact(&hidden).unwrap().starts);
+    }
+
+    #[test]
+    fn test_get_declarations() {
+        for path in ["tests/lexer-define.c", "tests/lexer-UDT.c"] {
+            let s = fs::read_to_string(path).unwrap();
+            let tokens = tokenize_compact(&s).unwrap();
+
+            let decls = get_declarations(&tokens);
+            assert_eq!(decls.fn_defs, get_spans::<FnDefScanner, _>(&tokens));
+            assert_eq!(decls.includes, get_include_spans(&tokens));
+            assert_eq!(decls.defines, get_spans::<DefineScanner, _>(&tokens));
+            assert_eq!(decls.udts, get_udt_spans(&tokens));
+        }
+    }
+
+    #[test]
+    fn test_reconstruct_source() {
+        for path in ["tests/lexer-define.c", "tests/lexer-UDT.c"] {
+            let s = fs::read_to_string(path).unwrap();
+            let tokens = tokenize_compact(&s).unwrap();
+
+            let mut exclude = get_udt_spans(&tokens);
+            exclude.extend(get_spans::<DefineScanner, _>(&tokens));
+
+            let expected: Vec<Token> = (0..tokens.len())
+                .filter(|&i| !exclude.iter().any(|r| r.contains(&i)))
+                .map(|i| tokens.token_at(i))
+                .collect();
+
+            assert_eq!(reconstruct_source(&tokens, &exclude), Token::tokens_to_string(&expected));
+        }
+    }
+
+    #[test]
+    fn test_compact_tokens_match() {
+        for path in ["tests/lexer-define.c", "tests/lexer-UDT.c"] {
+            let s = fs::read_to_string(path).unwrap();
+            let tokens = tokenize(&s).unwrap();
+            let compact = tokenize_compact(&s).unwrap();
+
+            assert_eq!(compact.len(), tokens.len());
+            for i in 0..tokens.len() {
+                assert_eq!(compact.token_at(i), tokens[i]);
+            }
+            assert_eq!(compact.text(0..compact.len()), s);
+
+            let slices = tokens.as_slice();
+            assert_eq!(get_spans::<FnDefScanner, _>(&compact), get_spans::<FnDefScanner, _>(slices));
+            assert_eq!(get_include_spans(&compact), get_include_spans(slices));
+            assert_eq!(get_spans::<DefineScanner, _>(&compact), get_spans::<DefineScanner, _>(slices));
+            assert_eq!(get_udt_spans(&compact), get_udt_spans(slices));
+
+            for r in get_udt_spans(&compact) {
+                assert_eq!(get_udt_name(&compact.view(r.clone())), get_udt_name(&tokens[r]));
+            }
+
+            // 5 bytes per token instead of 24
+            let vec_size = tokens.len() * std::mem::size_of::<Token>();
+            assert!(compact.heap_size() * 3 < vec_size);
+        }
+    }
+
     #[test]
     fn test_get_defines() {
         let s = fs::read_to_string("tests/lexer-define.c").unwrap();
         let tokens = tokenize(&s).unwrap();
 
-        let defines = get_defines(&tokens);
+        let defines: Vec<_> = get_spans::<DefineScanner, _>(&tokens[..]).into_iter().map(|r| &tokens[r]).collect();
 
         let mut log_dump = "".to_string();
         for &def in &defines {
@@ -828,7 +1753,7 @@ mod lexer_tests {
         let s = fs::read_to_string("tests/lexer-UDT.c").unwrap();
         let tokens = tokenize(&s).unwrap();
 
-        let defines = get_udts(&tokens);
+        let defines: Vec<_> = get_udt_spans(&tokens[..]).into_iter().map(|r| &tokens[r]).collect();
 
         let mut log_dump = "".to_string();
         for &def in &defines {
@@ -844,7 +1769,7 @@ mod lexer_tests {
         let s = fs::read_to_string("tests/lexer-define.c").unwrap();
         let tokens = tokenize(&s).unwrap();
 
-        let defines = get_defines(&tokens);
+        let defines: Vec<_> = get_spans::<DefineScanner, _>(&tokens[..]).into_iter().map(|r| &tokens[r]).collect();
 
         let mut names = vec![];
         for &d in &defines {
@@ -868,7 +1793,7 @@ mod lexer_tests {
         let s = fs::read_to_string("tests/lexer-UDT.c").unwrap();
         let tokens = tokenize(&s).unwrap();
 
-        let structs = get_udts(&tokens);
+        let structs: Vec<_> = get_udt_spans(&tokens[..]).into_iter().map(|r| &tokens[r]).collect();
 
         let mut names = vec![];
         for &d in &structs {
@@ -0,0 +1,95 @@
+// Rewrites a source file so some of its functions get internal linkage.
+//
+// gen-headers exports every non-static function, so a function only ever called from its
+// own file still goes through the header and can't be inlined into its callers without
+// LTO. Marking it `static` takes it out of the header on the next gen-headers run.
+
+use std::ops::Range;
+
+use anyhow::Result;
+
+use super::includes::is_trivia;
+use super::lexer_c::{self, Token, TokenBuffer, TokenSource};
+
+/// Marks the functions of `code` named in `names` `static`.
+/// A function used above its definition relied on the prototype in its header, which
+/// gen-headers is about to drop, so it gets a `static` prototype after the includes.
+pub fn make_static(code: &str, names: &[&str]) -> Result<String> {
+    let tokens = lexer_c::tokenize_compact(code)?;
+    let decls = lexer_c::get_declarations(&tokens);
+
+    let mut insertions: Vec<(usize, String)> = vec![];
+    let mut prototypes = String::new();
+
+    for span in &decls.fn_defs {
+        let Some((first, name)) = signature(&tokens, span.clone()) else {
+            continue;
+        };
+        if !names.contains(&name) {
+            continue;
+        }
+
+        insertions.push((tokens.span(first).start, "static ".to_string()));
+
+        let used_above = (0..span.start).any(|i| tokens.token_at(i) == Token::Object(name));
+        if used_above {
+            let sig = &code[tokens.byte_range(first..span.end)];
+            prototypes.push_str(&format!("static {};\n", sig.trim()));
+        }
+    }
+
+    if !prototypes.is_empty() {
+        // After the line of the last include, or at the top of the file
+        let after_includes = match decls.includes.iter().map(|r| tokens.byte_range(r.clone()).end).max() {
+            Some(end) => code[end..].find('\n').map_or(code.len(), |nl| end + nl + 1),
+            None => 0,
+        };
+        let separator = if after_includes == 0 { "" } else { "\n" };
+        insertions.push((after_includes, format!("{}{}", separator, prototypes)));
+    }
+
+    insertions.sort_by_key(|(at, _)| *at);
+
+    let mut out = String::with_capacity(code.len() + insertions.iter().map(|(_, s)| s.len()).sum::<usize>());
+    let mut copied_to = 0;
+    for (at, text) in insertions {
+        out.push_str(&code[copied_to..at]);
+        out.push_str(&text);
+        copied_to = at;
+    }
+    out.push_str(&code[copied_to..]);
+
+    Ok(out)
+}
+
+/// The first significant token of a function definition and the function's name
+fn signature<'a>(tokens: &TokenBuffer<'a>, span: Range<usize>) -> Option<(usize, &'a str)> {
+    let first = span.clone().find(|&i| !is_trivia(tokens.token_at(i)))?;
+    Some((first, lexer_c::get_fn_name(&tokens.view(span))?))
+}
+
+#[cfg(test)]
+mod linkage_tests {
+    use super::*;
+
+    #[test]
+    fn test_make_static() {
+        let code = "#include <stdio.h>\n#include \"../include/calc.h\"\n\n\
+                    int twice(int x) {\n    return add(x, x);\n}\n\n\
+                    int add(int a, int b) {\n    return a + b;\n}\n\n\
+                    inline int square(int x) {\n    return x * x;\n}\n";
+
+        let out = make_static(code, &["add", "square"]).unwrap();
+        assert_eq!(
+            out,
+            "#include <stdio.h>\n#include \"../include/calc.h\"\n\
+             \nstatic int add(int a, int b);\n\n\
+             int twice(int x) {\n    return add(x, x);\n}\n\n\
+             static int add(int a, int b) {\n    return a + b;\n}\n\n\
+             static inline int square(int x) {\n    return x * x;\n}\n"
+        );
+
+        // Nothing to do, nothing changes
+        assert_eq!(make_static(code, &["missing"]).unwrap(), code);
+    }
+}
@@ -0,0 +1,103 @@
+use std::collections::BTreeMap;
+use std::fs;
+use std::path::Path;
+
+use serde::{Deserialize, Serialize};
+
+/// Content hashes of the files `kiln gen-headers` produced on its last run, stored in
+/// `build/`. A source/header pair whose hashes still match, and whose dependencies (the
+/// other project files read to pick its includes) are unchanged too, was generated from
+/// exactly these bytes, so there is nothing to regenerate.
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct HeaderManifest {
+    version: String,
+    /// The generation options the files were produced with
+    #[serde(default)]
+    options: String,
+    files: BTreeMap<String, FileHashes>,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct FileHashes {
+    pub source: u64,
+    pub header: u64,
+    /// Every other file generation looked at (whether it existed or not)
+    #[serde(default)]
+    pub deps: Vec<String>,
+    /// Combined hash of the contents of `deps`
+    #[serde(default)]
+    pub deps_hash: u64,
+}
+
+impl HeaderManifest {
+    /// Loads the manifest at `path`. A missing, unreadable or outdated manifest is
+    /// treated as empty, which just means every file gets regenerated.
+    pub fn load(path: &Path) -> Self {
+        let manifest = fs::read_to_string(path)
+            .ok()
+            .and_then(|s| serde_json::from_str::<HeaderManifest>(&s).ok());
+
+        match manifest {
+            Some(m) if m.version == Self::current_version() => m,
+            _ => Self::new(),
+        }
+    }
+
+    pub fn new() -> Self {
+        Self {
+            version: Self::current_version(),
+            options: String::new(),
+            files: BTreeMap::new(),
+        }
+    }
+
+    /// The manifest for files generated with `options`: this one if they match the ones
+    /// its files were generated with, an empty one otherwise
+    pub fn with_options(self, options: &str) -> Self {
+        if self.options == options {
+            return self;
+        }
+        Self {
+            options: options.to_string(),
+            ..Self::new()
+        }
+    }
+
+    pub fn to_json(&self) -> String {
+        serde_json::to_string_pretty(self).unwrap()
+    }
+
+    /// Returns true if `file` was last generated into exactly `hashes`
+    pub fn is_fresh(&self, file: &str, hashes: &FileHashes) -> bool {
+        self.files.get(file) == Some(hashes)
+    }
+
+    /// The dependencies `file` was last generated with
+    pub fn deps(&self, file: &str) -> &[String] {
+        self.files.get(file).map_or(&[], |f| &f.deps)
+    }
+
+    /// Returns true if gen-headers manages `file`'s header
+    pub fn contains(&self, file: &str) -> bool {
+        self.files.contains_key(file)
+    }
+
+    pub fn insert(&mut self, file: &str, hashes: FileHashes) {
+        self.files.insert(file.to_string(), hashes);
+    }
+
+    pub fn remove(&mut self, file: &str) {
+        self.files.remove(file);
+    }
+
+    /// Drops the entries for files not in `files`
+    pub fn retain(&mut self, files: &[&str]) {
+        self.files.retain(|f, _| files.contains(&f.as_str()));
+    }
+
+    // Output may change between kiln versions, so entries are only trusted when they
+    // were written by this one
+    fn current_version() -> String {
+        env!("CARGO_PKG_VERSION").to_string()
+    }
+}
@@ -1,24 +1,206 @@
+pub mod context;
+pub mod incremental;
+pub mod includes;
+pub mod inlining;
 pub mod lexer_c;
+pub mod linkage;
+pub mod manifest;
+mod scan;
+pub mod stream;
 
 use std::collections::HashSet;
 
 use anyhow::{anyhow, Result};
+use inlining::InlineOptions;
+use lexer_c::{Token, TokenSource};
+
+/// The output of `generate` for one source file
+#[derive(Debug, Clone, PartialEq)]
+pub struct GeneratedFiles {
+    /// Contents of `include/<name>.h`
+    pub header: String,
+    /// Contents of `src/<name>.c` with the definitions that moved to the header removed
+    pub source: String,
+}
+
+/// Generates the header for `src/<raw_name>.c` from its source `code` and the current
+/// contents of its header `code_h` (empty if there is none yet), and rewrites the
+/// source to include it.
+/// `resolve_local` returns the declarations behind a `#include "..."` of the source, which
+/// decide whether the header needs that include (see `includes::select_includes`).
+/// `inline` picks the functions whose whole definition moves into the header as
+/// `static inline` (see `inlining`).
+pub fn generate(
+    raw_name: &str,
+    code: &str,
+    code_h: &str,
+    resolve_local: &dyn Fn(&str) -> Option<String>,
+    inline: &InlineOptions,
+) -> Result<GeneratedFiles> {
+    let mut ctx = context::thread_context();
+    let tokens = ctx.tokenize(&code)?;
+    let tokens_h = ctx.tokenize(&code_h)?;
+
+    let decls_h = ctx.declarations(&tokens_h);
+    let mut defines_h = tokens_h.views(&decls_h.defines);
+    let mut udts_h = tokens_h.views(&decls_h.udts);
+    let mut includes_h = tokens_h.views(&decls_h.includes);
+
+    let decls = ctx.declarations(&tokens);
+    let inlined = inlining::select(&tokens, &decls.fn_defs, inline);
+    let fn_defs: Vec<_> = decls
+        .fn_defs
+        .iter()
+        .enumerate()
+        .filter(|(i, _)| !inlined.iter().any(|f| f.fn_def == *i))
+        .map(|(_, span)| tokens.view(span.clone()))
+        .collect();
+    let includes = tokens.views(&decls.includes);
+    let defines = tokens.views(&decls.defines);
+    let udts = tokens.views(&decls.udts);
+
+    // Ensure headerfiles don't include themselves
+    let includes = filter_out_includes(&includes, raw_name);
+
+    // Skip the first definition to skip the #ifndef NAME_H #define NAME_H
+    if defines_h.len() > 0 {
+        defines_h.remove(0);
+    }
+
+    merge_defines(&mut defines_h, &defines)?;
+    merge_udts(&mut udts_h, &udts)?;
+
+    merge_includes(&mut includes_h, &includes);
+
+    // Bodies moved on an earlier run stay, unless the function is back in the source
+    let defined: HashSet<&str> = tokens
+        .views(&decls.fn_defs)
+        .iter()
+        .filter_map(|f| lexer_c::get_fn_name(f))
+        .collect();
+    let inline_defs: Vec<_> = inlining::header_definitions(&tokens_h)
+        .into_iter()
+        .map(|r| tokens_h.view(r))
+        .filter(|d| lexer_c::get_fn_name(d).is_some_and(|name| !defined.contains(name)))
+        .chain(inlined.iter().map(|f| tokens.view(f.definition.clone())))
+        .collect();
+    let declared: Vec<_> = fn_defs.iter().chain(&inline_defs).copied().collect();
+
+    // Only the includes the emitted declarations need; the rest stay in the .c file
+    let selection = includes::select_includes(&includes, &defines_h, &udts_h, &declared, resolve_local);
+    let includes = selection.includes;
+
+    // Every declaration is a borrowed slice of `code` or `code_h`, so the header
+    // is assembled with one allocation
+    let decl_len: usize = [&includes, &defines_h, &udts_h, &declared]
+        .iter()
+        .flat_map(|decls| decls.iter())
+        .map(|d| d.byte_range().len() + 16)
+        .sum();
+    let mut headers = String::with_capacity(decl_len + 4 * raw_name.len() + 64);
+
+    headers.push_str(&format!("#ifndef {}_H\n", raw_name.to_uppercase()));
+    headers.push_str(&format!("#define {}_H\n\n", raw_name.to_uppercase()));
+
+    for inc in &includes {
+        headers.push_str(inc.text(0..inc.len()).trim());
+        headers.push('\n');
+    }
+    headers.push('\n');
+
+    if !selection.forward_decls.is_empty() {
+        for decl in &selection.forward_decls {
+            headers.push_str(decl);
+            headers.push('\n');
+        }
+        headers.push('\n');
+    }
+
+    for def in &defines_h {
+        headers.push_str(&def.text(0..def.len()));
+        headers.push('\n');
+    }
+    headers.push('\n');
+
+    for struc in &udts_h {
+        headers.push_str(struc.text(0..struc.len()).trim());
+        headers.push_str("\n\n");
+    }
+    headers.push('\n');
+
+    for func in &fn_defs {
+        let inline_idx = (0..func.len())
+            .find(|&i| func.token_at(i) == Token::Object("inline"));
+
+        if let Some(inline_idx) = inline_idx {
+            // turn `inline void XXX() {}` in .c into `extern inline void XXX();` in .h
+            let before = func.text(0..inline_idx);
+            let after = func.text(inline_idx..func.len());
+            let s = format!("{}extern {}", before, after);
+            headers.push_str(s.trim());
+            headers.push_str(";\n\n");
+        } else {
+            headers.push_str(func.text(0..func.len()).trim());
+            headers.push_str(";\n\n");
+        }
+    }
+    headers.push('\n');
+
+    if !inline_defs.is_empty() {
+        let kept = inline_defs.len() - inlined.len();
+        for def in &inline_defs[..kept] {
+            headers.push_str(def.text(0..def.len()).trim());
+            headers.push_str("\n\n");
+        }
+        for def in &inline_defs[kept..] {
+            headers.push_str(inlining::static_inline_text(def).trim());
+            headers.push_str("\n\n");
+        }
+        headers.push('\n');
+    }
+
+    headers.push_str(&format!("#endif // {}_H", raw_name.to_uppercase()));
+
+    // Remove definitions from original C file to avoid duplicates
+    let exclude_tokens: Vec<_> = udts
+        .iter()
+        .chain(defines.iter())
+        .map(|decl| decl.token_range())
+        .chain(inlined.iter().map(|f| f.remove.clone()))
+        .collect();
+
+    let mut new_code = lexer_c::reconstruct_source(&tokens, &exclude_tokens);
+
+    let header_inc_path = format!("\"../include/{}.h\"", raw_name);
+
+    new_code = insert_self_include(new_code, &header_inc_path);
+
+    ctx.recycle_declarations(decls);
+    ctx.recycle_declarations(decls_h);
+    ctx.recycle_tokens(tokens);
+    ctx.recycle_tokens(tokens_h);
+
+    Ok(GeneratedFiles {
+        header: headers,
+        source: new_code,
+    })
+}
 
 /// Returns an error if there are any duplicate definitions
 /// Otherwise, adds all definitions in `src` to `dst`
-pub fn merge_defines<'a>(
-    dst: &mut Vec<&'a [lexer_c::Token<'a>]>,
-    src: &[&'a [lexer_c::Token<'a>]],
+pub fn merge_defines<'a, T: TokenSource<'a> + Copy>(
+    dst: &mut Vec<T>,
+    src: &[T],
 ) -> Result<()> {
     let mut dst_set = HashSet::new();
 
     for &tokens in dst.iter() {
-        let s = lexer_c::get_define_name(tokens);
+        let s = lexer_c::get_define_name(&tokens);
         dst_set.insert(s);
     }
 
     for &tokens in src.iter() {
-        let s = lexer_c::get_define_name(tokens);
+        let s = lexer_c::get_define_name(&tokens);
         if dst_set.contains(&s) {
             return Err(anyhow!("Duplicate #define definitions for {}", s));
         }
@@ -31,19 +213,19 @@ pub fn merge_defines<'a>(
 
 /// Returns an error if there are any duplicate definitions
 /// Otherwise, adds all definitions in `src` to `dst`
-pub fn merge_includes<'a>(
-    dst: &mut Vec<&'a [lexer_c::Token<'a>]>,
-    src: &[&'a [lexer_c::Token<'a>]],
+pub fn merge_includes<'a, T: TokenSource<'a> + Copy>(
+    dst: &mut Vec<T>,
+    src: &[T],
 ) {
     let mut dst_set = HashSet::new();
 
     for &tokens in dst.iter() {
-        let s = lexer_c::get_include_name(tokens);
+        let s = lexer_c::get_include_name(&tokens);
         dst_set.insert(s);
     }
 
     for &tokens in src.iter() {
-        let s = lexer_c::get_include_name(tokens);
+        let s = lexer_c::get_include_name(&tokens);
         if !dst_set.contains(&s) {
             dst.push(tokens);
         }
@@ -52,19 +234,19 @@ pub fn merge_includes<'a>(
 
 /// Returns an error if there are any duplicate definitions
 /// Otherwise, adds all definitions in `src` to `dst`
-pub fn merge_udts<'a>(
-    dst: &mut Vec<&'a [lexer_c::Token<'a>]>,
-    src: &[&'a [lexer_c::Token<'a>]],
+pub fn merge_udts<'a, T: TokenSource<'a> + Copy>(
+    dst: &mut Vec<T>,
+    src: &[T],
 ) -> Result<()> {
     let mut dst_set = HashSet::new();
 
     for &tokens in dst.iter() {
-        let s = lexer_c::get_udt_name(tokens);
+        let s = lexer_c::get_udt_name(&tokens);
         dst_set.insert(s);
     }
 
     for &tokens in src.iter() {
-        let s = lexer_c::get_udt_name(tokens);
+        let s = lexer_c::get_udt_name(&tokens);
         if dst_set.contains(&s) {
             return Err(anyhow!("Duplicate struct definitions for {}", s));
         }
@@ -79,11 +261,46 @@ pub fn merge_udts<'a>(
 /// This will do nothing and return `code` if the include statement already exists, otherwise
 /// it will insert it at the end of all the include statements
 pub fn insert_self_include(code: String, include: &str) -> String {
+    if code.contains('\r') {
+        return insert_self_include_lines(code, include);
+    }
+
+    // `code.lines().join("\n")` without the per-line copies: drop one trailing newline and
+    // splice the include in after the last include line (or the first line if there are none)
+    let body = code.strip_suffix('\n').unwrap_or(&code);
+
+    let mut insert_at = None;
+    let mut line_start = 0;
+    for line in body.split('\n') {
+        let line_end = line_start + line.len();
+        if is_self_include(line, include) {
+            return code;
+        }
+        if is_include_statement(line) || insert_at.is_none() {
+            insert_at = Some(line_end);
+        }
+        line_start = line_end + 1;
+    }
+
+    let include_line = format!("#include {}", include);
+    if code.is_empty() {
+        return include_line;
+    }
+
+    let insert_at = insert_at.unwrap();
+    let mut new_code = String::with_capacity(body.len() + include_line.len() + 1);
+    new_code.push_str(&body[..insert_at]);
+    new_code.push('\n');
+    new_code.push_str(&include_line);
+    new_code.push_str(&body[insert_at..]);
+    new_code
+}
+
+/// Line based version of `insert_self_include`, used for sources with `\r\n` line endings
+fn insert_self_include_lines(code: String, include: &str) -> String {
     let mut code_lines: Vec<&str> = code.lines().collect();
 
-    let contains_include = code_lines.iter().any(|&line| {
-        line.trim().starts_with("#") && line.contains("include") && line.contains(include)
-    });
+    let contains_include = code_lines.iter().any(|&line| is_self_include(line, include));
 
     if contains_include {
         return code;
@@ -92,11 +309,7 @@ pub fn insert_self_include(code: String, include: &str) -> String {
     let mut line_idx: usize = 0;
 
     for (i, &line) in code_lines.iter().enumerate() {
-        let is_include_statement = line.trim().starts_with("#")
-            && line.contains("include")
-            && (line.contains("<") || line.contains("\""));
-
-        if is_include_statement {
+        if is_include_statement(line) {
             line_idx = i;
         }
     }
@@ -112,11 +325,21 @@ pub fn insert_self_include(code: String, include: &str) -> String {
     code_lines.join("\n")
 }
 
+fn is_self_include(line: &str, include: &str) -> bool {
+    line.trim().starts_with("#") && line.contains("include") && line.contains(include)
+}
+
+fn is_include_statement(line: &str) -> bool {
+    line.trim().starts_with("#")
+        && line.contains("include")
+        && (line.contains("<") || line.contains("\""))
+}
+
 /// Filters out `#include "XXX.h"` where `file_name` is `"XXX"`
-pub fn filter_out_includes<'a>(
-    includes: &Vec<&'a [lexer_c::Token]>,
+pub fn filter_out_includes<'a, T: TokenSource<'a> + Copy>(
+    includes: &[T],
     file_name: &str,
-) -> Vec<&'a [lexer_c::Token<'a>]> {
+) -> Vec<T> {
     let include_str_name = [
         format!("{}.h\"", file_name),
         format!("/{}.h\"", file_name),
@@ -124,11 +347,14 @@ pub fn filter_out_includes<'a>(
     ];
 
     includes
-        .clone()
-        .into_iter()
-        .filter(|&x| {
-            if let Some(lexer_c::Token::Literal(s)) = x.last() {
-                if s == &include_str_name[0] {
+        .iter()
+        .copied()
+        .filter(|x| {
+            if x.len() == 0 {
+                return true;
+            }
+            if let Token::Literal(s) = x.token_at(x.len() - 1) {
+                if s == include_str_name[0] {
                     return false;
                 } else if include_str_name[1..]
                     .iter()
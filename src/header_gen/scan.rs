@@ -0,0 +1,298 @@
+// Vectorized byte scanning primitives used by the lexer.
+//
+// Every function here has a scalar fallback and returns exactly what the scalar
+// version returns. On x86_64, SSE2 is always available and AVX2 is picked at runtime
+// when the CPU supports it.
+
+/// Returns true if `byte` ends an `Object` token (it maps to a symbol/whitespace token).
+#[inline]
+pub fn is_terminator(byte: u8) -> bool {
+    (byte as usize) < TERMINATORS.len() && TERMINATORS[byte as usize]
+}
+
+/// Classifies the input 64 bytes at a time into bitmasks (identifier bytes and spaces),
+/// so finding the end of an identifier or a whitespace run is a shift and a
+/// trailing-zero count instead of a byte loop. Most tokens are a few bytes long, so one
+/// classified block serves a dozen or so tokens.
+pub struct ByteClasses<'b> {
+    bytes: &'b [u8],
+    base: usize,
+    ident: u64,
+    space: u64,
+}
+
+impl<'b> ByteClasses<'b> {
+    pub fn new(bytes: &'b [u8]) -> Self {
+        let mut classes = Self {
+            bytes,
+            base: 0,
+            ident: 0,
+            space: 0,
+        };
+        classes.load(0);
+        classes
+    }
+
+    /// Returns the index of the first byte at or after `from` that terminates an object
+    /// (identifier, number, keyword, ...). Returns `bytes.len()` if there is none.
+    #[inline]
+    pub fn find_object_end(&mut self, mut from: usize) -> usize {
+        loop {
+            // Identifier characters are by far the most common object bytes, so skip those
+            // in bulk and only classify the odd byte (quotes, non-ascii, ...) by hand.
+            from = self.skip(from, Class::Ident);
+            if from >= self.bytes.len() || is_terminator(self.bytes[from]) {
+                return from;
+            }
+            from += 1;
+        }
+    }
+
+    /// Returns the number of consecutive spaces starting at `from`
+    #[inline]
+    pub fn count_spaces(&mut self, from: usize) -> usize {
+        self.skip(from, Class::Space) - from
+    }
+
+    #[inline]
+    fn skip(&mut self, mut from: usize, class: Class) -> usize {
+        while from < self.bytes.len() {
+            if from < self.base || from >= self.base + 64 {
+                self.load(from & !63);
+            }
+            let mask = match class {
+                Class::Ident => self.ident,
+                Class::Space => self.space,
+            };
+            let others = !mask >> (from - self.base);
+            if others != 0 {
+                return (from + others.trailing_zeros() as usize).min(self.bytes.len());
+            }
+            from = self.base + 64;
+        }
+        self.bytes.len()
+    }
+
+    #[inline(never)]
+    fn load(&mut self, base: usize) {
+        self.base = base;
+        if base + 64 <= self.bytes.len() {
+            #[cfg(target_arch = "x86_64")]
+            {
+                (self.ident, self.space) = if is_x86_feature_detected!("avx2") {
+                    unsafe { x86::classify_avx2(&self.bytes[base..(base + 64)]) }
+                } else {
+                    unsafe { x86::classify_sse2(&self.bytes[base..(base + 64)]) }
+                };
+                return;
+            }
+        }
+
+        // Tail of the input (or no SIMD): bits past the end stay 0, which reads as
+        // "not in class" and stops any skip at `bytes.len()`
+        let end = (base + 64).min(self.bytes.len());
+        (self.ident, self.space) = classify_scalar(&self.bytes[base.min(end)..end]);
+    }
+}
+
+#[derive(Clone, Copy)]
+enum Class {
+    Ident,
+    Space,
+}
+
+/// Returns the index of the first occurrence of `needle` at or after `from`
+#[inline]
+pub fn find_byte(bytes: &[u8], from: usize, needle: u8) -> Option<usize> {
+    find_either(bytes, from, needle, needle)
+}
+
+/// Returns the index of the first occurrence of `a` or `b` at or after `from`.
+/// Used for comments and string literals, which are long enough for AVX2 to pay off.
+#[inline]
+pub fn find_either(bytes: &[u8], from: usize, a: u8, b: u8) -> Option<usize> {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return unsafe { x86::find_either_avx2(bytes, from, a, b) };
+        }
+        return unsafe { x86::find_either_sse2(bytes, from, a, b) };
+    }
+
+    #[allow(unreachable_code)]
+    find_either_scalar(bytes, from, a, b)
+}
+
+/// Returns the index just past the `*/` that closes a block comment, searching from `from`.
+/// Returns `bytes.len()` if the comment is never closed.
+#[inline]
+pub fn find_block_comment_end(bytes: &[u8], mut from: usize) -> usize {
+    while let Some(star) = find_byte(bytes, from, b'*') {
+        if star + 1 < bytes.len() && bytes[star + 1] == b'/' {
+            return star + 2;
+        }
+        from = star + 1;
+    }
+    bytes.len()
+}
+
+#[inline]
+fn is_ident(byte: u8) -> bool {
+    byte.is_ascii_alphanumeric() || byte == b'_'
+}
+
+/// Returns (identifier mask, space mask) for up to 64 bytes
+fn classify_scalar(block: &[u8]) -> (u64, u64) {
+    let mut ident = 0;
+    let mut space = 0;
+    for (i, &b) in block.iter().enumerate() {
+        ident |= (is_ident(b) as u64) << i;
+        space |= ((b == b' ') as u64) << i;
+    }
+    (ident, space)
+}
+
+fn find_either_scalar(bytes: &[u8], from: usize, a: u8, b: u8) -> Option<usize> {
+    bytes[from..]
+        .iter()
+        .position(|&c| c == a || c == b)
+        .map(|i| i + from)
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+
+    // The SIMD loops only ever do full-width unaligned loads that lie inside `bytes`;
+    // the remaining tail (< one vector) is handled by the scalar versions.
+
+    /// Lanes set to 0xFF where `v` is in `[lo, lo + span]` (unsigned)
+    #[inline(always)]
+    unsafe fn in_range_128(v: __m128i, lo: u8, span: u8) -> __m128i {
+        let t = _mm_sub_epi8(v, _mm_set1_epi8(lo as i8));
+        _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(span as i8)), t)
+    }
+
+    #[inline(always)]
+    unsafe fn in_range_256(v: __m256i, lo: u8, span: u8) -> __m256i {
+        let t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo as i8));
+        _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(span as i8)), t)
+    }
+
+    /// `block` must be exactly 64 bytes
+    pub unsafe fn classify_sse2(block: &[u8]) -> (u64, u64) {
+        let mut ident = 0;
+        let mut space = 0;
+        for lane in 0..4 {
+            let v = _mm_loadu_si128(block.as_ptr().add(lane * 16) as *const __m128i);
+            let lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            let alpha = in_range_128(lower, b'a', b'z' - b'a');
+            let digit = in_range_128(v, b'0', b'9' - b'0');
+            let under = _mm_cmpeq_epi8(v, _mm_set1_epi8(b'_' as i8));
+            let is_ident = _mm_or_si128(_mm_or_si128(alpha, digit), under);
+            let is_space = _mm_cmpeq_epi8(v, _mm_set1_epi8(b' ' as i8));
+
+            ident |= (_mm_movemask_epi8(is_ident) as u16 as u64) << (lane * 16);
+            space |= (_mm_movemask_epi8(is_space) as u16 as u64) << (lane * 16);
+        }
+        (ident, space)
+    }
+
+    /// `block` must be exactly 64 bytes
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn classify_avx2(block: &[u8]) -> (u64, u64) {
+        let mut ident = 0;
+        let mut space = 0;
+        for lane in 0..2 {
+            let v = _mm256_loadu_si256(block.as_ptr().add(lane * 32) as *const __m256i);
+            let lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            let alpha = in_range_256(lower, b'a', b'z' - b'a');
+            let digit = in_range_256(v, b'0', b'9' - b'0');
+            let under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b'_' as i8));
+            let is_ident = _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+            let is_space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b' ' as i8));
+
+            ident |= (_mm256_movemask_epi8(is_ident) as u32 as u64) << (lane * 32);
+            space |= (_mm256_movemask_epi8(is_space) as u32 as u64) << (lane * 32);
+        }
+        (ident, space)
+    }
+
+    #[inline]
+    pub unsafe fn find_either_sse2(bytes: &[u8], mut from: usize, a: u8, b: u8) -> Option<usize> {
+        let ptr = bytes.as_ptr();
+        let splat_a = _mm_set1_epi8(a as i8);
+        let splat_b = _mm_set1_epi8(b as i8);
+        while from + 16 <= bytes.len() {
+            let v = _mm_loadu_si128(ptr.add(from) as *const __m128i);
+            let hits = _mm_or_si128(_mm_cmpeq_epi8(v, splat_a), _mm_cmpeq_epi8(v, splat_b));
+            let mask = _mm_movemask_epi8(hits) as u32;
+            if mask != 0 {
+                return Some(from + mask.trailing_zeros() as usize);
+            }
+            from += 16;
+        }
+        super::find_either_scalar(bytes, from, a, b)
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn find_either_avx2(bytes: &[u8], mut from: usize, a: u8, b: u8) -> Option<usize> {
+        let ptr = bytes.as_ptr();
+        let splat_a = _mm256_set1_epi8(a as i8);
+        let splat_b = _mm256_set1_epi8(b as i8);
+        while from + 32 <= bytes.len() {
+            let v = _mm256_loadu_si256(ptr.add(from) as *const __m256i);
+            let hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, splat_a), _mm256_cmpeq_epi8(v, splat_b));
+            let mask = _mm256_movemask_epi8(hits) as u32;
+            if mask != 0 {
+                return Some(from + mask.trailing_zeros() as usize);
+            }
+            from += 32;
+        }
+        find_either_sse2(bytes, from, a, b)
+    }
+}
+
+// Bytes that map to a symbol or whitespace token (mirrors `lexer_c::TOKEN_MAPPING`)
+const TERMINATORS: [bool; 128] = {
+    let mut table = [false; 128];
+    let symbols = b"\t\n !#$%&()*+,-./:;<=>?@[\\]^`{|}~";
+    let mut i = 0;
+    while i < symbols.len() {
+        table[symbols[i] as usize] = true;
+        i += 1;
+    }
+    table
+};
+
+#[cfg(test)]
+mod scan_tests {
+    use super::*;
+
+    fn sample() -> Vec<u8> {
+        let mut s = String::new();
+        for i in 0..40 {
+            s.push_str(&"a_Z9".repeat(i % 11));
+            s.push_str(&" ".repeat(i % 37));
+            s.push_str(["\"", "'", "é", "\n", "*/", "*", "\t", "@"][i % 8]);
+        }
+        s.into_bytes()
+    }
+
+    #[test]
+    fn test_scan_matches_scalar() {
+        let bytes = sample();
+        let mut classes = ByteClasses::new(&bytes);
+        for from in (0..bytes.len()).chain((0..bytes.len()).rev()) {
+            let ident_end = from + bytes[from..].iter().take_while(|&&b| is_ident(b)).count();
+            let spaces = bytes[from..].iter().take_while(|&&b| b == b' ').count();
+
+            assert_eq!(classes.skip(from, Class::Ident), ident_end);
+            assert_eq!(classes.count_spaces(from), spaces);
+            assert_eq!(
+                find_either(&bytes, from, b'"', b'\n'),
+                find_either_scalar(&bytes, from, b'"', b'\n')
+            );
+        }
+    }
+}
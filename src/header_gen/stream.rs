@@ -0,0 +1,311 @@
+// Lexes an input in bounded chunks instead of all at once.
+//
+// Generated sources (lookup tables, protocol codecs) can run to hundreds of megabytes,
+// and a `TokenBuffer` of the whole file costs five bytes per token on top of that. The
+// chunked lexer reads the input a chunk at a time and only cuts it where no token spans
+// the cut, so lexing the chunks one after another yields exactly the tokens lexing the
+// whole input would. The state the cut depends on (inside a comment or a string literal,
+// after a line continuation, the brace depth, inside a directive) is carried from one
+// chunk to the next.
+
+use std::io::{ErrorKind, Read};
+
+use anyhow::{anyhow, Result};
+
+use super::context::LexerContext;
+use super::lexer_c::TokenBuffer;
+use super::scan;
+
+/// Inputs at least this large are worth lexing in chunks
+pub const STREAM_THRESHOLD: usize = 16 << 20;
+
+pub const DEFAULT_CHUNK_SIZE: usize = 1 << 20;
+
+/// Where a chunk sits in the whole input, and the state of the input at that point
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ChunkStart {
+    /// Byte offset of the chunk's first byte
+    pub offset: usize,
+    /// 1-based line the chunk starts on
+    pub line: usize,
+    /// Index of the chunk's first token among all tokens of the input
+    pub token: usize,
+    /// Number of `{` not yet closed before the chunk
+    pub depth: usize,
+    /// Whether the chunk starts inside a preprocessor directive (a directive longer than
+    /// a chunk is the only way it can)
+    pub directive: bool,
+}
+
+impl Default for ChunkStart {
+    fn default() -> Self {
+        Self {
+            offset: 0,
+            line: 1,
+            token: 0,
+            depth: 0,
+            directive: false,
+        }
+    }
+}
+
+pub struct Chunk<'b> {
+    pub start: ChunkStart,
+    pub tokens: TokenBuffer<'b>,
+}
+
+/// Lexes the input read from `reader` one chunk of about `chunk_size` bytes at a time.
+/// Only a token longer than a chunk (a huge comment, say) makes it hold more than that.
+pub struct ChunkedLexer<R: Read> {
+    reader: R,
+    chunk_size: usize,
+    eof: bool,
+    buf: Vec<u8>,
+    /// Where `buf` starts in the input
+    start: ChunkStart,
+    /// The bytes of `buf` the last chunk covered, the state after them and its token count
+    handed_out: Option<(Cut, usize)>,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Cut {
+    at: usize,
+    depth: usize,
+    directive: bool,
+}
+
+impl<R: Read> ChunkedLexer<R> {
+    pub fn new(reader: R) -> Self {
+        Self::with_chunk_size(reader, DEFAULT_CHUNK_SIZE)
+    }
+
+    pub fn with_chunk_size(reader: R, chunk_size: usize) -> Self {
+        Self {
+            reader,
+            chunk_size: chunk_size.max(1),
+            eof: false,
+            buf: Vec::new(),
+            start: ChunkStart::default(),
+            handed_out: None,
+        }
+    }
+
+    /// Lexes the next chunk with the buffers of `ctx`. Give the tokens back with
+    /// `ctx.recycle_tokens` before asking for the next one, so every chunk reuses them.
+    pub fn next_chunk(&mut self, ctx: &mut LexerContext) -> Result<Option<Chunk<'_>>> {
+        if let Some((cut, tokens)) = self.handed_out.take() {
+            let newlines = self.buf[..cut.at].iter().filter(|&&b| b == b'\n').count();
+            self.start = ChunkStart {
+                offset: self.start.offset + cut.at,
+                line: self.start.line + newlines,
+                token: self.start.token + tokens,
+                depth: cut.depth,
+                directive: cut.directive,
+            };
+            self.buf.drain(..cut.at);
+        }
+
+        let mut want = self.chunk_size;
+        let cut = loop {
+            self.fill(want)?;
+            if self.eof {
+                if self.buf.is_empty() {
+                    return Ok(None);
+                }
+                // The rest of the input, the state after it doesn't matter
+                break Cut {
+                    at: self.buf.len(),
+                    depth: 0,
+                    directive: false,
+                };
+            }
+            match find_cut(&self.buf, self.start.depth, self.start.directive) {
+                Some(cut) => break cut,
+                // A single token doesn't fit, read until it does
+                None => want = self.buf.len() * 2,
+            }
+        };
+
+        let code = std::str::from_utf8(&self.buf[..cut.at])
+            .map_err(|e| anyhow!("Input is not valid UTF-8 at byte {}: {}", self.start.offset + e.valid_up_to(), e))?;
+        let tokens = ctx.tokenize(code)?;
+        self.handed_out = Some((cut, tokens.len()));
+
+        Ok(Some(Chunk {
+            start: self.start,
+            tokens,
+        }))
+    }
+
+    /// Reads until `buf` holds `want` bytes or the input ends
+    fn fill(&mut self, want: usize) -> Result<()> {
+        let mut filled = self.buf.len();
+        if self.eof || filled >= want {
+            return Ok(());
+        }
+
+        self.buf.resize(want, 0);
+        while filled < want {
+            match self.reader.read(&mut self.buf[filled..]) {
+                Ok(0) => {
+                    self.eof = true;
+                    break;
+                }
+                Ok(n) => filled += n,
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => {
+                    self.buf.truncate(filled);
+                    return Err(anyhow!("Failed to read input: {}", e));
+                }
+            }
+        }
+        self.buf.truncate(filled);
+        Ok(())
+    }
+}
+
+/// Finds where to end a chunk of `bytes`, which start at a token boundary with brace depth
+/// `depth`. This follows the lexer's token rules byte for byte, so cuts only land between
+/// two tokens, and never after a token that the rest of `bytes` may still extend.
+///
+/// The best cut ends a top-level declaration, so the declaration scanners see each one
+/// whole. Failing that any line end will do (except one continued with `\`), and for a
+/// huge single line (a table of constants) the start of a token after `,` `;` `{` or `}`.
+/// An early cut still makes progress: there's no better cut after it, so the next chunk
+/// reaches at least as far as these `bytes` did.
+fn find_cut(bytes: &[u8], mut depth: usize, mut directive: bool) -> Option<Cut> {
+    let (mut declaration, mut line, mut token) = (None, None, None);
+
+    // What the current line looks like so far: whether nothing but whitespace and comments
+    // came yet, whether it ends in `\`, the first byte of its last significant token and
+    // whether that token was a separator. A line that only holds a comment doesn't end a
+    // declaration, the comment belongs to the one after it.
+    let (mut line_start, mut continued, mut last) = (true, false, 0u8);
+    let mut after_separator = false;
+
+    let mut i = 0;
+    while i < bytes.len() {
+        let byte = bytes[i];
+        match byte {
+            b' ' | b'\t' => {
+                i += 1;
+                continue;
+            }
+            b'\n' => {
+                i += 1;
+                if !continued {
+                    let cut = Cut { at: i, depth, directive: false };
+                    if depth == 0 && (directive || matches!(last, b';' | b'}')) {
+                        declaration = Some(cut);
+                    } else {
+                        line = Some(cut);
+                    }
+                    directive = false;
+                }
+                (line_start, continued, last, after_separator) = (true, false, 0, false);
+                continue;
+            }
+            b'/' if i + 1 == bytes.len() => break,
+            b'/' if matches!(bytes[i + 1], b'*' | b'/') => {
+                let end = if bytes[i + 1] == b'*' {
+                    let end = scan::find_block_comment_end(bytes, i + 2);
+                    (end >= i + 4 && bytes[..end].ends_with(b"*/")).then_some(end)
+                } else {
+                    scan::find_byte(bytes, i + 2, b'\n')
+                };
+                match end {
+                    Some(end) => i = end,
+                    None => break,
+                }
+                continued = false;
+                continue;
+            }
+            _ => {}
+        }
+
+        if after_separator && byte != b'#' {
+            token = Some(Cut { at: i, depth, directive });
+        }
+        let at_line_start = line_start;
+        (line_start, continued, last) = (false, byte == b'\\', byte);
+        after_separator = matches!(byte, b',' | b';' | b'{' | b'}');
+
+        match byte {
+            b'"' => match scan::find_either(bytes, i + 1, b'"', b'\n') {
+                Some(end) if bytes[end] == b'"' => i = end + 1,
+                // Not closed on its line, which fails to lex either way
+                Some(end) => i = end,
+                None => break,
+            },
+            b'{' => {
+                depth += 1;
+                i += 1;
+            }
+            b'}' => {
+                depth = depth.saturating_sub(1);
+                i += 1;
+            }
+            b'#' => {
+                directive |= at_line_start;
+                i += 1;
+            }
+            _ if scan::is_terminator(byte) => i += 1,
+            _ => match (i + 1..bytes.len()).find(|&j| scan::is_terminator(bytes[j])) {
+                Some(end) => i = end,
+                None => break,
+            },
+        }
+    }
+
+    declaration.or(line).or(token)
+}
+
+#[cfg(test)]
+mod stream_tests {
+    use std::fs;
+
+    use super::super::lexer_c::{tokenize_compact, Token, TokenSource};
+    use super::*;
+
+    #[test]
+    fn test_chunks_lex_like_the_whole_input() {
+        let mut code = fs::read_to_string("tests/lexer-UDT.c").unwrap();
+        code.push_str(
+            "/* a block comment\n * over, several; lines }\n */\n\
+             #define TWICE(x) \\\n    ((x) * 2)\n\
+             static const char *names[] = { \"a, b\", \"c; d\" }; // trailing, comment\n\
+             char quote = '\"', comma = ',';\n\
+             static const int table[] = {",
+        );
+        for i in 0..300 {
+            code.push_str(&format!("0x{:02x}, ", i % 256));
+        }
+        code.push_str("};\nint last(void) { return table[0]; }\n");
+        let whole = tokenize_compact(&code).unwrap();
+
+        for chunk_size in [1, 7, 64, 1000, code.len()] {
+            let mut lexer = ChunkedLexer::with_chunk_size(code.as_bytes(), chunk_size);
+            let mut ctx = LexerContext::default();
+            let mut count = 0;
+
+            while let Some(chunk) = lexer.next_chunk(&mut ctx).unwrap() {
+                let start = chunk.start;
+                assert_eq!(start.token, count);
+                assert_eq!(start.offset, whole.span(count).start);
+                assert_eq!(start.line, code[..start.offset].matches('\n').count() + 1);
+                let depth = (0..count).fold(0usize, |d, i| match whole.token_at(i) {
+                    Token::OpenCurlyBrace => d + 1,
+                    Token::CloseCurlyBrace => d.saturating_sub(1),
+                    _ => d,
+                });
+                assert_eq!(start.depth, depth);
+                for i in 0..chunk.tokens.len() {
+                    assert_eq!(chunk.tokens.token_at(i), whole.token_at(count + i), "chunk size {}", chunk_size);
+                }
+                count += chunk.tokens.len();
+                ctx.recycle_tokens(chunk.tokens);
+            }
+            assert_eq!(count, whole.len());
+        }
+    }
+}
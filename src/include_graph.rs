@@ -0,0 +1,391 @@
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+
+use anyhow::{anyhow, Result};
+
+use crate::header_gen::context;
+use crate::header_gen::includes::{include_target, IncludeTarget};
+use crate::header_gen::lexer_c::{self, TokenBuffer};
+use crate::header_gen::stream::{self, ChunkedLexer};
+use crate::source::SourceFile;
+use crate::utils;
+
+#[derive(Debug, Clone, Copy, PartialEq, clap::ValueEnum)]
+pub enum GraphFormat {
+    Table,
+    Dot,
+    Json,
+}
+
+/// The include graph of a set of translation units. Every file (TU or header) that is
+/// reached through `#include` is a node; headers that can't be found in any search dir
+/// are kept as unresolved leaves so they still show up in the report.
+///
+/// The graph is built from the lexer alone: every `#include` is followed, including ones
+/// behind `#if`s, and each header is counted once per TU (as if it had include guards).
+pub struct IncludeGraph {
+    nodes: Vec<Node>,
+    index: HashMap<PathBuf, usize>,
+}
+
+struct Node {
+    name: String,
+    kind: NodeKind,
+    lines: usize,
+    bytes: usize,
+    edges: Vec<usize>,
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum NodeKind {
+    Unit,
+    Header,
+    Unresolved,
+}
+
+/// What a header costs the build: it is parsed `tus` times, and each time it brings in
+/// `lines`/`bytes` of text (itself plus everything it includes, counted once)
+#[derive(Debug)]
+pub struct HeaderCost {
+    pub name: String,
+    pub tus: usize,
+    pub lines: usize,
+    pub bytes: usize,
+    pub cost: usize,
+}
+
+struct ScannedFile {
+    lines: usize,
+    bytes: usize,
+    includes: Vec<ResolvedInclude>,
+}
+
+enum ResolvedInclude {
+    Found(PathBuf),
+    Missing(String),
+}
+
+impl IncludeGraph {
+    /// Builds the graph reachable from `units`. Quoted includes are looked up next to the
+    /// including file first and then in `search_dirs`, angled includes in `search_dirs`
+    /// only. Node names are shown relative to `root` when they live under it.
+    pub fn build(units: &[PathBuf], search_dirs: &[PathBuf], root: &Path) -> Result<Self> {
+        let mut graph = Self {
+            nodes: vec![],
+            index: HashMap::new(),
+        };
+
+        let mut frontier = vec![];
+        for unit in units {
+            let path = fs::canonicalize(unit).map_err(|e| anyhow!("Failed to open {:?}: {}", unit, e))?;
+            if !graph.index.contains_key(&path) {
+                graph.add_node(path.clone(), display_name(&path, root), NodeKind::Unit);
+                frontier.push(path);
+            }
+        }
+
+        // Breadth first, one level at a time, so each level can be lexed in parallel
+        while !frontier.is_empty() {
+            let scanned = utils::par_map(&frontier, |path| scan_file(path, search_dirs));
+
+            let mut next = vec![];
+            for (path, scanned) in frontier.iter().zip(scanned) {
+                let id = graph.index[path];
+                let scanned = match scanned {
+                    Ok(s) => s,
+                    Err(e) if graph.nodes[id].kind == NodeKind::Unit => return Err(e),
+                    // A header we can't read or lex is kept as a leaf
+                    Err(_) => continue,
+                };
+
+                let mut edges = Vec::with_capacity(scanned.includes.len());
+                for include in scanned.includes {
+                    let (key, name, kind) = match include {
+                        ResolvedInclude::Found(p) => {
+                            let name = display_name(&p, root);
+                            (p, name, NodeKind::Header)
+                        }
+                        ResolvedInclude::Missing(name) => (PathBuf::from(&name), name, NodeKind::Unresolved),
+                    };
+                    let child = match graph.index.get(&key) {
+                        Some(&child) => child,
+                        None => {
+                            if kind == NodeKind::Header {
+                                next.push(key.clone());
+                            }
+                            graph.add_node(key, name, kind)
+                        }
+                    };
+                    if !edges.contains(&child) {
+                        edges.push(child);
+                    }
+                }
+
+                let node = &mut graph.nodes[id];
+                node.lines = scanned.lines;
+                node.bytes = scanned.bytes;
+                node.edges = edges;
+            }
+            frontier = next;
+        }
+
+        Ok(graph)
+    }
+
+    fn add_node(&mut self, key: PathBuf, name: String, kind: NodeKind) -> usize {
+        let id = self.nodes.len();
+        self.nodes.push(Node {
+            name,
+            kind,
+            lines: 0,
+            bytes: 0,
+            edges: vec![],
+        });
+        self.index.insert(key, id);
+        id
+    }
+
+    /// Marks every node reachable from `start` (including itself) with `stamp`
+    /// and returns them
+    fn reachable(&self, start: usize, seen: &mut [usize], stamp: usize) -> Vec<usize> {
+        let mut out = vec![start];
+        seen[start] = stamp;
+        let mut i = 0;
+        while i < out.len() {
+            for &child in &self.nodes[out[i]].edges {
+                if seen[child] != stamp {
+                    seen[child] = stamp;
+                    out.push(child);
+                }
+            }
+            i += 1;
+        }
+        out
+    }
+
+    /// Returns the cost of every header, most expensive first
+    pub fn costs(&self) -> Vec<HeaderCost> {
+        let mut seen = vec![usize::MAX; self.nodes.len()];
+        let mut tus = vec![0; self.nodes.len()];
+        for id in 0..self.nodes.len() {
+            if self.nodes[id].kind == NodeKind::Unit {
+                for reached in self.reachable(id, &mut seen, id) {
+                    tus[reached] += 1;
+                }
+            }
+        }
+
+        let mut costs = vec![];
+        for id in 0..self.nodes.len() {
+            if self.nodes[id].kind == NodeKind::Unit {
+                continue;
+            }
+            let closure = self.reachable(id, &mut seen, self.nodes.len() + id);
+            let lines = closure.iter().map(|&n| self.nodes[n].lines).sum();
+            let bytes: usize = closure.iter().map(|&n| self.nodes[n].bytes).sum();
+            costs.push(HeaderCost {
+                name: self.nodes[id].name.clone(),
+                tus: tus[id],
+                lines,
+                bytes,
+                cost: tus[id] * bytes,
+            });
+        }
+
+        costs.sort_by(|a, b| b.cost.cmp(&a.cost).then_with(|| a.name.cmp(&b.name)));
+        costs
+    }
+
+    pub fn to_table(&self, costs: &[HeaderCost]) -> String {
+        let width = costs.iter().map(|c| c.name.len()).max().unwrap_or(0).max("Header".len());
+        let mut out = String::new();
+        let _ = writeln!(
+            out,
+            "{:<width$}  {:>5}  {:>9}  {:>11}  {:>14}",
+            "Header", "TUs", "Lines", "Bytes", "Cost (TUs*B)"
+        );
+        for c in costs {
+            let _ = writeln!(
+                out,
+                "{:<width$}  {:>5}  {:>9}  {:>11}  {:>14}",
+                c.name, c.tus, c.lines, c.bytes, c.cost
+            );
+        }
+        out
+    }
+
+    pub fn to_dot(&self, costs: &[HeaderCost]) -> String {
+        let by_name: HashMap<&str, &HeaderCost> = costs.iter().map(|c| (c.name.as_str(), c)).collect();
+
+        let mut out = String::from("digraph includes {\n    rankdir=LR;\n");
+        for (id, node) in self.nodes.iter().enumerate() {
+            let label = match by_name.get(node.name.as_str()) {
+                Some(c) => format!("{}\\n{} TUs, {} lines", node.name, c.tus, c.lines),
+                None => node.name.clone(),
+            };
+            let shape = match node.kind {
+                NodeKind::Unit => "box",
+                NodeKind::Header => "ellipse",
+                NodeKind::Unresolved => "plaintext",
+            };
+            let _ = writeln!(out, "    n{} [label=\"{}\", shape={}];", id, label.replace('"', "\\\""), shape);
+        }
+        for (id, node) in self.nodes.iter().enumerate() {
+            for child in &node.edges {
+                let _ = writeln!(out, "    n{} -> n{};", id, child);
+            }
+        }
+        out.push_str("}\n");
+        out
+    }
+
+    pub fn to_json(&self, costs: &[HeaderCost]) -> String {
+        let by_name: HashMap<&str, &HeaderCost> = costs.iter().map(|c| (c.name.as_str(), c)).collect();
+
+        let nodes: Vec<_> = self
+            .nodes
+            .iter()
+            .enumerate()
+            .map(|(id, node)| {
+                let kind = match node.kind {
+                    NodeKind::Unit => "tu",
+                    NodeKind::Header => "header",
+                    NodeKind::Unresolved => "unresolved",
+                };
+                let mut value = serde_json::json!({
+                    "id": id,
+                    "name": node.name,
+                    "kind": kind,
+                    "lines": node.lines,
+                    "bytes": node.bytes,
+                    "includes": node.edges,
+                });
+                if let Some(c) = by_name.get(node.name.as_str()) {
+                    value["tus"] = c.tus.into();
+                    value["transitive_lines"] = c.lines.into();
+                    value["transitive_bytes"] = c.bytes.into();
+                    value["cost"] = c.cost.into();
+                }
+                value
+            })
+            .collect();
+
+        serde_json::to_string_pretty(&serde_json::json!({ "nodes": nodes })).unwrap()
+    }
+}
+
+fn scan_file(path: &Path, search_dirs: &[PathBuf]) -> Result<ScannedFile> {
+    let file = SourceFile::open(path)?;
+    let code = file.as_str();
+    let mut ctx = context::thread_context();
+
+    let parent = path.parent().unwrap_or(Path::new("."));
+    let mut includes = vec![];
+    let mut add_includes = |tokens: &TokenBuffer| {
+        for span in lexer_c::get_include_spans(tokens) {
+            let resolved = match include_target(&tokens.view(span)) {
+                Some(IncludeTarget::Local(name)) => {
+                    resolve(&name, Some(parent), search_dirs).ok_or_else(|| format!("\"{}\"", name))
+                }
+                Some(IncludeTarget::System(name)) => {
+                    resolve(&name, None, search_dirs).ok_or_else(|| format!("<{}>", name))
+                }
+                // Computed includes (`#include MACRO`) can't be followed
+                None => continue,
+            };
+            includes.push(match resolved {
+                Ok(p) => ResolvedInclude::Found(p),
+                Err(name) => ResolvedInclude::Missing(name),
+            });
+        }
+    };
+
+    if code.len() >= stream::STREAM_THRESHOLD {
+        let mut chunks = ChunkedLexer::new(code.as_bytes());
+        while let Some(chunk) = chunks.next_chunk(&mut ctx)? {
+            add_includes(&chunk.tokens);
+            ctx.recycle_tokens(chunk.tokens);
+        }
+    } else {
+        let tokens = ctx.tokenize(code)?;
+        add_includes(&tokens);
+        ctx.recycle_tokens(tokens);
+    }
+
+    Ok(ScannedFile {
+        lines: code.lines().count(),
+        bytes: code.len(),
+        includes,
+    })
+}
+
+fn resolve(name: &str, local_dir: Option<&Path>, search_dirs: &[PathBuf]) -> Option<PathBuf> {
+    local_dir
+        .into_iter()
+        .chain(search_dirs.iter().map(|d| d.as_path()))
+        .map(|dir| dir.join(name))
+        .find(|p| p.is_file())
+        .and_then(|p| fs::canonicalize(p).ok())
+}
+
+fn display_name(path: &Path, root: &Path) -> String {
+    path.strip_prefix(root).unwrap_or(path).to_string_lossy().into_owned()
+}
+
+/// Asks `compiler` for its built-in `#include <...>` search list, so system headers can
+/// be followed too
+pub fn compiler_search_dirs(compiler: &str) -> Result<Vec<PathBuf>> {
+    let output = Command::new(compiler)
+        .args(["-xc", "-E", "-v", "-"])
+        .stdin(Stdio::null())
+        .stdout(Stdio::null())
+        .stderr(Stdio::piped())
+        .output()
+        .map_err(|e| anyhow!("Failed to run `{}`: {}", compiler, e))?;
+
+    let stderr = String::from_utf8_lossy(&output.stderr);
+    let dirs = stderr
+        .lines()
+        .skip_while(|l| !l.starts_with("#include <...> search starts here:"))
+        .skip(1)
+        .take_while(|l| !l.starts_with("End of search list."))
+        .map(|l| PathBuf::from(l.trim().trim_end_matches(" (framework directory)")))
+        .collect();
+    Ok(dirs)
+}
+
+#[cfg(test)]
+mod include_graph_tests {
+    use super::*;
+
+    #[test]
+    fn test_header_costs() {
+        let dir = tempfile::tempdir().unwrap();
+        let root = fs::canonicalize(dir.path()).unwrap();
+        let (src, inc) = (root.join("src"), root.join("include"));
+        fs::create_dir_all(&src).unwrap();
+        fs::create_dir_all(&inc).unwrap();
+
+        fs::write(inc.join("base.h"), "#define A 1\n#define B 2\n").unwrap();
+        fs::write(inc.join("list.h"), "#include \"base.h\"\nstruct List;\n").unwrap();
+        fs::write(src.join("a.c"), "#include <list.h>\n#include <stdio.h>\nint a;\n").unwrap();
+        fs::write(src.join("b.c"), "#include \"../include/base.h\"\n#include <list.h>\nint b;\n").unwrap();
+
+        let units = [src.join("a.c"), src.join("b.c")];
+        let graph = IncludeGraph::build(&units, &[inc.clone()], &root).unwrap();
+        let costs = graph.costs();
+
+        let base = costs.iter().find(|c| c.name == "include/base.h").unwrap();
+        assert_eq!((base.tus, base.lines, base.bytes, base.cost), (2, 2, 24, 48));
+
+        let list = costs.iter().find(|c| c.name == "include/list.h").unwrap();
+        assert_eq!((list.tus, list.lines, list.bytes), (2, 4, 24 + 31));
+        assert_eq!(costs[0].name, "include/list.h");
+
+        let stdio = costs.iter().find(|c| c.name == "<stdio.h>").unwrap();
+        assert_eq!((stdio.tus, stdio.cost), (1, 0));
+    }
+}
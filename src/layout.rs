@@ -0,0 +1,759 @@
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+
+use anyhow::{anyhow, Result};
+use gimli::{AttributeValue, Reader as _};
+use object::{Object, ObjectSection, ObjectSymbol, RelocationKind, RelocationTarget};
+
+use crate::header_gen::context;
+use crate::header_gen::lexer_c::{self, Token, TokenSource};
+use crate::utils;
+
+/// Bytes per cache line, unless told otherwise
+pub const CACHE_LINE: usize = 64;
+
+/// A struct definition found in the project's sources by the lexer
+#[derive(Debug, Clone)]
+pub struct StructDef {
+    /// The struct's tag, or its typedef name when it has no tag
+    pub name: String,
+    /// The typedef name of a tagged struct (`typedef struct foo {..} foo_t;`)
+    pub alias: Option<String>,
+    pub file: PathBuf,
+    /// 1-based line of the definition
+    pub line: usize,
+}
+
+impl StructDef {
+    pub fn is_named(&self, name: &str) -> bool {
+        self.name == name || self.alias.as_deref() == Some(name)
+    }
+}
+
+/// The layout of a struct as the compiler laid it out, read from the debug info
+#[derive(Debug, Clone, PartialEq)]
+pub struct StructLayout {
+    pub name: String,
+    pub size: usize,
+    pub align: usize,
+    /// In declaration order, which is also offset order
+    pub members: Vec<Member>,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Member {
+    pub name: String,
+    pub type_name: String,
+    pub offset: usize,
+    pub size: usize,
+    pub align: usize,
+    /// Bit offset from the start of the struct and width of a bit-field
+    pub bits: Option<(usize, usize)>,
+    /// A C++ base class rather than a field
+    pub base: bool,
+}
+
+impl Member {
+    /// Byte range the member occupies (for a bit-field, every byte holding one of its bits)
+    fn bytes(&self) -> (usize, usize) {
+        match self.bits {
+            Some((offset, width)) => (offset / 8, (offset + width).div_ceil(8)),
+            None => (self.offset, self.offset + self.size),
+        }
+    }
+}
+
+/// Unused bytes between two members
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Hole {
+    /// Index of the member the hole follows
+    pub after: usize,
+    pub offset: usize,
+    pub size: usize,
+}
+
+impl StructLayout {
+    pub fn holes(&self) -> Vec<Hole> {
+        let mut holes = vec![];
+        let mut end = 0;
+        for (i, member) in self.members.iter().enumerate() {
+            let (start, member_end) = member.bytes();
+            if i > 0 && start > end {
+                holes.push(Hole {
+                    after: i - 1,
+                    offset: end,
+                    size: start - end,
+                });
+            }
+            end = end.max(member_end);
+        }
+        holes
+    }
+
+    /// Unused bytes after the last member, there to keep the members of an array of the
+    /// struct aligned
+    pub fn padding(&self) -> usize {
+        let end = self.members.iter().map(|m| m.bytes().1).max().unwrap_or(0);
+        self.size.saturating_sub(end)
+    }
+
+    /// Members that start on one cache line and end on another, so reading one touches two
+    pub fn straddling(&self, cache_line: usize) -> impl Iterator<Item = &Member> {
+        self.members.iter().filter(move |m| {
+            let (start, end) = m.bytes();
+            end > start && start / cache_line != (end - 1) / cache_line
+        })
+    }
+
+    /// A member order that leaves no holes, and the size the struct would have with it,
+    /// if that's smaller than now. Members sorted by decreasing alignment never need a
+    /// hole: every size is a multiple of its alignment, and alignments are powers of two,
+    /// so each member ends aligned for the next one. Only the trailing padding up to the
+    /// struct's alignment is left, which no order can avoid.
+    ///
+    /// Structs with bit-fields, base classes or a flexible array member are left alone,
+    /// the compiler doesn't lay those out member by member.
+    pub fn reordered(&self) -> Option<(Vec<usize>, usize)> {
+        let flexible = self.members.last().is_some_and(|m| m.size == 0 && m.offset == self.size);
+        if flexible || self.members.iter().any(|m| m.bits.is_some() || m.base) {
+            return None;
+        }
+
+        let mut order: Vec<usize> = (0..self.members.len()).collect();
+        order.sort_by_key(|&i| std::cmp::Reverse(self.members[i].align));
+
+        let mut size = 0usize;
+        for &i in &order {
+            let member = &self.members[i];
+            size = size.next_multiple_of(member.align.max(1)) + member.size;
+        }
+        let size = size.next_multiple_of(self.align.max(1));
+
+        (size < self.size).then_some((order, size))
+    }
+
+    /// The layout in the style of `pahole`: members with their offset and size, holes,
+    /// cache line boundaries, a summary and the suggested order if there is one
+    pub fn to_text(&self, def: &StructDef, cache_line: usize) -> String {
+        let mut out = String::new();
+        let holes = self.holes();
+        let straddling: Vec<_> = self.straddling(cache_line).map(|m| m.name.as_str()).collect();
+
+        let _ = writeln!(out, "{} {{ /* {}:{} */", self.name, def.file.display(), def.line);
+        let mut line = 0;
+        for (i, member) in self.members.iter().enumerate() {
+            let (start, _) = member.bytes();
+            if start / cache_line > line {
+                line = start / cache_line;
+                let _ = writeln!(out, "    /* --- cacheline {} boundary ({} bytes) --- */", line, line * cache_line);
+            }
+
+            let decl = match (member.base, member.bits) {
+                (true, _) => format!("{} /* base */", member.type_name),
+                (false, Some((_, width))) => format!("{} {}:{};", member.type_name, member.name, width),
+                // Array dimensions go after the name, as declared
+                (false, None) => match member.type_name.find('[') {
+                    Some(dims) => format!("{} {}{};", &member.type_name[..dims], member.name, &member.type_name[dims..]),
+                    None => format!("{} {};", member.type_name, member.name),
+                },
+            };
+            let note = if straddling.contains(&member.name.as_str()) { " straddles a cacheline" } else { "" };
+            let _ = writeln!(out, "    {:<40} /* {:>5} {:>5}{} */", decl, member.offset, member.size, note);
+
+            for hole in holes.iter().filter(|h| h.after == i) {
+                let _ = writeln!(out, "    /* XXX {} byte hole */", hole.size);
+            }
+        }
+
+        let _ = writeln!(
+            out,
+            "    /* size: {}, cachelines: {}, holes: {}, sum holes: {}, padding: {} */",
+            self.size,
+            self.size.div_ceil(cache_line),
+            holes.len(),
+            holes.iter().map(|h| h.size).sum::<usize>(),
+            self.padding(),
+        );
+        if let Some((order, size)) = self.reordered() {
+            let names: Vec<_> = order.iter().map(|&i| self.members[i].name.as_str()).collect();
+            let _ = writeln!(out, "    /* reordered to {} bytes (saves {}): {} */", size, self.size - size, names.join(", "));
+        }
+        out.push_str("};\n");
+
+        out
+    }
+}
+
+/// The structs `code` (the contents of `path`) defines, found with the lexer's UDT scanner
+pub fn find_structs(path: &Path, code: &str) -> Result<Vec<StructDef>> {
+    let mut ctx = context::thread_context();
+    let tokens = ctx.tokenize(code)?;
+
+    let mut structs = vec![];
+    for span in lexer_c::get_udt_spans(&tokens) {
+        let udt = tokens.view(span.clone());
+        let mut significant = (0..udt.len())
+            .map(|i| (i, udt.token_at(i)))
+            .filter(|(_, t)| !matches!(t, Token::Space | Token::Tab | Token::NewLine | Token::BackSlash | Token::Comment(_)));
+
+        let (first, tok) = significant.next().unwrap();
+        let typedef = tok == Token::Object("typedef");
+        let keyword = if typedef { significant.next().map(|(_, t)| t) } else { Some(tok) };
+        if keyword != Some(Token::Object("struct")) {
+            continue;
+        }
+
+        let name = lexer_c::get_udt_name(&udt).to_string();
+        // The last name before the closing `;` at brace depth 0
+        let alias = typedef
+            .then(|| {
+                let mut depth = 0usize;
+                let mut alias = None;
+                for (_, tok) in significant {
+                    match tok {
+                        Token::OpenCurlyBrace => depth += 1,
+                        Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+                        Token::Object(obj) if depth == 0 => alias = Some(obj),
+                        _ => {}
+                    }
+                }
+                alias.filter(|&a| a != name).map(str::to_string)
+            })
+            .flatten();
+
+        let offset = tokens.span(span.start + first).start;
+        structs.push(StructDef {
+            name,
+            alias,
+            file: path.to_path_buf(),
+            line: code[..offset].matches('\n').count() + 1,
+        });
+    }
+    ctx.recycle_tokens(tokens);
+
+    Ok(structs)
+}
+
+/// How to compile a translation unit the way the build does (compiler, standard, include
+/// dirs), for its debug info
+pub struct Compiler {
+    pub program: String,
+    pub args: Vec<String>,
+}
+
+impl Compiler {
+    /// Compiles `unit` into the object file `out` with debug info for every type it
+    /// defines, even ones it doesn't use
+    fn debug_object(&self, unit: &Path, out: &Path) -> Result<()> {
+        let output = Command::new(&self.program)
+            .args(&self.args)
+            .args(["-g", "-O0", "-fno-eliminate-unused-debug-types", "-c"])
+            .arg(unit)
+            .arg("-o")
+            .arg(out)
+            .output()
+            .map_err(|e| anyhow!("Failed to run `{}`: {}", self.program, e))?;
+
+        if !output.status.success() {
+            return Err(anyhow!(
+                "Failed to compile {:?}:\n{}",
+                unit,
+                String::from_utf8_lossy(&output.stderr)
+            ));
+        }
+        Ok(())
+    }
+}
+
+/// The layouts of `structs`, each read from the debug info of the unit it's paired with.
+/// A header has no unit of its own; for `None` a unit that only includes the struct's
+/// file is compiled. A struct missing from its unit's debug info (behind an `#if`, say)
+/// gets an error.
+pub fn compile_layouts(compiler: &Compiler, structs: &[(StructDef, Option<PathBuf>)]) -> Result<Vec<Result<StructLayout>>> {
+    let tmp = tempfile::tempdir()?;
+    let (units, unit_of) = units(structs, tmp.path())?;
+
+    let objects = utils::par_map(&units.iter().enumerate().collect::<Vec<_>>(), |&(i, unit)| {
+        let object = tmp.path().join(format!("unit{}.o", i));
+        compiler.debug_object(unit, &object)?;
+        read_layouts(&object)
+    });
+
+    let mut layouts = vec![];
+    for ((def, _), idx) in structs.iter().zip(unit_of) {
+        let layout = match &objects[idx] {
+            Ok(found) => [Some(&def.name), def.alias.as_ref()]
+                .into_iter()
+                .flatten()
+                .find_map(|name| found.get(name))
+                .cloned()
+                .ok_or_else(|| anyhow!("`{}` isn't in the debug info of {:?}", def.name, units[idx])),
+            Err(e) => Err(anyhow!("{}", e)),
+        };
+        layouts.push(layout);
+    }
+
+    Ok(layouts)
+}
+
+/// The units to compile for `structs`, and the index of each struct's unit. One compile
+/// per unit, however many structs it's asked for: a header's structs share one probe unit,
+/// written to `dir`.
+fn units(structs: &[(StructDef, Option<PathBuf>)], dir: &Path) -> Result<(Vec<PathBuf>, Vec<usize>)> {
+    let mut units: Vec<PathBuf> = vec![];
+    let mut unit_of = vec![];
+    let mut probes: HashMap<PathBuf, PathBuf> = HashMap::new();
+    for (def, unit) in structs {
+        let unit = match unit {
+            Some(unit) => unit.clone(),
+            None => {
+                let header = def.file.canonicalize().unwrap_or_else(|_| def.file.clone());
+                match probes.get(&header) {
+                    Some(probe) => probe.clone(),
+                    None => {
+                        let probe = dir.join(format!("probe{}.c", probes.len()));
+                        fs::write(&probe, format!("#include \"{}\"\n", header.display()))?;
+                        probes.insert(header, probe.clone());
+                        probe
+                    }
+                }
+            }
+        };
+        let idx = units.iter().position(|u| *u == unit).unwrap_or_else(|| {
+            units.push(unit);
+            units.len() - 1
+        });
+        unit_of.push(idx);
+    }
+
+    Ok((units, unit_of))
+}
+
+/// Relocations of a debug section in an object file, by the offset they apply to. Offsets
+/// into `.debug_str` and the like are only filled in by the linker, so they have to be
+/// applied to read an object file before it's linked.
+#[derive(Debug, Default)]
+struct Relocations(HashMap<usize, u64>);
+
+impl gimli::Relocate for &Relocations {
+    fn relocate_address(&self, offset: usize, value: u64) -> gimli::Result<u64> {
+        Ok(self.0.get(&offset).copied().unwrap_or(value))
+    }
+
+    fn relocate_offset(&self, offset: usize, value: usize) -> gimli::Result<usize> {
+        Ok(self.0.get(&offset).map_or(value, |&v| v as usize))
+    }
+}
+
+type Reader<'d> = gimli::RelocateReader<gimli::EndianSlice<'d, gimli::RunTimeEndian>, &'d Relocations>;
+type Unit<'d> = gimli::Unit<Reader<'d>>;
+
+/// The layouts of every struct in the DWARF of `object`, by tag and by typedef name
+fn read_layouts(object: &Path) -> Result<HashMap<String, StructLayout>> {
+    let data = fs::read(object)?;
+    let file = object::File::parse(&*data).map_err(|e| anyhow!("Failed to read {:?}: {}", object, e))?;
+    let endian = match file.is_little_endian() {
+        true => gimli::RunTimeEndian::Little,
+        false => gimli::RunTimeEndian::Big,
+    };
+
+    let sections = gimli::DwarfSections::load(|id| load_section(&file, id.name()))?;
+    let dwarf = sections.borrow(|(data, relocations)| {
+        gimli::RelocateReader::new(gimli::EndianSlice::new(data, endian), relocations)
+    });
+
+    let mut layouts = HashMap::new();
+    let mut headers = dwarf.units();
+    while let Some(header) = headers.next()? {
+        let unit = dwarf.unit(header)?;
+        let mut entries = unit.entries();
+        while let Some((_, entry)) = entries.next_dfs()? {
+            let is_struct = matches!(entry.tag(), gimli::DW_TAG_structure_type | gimli::DW_TAG_class_type);
+            if !(is_struct || entry.tag() == gimli::DW_TAG_typedef) {
+                continue;
+            }
+            let Some(name) = die_name(&dwarf, &unit, entry)? else {
+                continue;
+            };
+            if layouts.contains_key(&name) {
+                continue;
+            }
+
+            let target = match is_struct {
+                true => Some(entry.offset()),
+                false => struct_behind(&unit, entry)?,
+            };
+            if let Some(target) = target {
+                if let Some(layout) = struct_layout(&dwarf, &unit, target)? {
+                    layouts.insert(name, layout);
+                }
+            }
+        }
+    }
+
+    Ok(layouts)
+}
+
+fn load_section<'d>(file: &object::File<'d>, name: &str) -> Result<(Cow<'d, [u8]>, Relocations)> {
+    let Some(section) = file.section_by_name(name) else {
+        return Ok((Cow::Borrowed(&[]), Relocations::default()));
+    };
+    let data = section.uncompressed_data()?;
+
+    let mut relocations = HashMap::new();
+    for (offset, reloc) in section.relocations() {
+        if reloc.kind() != RelocationKind::Absolute {
+            continue;
+        }
+        let base = match reloc.target() {
+            RelocationTarget::Symbol(idx) => file.symbol_by_index(idx)?.address(),
+            RelocationTarget::Section(idx) => file.section_by_index(idx)?.address(),
+            _ => continue,
+        };
+        let addend = match reloc.has_implicit_addend() {
+            true => {
+                let (start, len) = (offset as usize, (reloc.size() / 8) as usize);
+                let Some(bytes) = data.get(start..start + len).filter(|_| len <= 8) else {
+                    continue;
+                };
+                let mut buf = [0u8; 8];
+                match file.is_little_endian() {
+                    true => buf[..len].copy_from_slice(bytes),
+                    false => buf[8 - len..].copy_from_slice(bytes),
+                }
+                match file.is_little_endian() {
+                    true => i64::from_le_bytes(buf),
+                    false => i64::from_be_bytes(buf),
+                }
+            }
+            false => reloc.addend(),
+        };
+        relocations.insert(offset as usize, base.wrapping_add(addend as u64));
+    }
+
+    Ok((data, Relocations(relocations)))
+}
+
+type Entry<'a, 'd> = gimli::DebuggingInformationEntry<'a, 'a, Reader<'d>>;
+
+fn die_name<'d>(dwarf: &gimli::Dwarf<Reader<'d>>, unit: &Unit<'d>, entry: &Entry<'_, 'd>) -> Result<Option<String>> {
+    match entry.attr_value(gimli::DW_AT_name)? {
+        Some(value) => Ok(Some(dwarf.attr_string(unit, value)?.to_string_lossy()?.into_owned())),
+        None => Ok(None),
+    }
+}
+
+fn udata(entry: &Entry<'_, '_>, attr: gimli::DwAt) -> Result<Option<usize>> {
+    Ok(entry.attr_value(attr)?.and_then(|v| v.udata_value()).map(|v| v as usize))
+}
+
+fn type_ref(entry: &Entry<'_, '_>) -> Result<Option<gimli::UnitOffset>> {
+    match entry.attr_value(gimli::DW_AT_type)? {
+        Some(AttributeValue::UnitRef(offset)) => Ok(Some(offset)),
+        _ => Ok(None),
+    }
+}
+
+/// The struct a typedef names, through any further typedefs
+fn struct_behind(unit: &Unit<'_>, typedef: &Entry<'_, '_>) -> Result<Option<gimli::UnitOffset>> {
+    let mut next = type_ref(typedef)?;
+    for _ in 0..16 {
+        let Some(offset) = next else {
+            break;
+        };
+        let entry = unit.entry(offset)?;
+        match entry.tag() {
+            gimli::DW_TAG_structure_type | gimli::DW_TAG_class_type => return Ok(Some(offset)),
+            gimli::DW_TAG_typedef => next = type_ref(&entry)?,
+            _ => break,
+        }
+    }
+    Ok(None)
+}
+
+fn struct_layout<'d>(dwarf: &gimli::Dwarf<Reader<'d>>, unit: &Unit<'d>, offset: gimli::UnitOffset) -> Result<Option<StructLayout>> {
+    let entry = unit.entry(offset)?;
+    // A forward declaration, the definition is elsewhere
+    let Some(size) = udata(&entry, gimli::DW_AT_byte_size)? else {
+        return Ok(None);
+    };
+
+    let mut members = vec![];
+    let mut tree = unit.entries_tree(Some(offset))?;
+    let mut children = tree.root()?.children();
+    while let Some(child) = children.next()? {
+        let entry = child.entry();
+        let base = entry.tag() == gimli::DW_TAG_inheritance;
+        if !(base || entry.tag() == gimli::DW_TAG_member) {
+            continue;
+        }
+        // Static members have no location
+        let Some(offset) = member_location(entry)? else {
+            if let Some(bit_offset) = udata(entry, gimli::DW_AT_data_bit_offset)? {
+                members.push(member(dwarf, unit, entry, bit_offset / 8, base)?);
+            }
+            continue;
+        };
+        members.push(member(dwarf, unit, entry, offset, base)?);
+    }
+
+    let align = match udata(&entry, gimli::DW_AT_alignment)? {
+        Some(align) => align,
+        None => members.iter().map(|m| m.align).max().unwrap_or(1),
+    };
+    let tag = match entry.tag() {
+        gimli::DW_TAG_class_type => "class",
+        _ => "struct",
+    };
+    let name = match die_name(dwarf, unit, &entry)? {
+        Some(name) => format!("{} {}", tag, name),
+        None => format!("{} <anonymous>", tag),
+    };
+
+    Ok(Some(StructLayout { name, size, align, members }))
+}
+
+fn member<'d>(dwarf: &gimli::Dwarf<Reader<'d>>, unit: &Unit<'d>, entry: &Entry<'_, 'd>, offset: usize, base: bool) -> Result<Member> {
+    let ty = type_ref(entry)?;
+    let type_name = type_name(dwarf, unit, ty, 0)?;
+    let (size, align) = size_align(unit, ty, 0)?;
+
+    // DWARF 4+ gives the bit offset from the start of the struct, DWARF 2 and 3 the offset
+    // of the bit-field's high bit in its storage unit (for little-endian targets)
+    let bits = match udata(entry, gimli::DW_AT_bit_size)? {
+        Some(width) => match udata(entry, gimli::DW_AT_data_bit_offset)? {
+            Some(bit_offset) => Some((bit_offset, width)),
+            None => {
+                let storage = udata(entry, gimli::DW_AT_byte_size)?.unwrap_or(size);
+                let high = udata(entry, gimli::DW_AT_bit_offset)?.unwrap_or(0);
+                Some(((offset + storage) * 8 - high - width, width))
+            }
+        },
+        None => None,
+    };
+
+    Ok(Member {
+        name: die_name(dwarf, unit, entry)?.unwrap_or_default(),
+        type_name,
+        offset: bits.map_or(offset, |(bit_offset, _)| bit_offset / 8),
+        size: bits.map_or(size, |(_, width)| width.div_ceil(8)),
+        align,
+        bits,
+        base,
+    })
+}
+
+/// `DW_AT_data_member_location`, a constant or (before DWARF 4) a `DW_OP_plus_uconst`
+fn member_location(entry: &Entry<'_, '_>) -> Result<Option<usize>> {
+    match entry.attr_value(gimli::DW_AT_data_member_location)? {
+        Some(AttributeValue::Exprloc(expr)) => {
+            let mut reader = expr.0;
+            if reader.read_u8()? != gimli::DW_OP_plus_uconst.0 {
+                return Ok(None);
+            }
+            Ok(Some(reader.read_uleb128()? as usize))
+        }
+        Some(value) => Ok(value.udata_value().map(|v| v as usize)),
+        None => Ok(None),
+    }
+}
+
+/// Size and alignment of a type. DWARF only records an alignment the source asked for,
+/// otherwise it's the natural one: the size of a scalar, the largest of the members
+fn size_align(unit: &Unit<'_>, ty: Option<gimli::UnitOffset>, depth: usize) -> Result<(usize, usize)> {
+    let Some(offset) = ty.filter(|_| depth < 32) else {
+        return Ok((0, 1));
+    };
+    let entry = unit.entry(offset)?;
+    let size = udata(&entry, gimli::DW_AT_byte_size)?;
+    let explicit = udata(&entry, gimli::DW_AT_alignment)?;
+
+    let (size, align) = match entry.tag() {
+        gimli::DW_TAG_typedef
+        | gimli::DW_TAG_const_type
+        | gimli::DW_TAG_volatile_type
+        | gimli::DW_TAG_restrict_type
+        | gimli::DW_TAG_atomic_type => size_align(unit, type_ref(&entry)?, depth + 1)?,
+        gimli::DW_TAG_pointer_type
+        | gimli::DW_TAG_reference_type
+        | gimli::DW_TAG_rvalue_reference_type
+        | gimli::DW_TAG_ptr_to_member_type => {
+            let size = size.unwrap_or(unit.encoding().address_size as usize);
+            (size, size)
+        }
+        gimli::DW_TAG_base_type => {
+            let size = size.unwrap_or(1);
+            // `_Complex double` is two doubles
+            match entry.attr_value(gimli::DW_AT_encoding)? {
+                Some(AttributeValue::Encoding(gimli::DW_ATE_complex_float)) => (size, (size / 2).max(1)),
+                _ => (size, size.max(1)),
+            }
+        }
+        gimli::DW_TAG_enumeration_type => {
+            let size = size.unwrap_or(4);
+            (size, size.max(1))
+        }
+        gimli::DW_TAG_array_type => {
+            let (element, align) = size_align(unit, type_ref(&entry)?, depth + 1)?;
+            let mut count = 1;
+            let mut tree = unit.entries_tree(Some(offset))?;
+            let mut children = tree.root()?.children();
+            while let Some(child) = children.next()? {
+                let dim = child.entry();
+                if dim.tag() != gimli::DW_TAG_subrange_type {
+                    continue;
+                }
+                // No bound is a flexible array member
+                count *= match (udata(dim, gimli::DW_AT_count)?, udata(dim, gimli::DW_AT_upper_bound)?) {
+                    (Some(count), _) => count,
+                    (None, Some(upper)) => upper + 1,
+                    (None, None) => 0,
+                };
+            }
+            (size.unwrap_or(element * count), align)
+        }
+        gimli::DW_TAG_structure_type | gimli::DW_TAG_class_type | gimli::DW_TAG_union_type => {
+            let mut align = 1;
+            let mut tree = unit.entries_tree(Some(offset))?;
+            let mut children = tree.root()?.children();
+            while let Some(child) = children.next()? {
+                let member = child.entry();
+                if matches!(member.tag(), gimli::DW_TAG_member | gimli::DW_TAG_inheritance)
+                    && (member_location(member)?.is_some() || entry.tag() == gimli::DW_TAG_union_type)
+                {
+                    align = align.max(size_align(unit, type_ref(member)?, depth + 1)?.1);
+                }
+            }
+            (size.unwrap_or(0), align)
+        }
+        _ => (size.unwrap_or(0), size.unwrap_or(1).max(1)),
+    };
+
+    Ok((size, explicit.unwrap_or(align)))
+}
+
+/// The C spelling of a type, close enough to recognize it
+fn type_name<'d>(dwarf: &gimli::Dwarf<Reader<'d>>, unit: &Unit<'d>, ty: Option<gimli::UnitOffset>, depth: usize) -> Result<String> {
+    let Some(offset) = ty.filter(|_| depth < 32) else {
+        return Ok("void".to_string());
+    };
+    let entry = unit.entry(offset)?;
+    let name = die_name(dwarf, unit, &entry)?;
+    let inner = || type_name(dwarf, unit, type_ref(&entry)?, depth + 1);
+
+    Ok(match entry.tag() {
+        gimli::DW_TAG_pointer_type => format!("{} *", inner()?),
+        gimli::DW_TAG_reference_type => format!("{} &", inner()?),
+        gimli::DW_TAG_const_type => format!("const {}", inner()?),
+        gimli::DW_TAG_volatile_type => format!("volatile {}", inner()?),
+        gimli::DW_TAG_restrict_type => format!("{} restrict", inner()?),
+        gimli::DW_TAG_atomic_type => format!("_Atomic {}", inner()?),
+        gimli::DW_TAG_array_type => {
+            let mut dims = String::new();
+            let mut tree = unit.entries_tree(Some(offset))?;
+            let mut children = tree.root()?.children();
+            while let Some(child) = children.next()? {
+                let dim = child.entry();
+                match (udata(dim, gimli::DW_AT_count)?, udata(dim, gimli::DW_AT_upper_bound)?) {
+                    (Some(count), _) => {
+                        let _ = write!(dims, "[{}]", count);
+                    }
+                    (None, Some(upper)) => {
+                        let _ = write!(dims, "[{}]", upper + 1);
+                    }
+                    _ => dims.push_str("[]"),
+                }
+            }
+            format!("{}{}", inner()?, dims)
+        }
+        gimli::DW_TAG_structure_type => format!("struct {}", name.as_deref().unwrap_or("<anonymous>")),
+        gimli::DW_TAG_union_type => format!("union {}", name.as_deref().unwrap_or("<anonymous>")),
+        gimli::DW_TAG_enumeration_type => format!("enum {}", name.as_deref().unwrap_or("<anonymous>")),
+        gimli::DW_TAG_subroutine_type => "fn".to_string(),
+        _ => name.unwrap_or_else(|| "?".to_string()),
+    })
+}
+
+#[cfg(test)]
+mod layout_tests {
+    use super::*;
+
+    fn field(name: &str, offset: usize, size: usize) -> Member {
+        Member {
+            name: name.to_string(),
+            type_name: "int".to_string(),
+            offset,
+            size,
+            align: size,
+            bits: None,
+            base: false,
+        }
+    }
+
+    #[test]
+    fn test_holes_and_reordering() {
+        // struct { char a; double b; char c; int d; }
+        let layout = StructLayout {
+            name: "struct s".to_string(),
+            size: 24,
+            align: 8,
+            members: vec![field("a", 0, 1), field("b", 8, 8), field("c", 16, 1), field("d", 20, 4)],
+        };
+        assert_eq!(
+            layout.holes(),
+            vec![Hole { after: 0, offset: 1, size: 7 }, Hole { after: 2, offset: 17, size: 3 }]
+        );
+        assert_eq!(layout.padding(), 0);
+        assert_eq!(layout.reordered(), Some((vec![1, 3, 0, 2], 16)));
+        assert_eq!(layout.straddling(16).map(|m| m.name.as_str()).collect::<Vec<_>>(), Vec::<&str>::new());
+        assert_eq!(layout.straddling(4).map(|m| m.name.as_str()).collect::<Vec<_>>(), vec!["b"]);
+    }
+
+    #[test]
+    fn test_reads_compiled_layouts() {
+        let Ok(dir) = tempfile::tempdir() else {
+            return;
+        };
+        let header = dir.path().join("shapes.h");
+        let code = "#include <stdint.h>\n\n\
+                    struct packet {\n    char kind;\n    double value;\n    short id;\n    int line[20];\n};\n\n\
+                    // A tidy one\n\
+                    typedef struct {\n    uint64_t a;\n    uint32_t b;\n    unsigned flag : 1;\n} tidy_t;\n";
+        fs::write(&header, code).unwrap();
+
+        let structs = find_structs(&header, code).unwrap();
+        assert_eq!(structs.len(), 2);
+        assert_eq!((structs[0].name.as_str(), structs[0].line), ("packet", 3));
+        assert_eq!((structs[1].name.as_str(), structs[1].line), ("tidy_t", 11));
+
+        // Both structs of the header come from one probe
+        let pairs: Vec<_> = structs.into_iter().map(|s| (s, None)).collect();
+        let (units, unit_of) = units(&pairs, dir.path()).unwrap();
+        assert_eq!((units.len(), unit_of), (1, vec![0, 0]));
+
+        // Only where there's a C compiler to produce the debug info
+        let compiler = Compiler { program: "cc".to_string(), args: vec![] };
+        if Command::new("cc").arg("--version").output().is_err() {
+            return;
+        }
+        let layouts = compile_layouts(&compiler, &pairs).unwrap();
+
+        let packet = layouts[0].as_ref().unwrap();
+        assert_eq!(packet.name, "struct packet");
+        assert_eq!(packet.members.iter().map(|m| m.offset).collect::<Vec<_>>(), vec![0, 8, 16, 20]);
+        assert_eq!(packet.members[3].type_name, "int[20]");
+        assert_eq!(packet.size, 104);
+        assert_eq!(packet.holes().iter().map(|h| h.size).sum::<usize>(), 9);
+        assert_eq!(packet.padding(), 4);
+        assert_eq!(packet.reordered().map(|(_, size)| size), Some(96));
+        assert_eq!(packet.straddling(CACHE_LINE).map(|m| m.name.as_str()).collect::<Vec<_>>(), vec!["line"]);
+
+        let tidy = layouts[1].as_ref().unwrap();
+        assert_eq!(tidy.members[2].bits, Some((96, 1)));
+        assert_eq!(tidy.reordered(), None);
+    }
+}
@@ -1,22 +1,42 @@
+mod analysis_cache;
 mod build_sys;
 mod cli;
 mod config;
 mod constants;
 mod header_gen;
+mod include_graph;
+mod layout;
 mod local_dev;
 mod packaging;
+mod pot_analysis;
+mod source;
+mod source_index;
+mod symbol_index;
 mod testing;
 mod utils;
 
+use analysis_cache::AnalysisCache;
 use anyhow::{anyhow, Result};
 use clap::Parser;
-use config::Config;
-use constants::{CONFIG_FILE, DEV_ENV_CFG_FILE, PACKAGE_DIR, SEPARATOR};
-use header_gen::lexer_c;
+use config::{Config, KilnPot};
+use constants::{
+    ANALYSIS_CACHE_FILE, CONFIG_FILE, DEV_ENV_CFG_FILE, HEADER_MANIFEST_FILE, PACKAGE_DIR, SEPARATOR, SOURCE_INDEX_FILE, SYMBOL_INDEX_FILE,
+    SYMBOL_SOURCES_FILE,
+};
+use header_gen::inlining::InlineOptions;
+use header_gen::manifest::{FileHashes, HeaderManifest};
 use local_dev::{dev_env_config, editors};
 use packaging::package_manager::{self, PkgError};
-use std::{env, fs, io::Write, path::Path, process, time};
+use pot_analysis::PotAnalysis;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::cell::RefCell;
+use std::collections::BTreeSet;
+use std::{collections::HashSet, env, fs, io::Write, path::{Path, PathBuf}, process, thread, time};
 use strum::IntoEnumIterator;
+use source::SourceFile;
+use source_index::SourceIndex;
+use symbol_index::{Origin, SymbolIndex};
+use testing::rules::RuleSet;
 use testing::safety;
 use utils::Language;
 
@@ -103,6 +123,56 @@ async fn main() {
                 process::exit(1);
             }
         }
+        cli::Commands::IncludeGraph { format, system, top } => {
+            if let Err(e) = build_sys::validate_proj_repo(cwd.as_path()) {
+                println!("{}", e);
+                process::exit(1);
+            }
+            let config = config.unwrap();
+
+            if let Err(err) = handle_include_graph(&config, format, system, top) {
+                eprintln!("An error occurred while building the include graph:\n{}", err);
+                process::exit(1);
+            }
+        }
+        cli::Commands::Symbols { name, unused, json } => {
+            if let Err(e) = build_sys::validate_proj_repo(cwd.as_path()) {
+                println!("{}", e);
+                process::exit(1);
+            }
+            let config = config.unwrap();
+
+            if let Err(err) = handle_symbols(&config, name.as_deref(), unused, json) {
+                eprintln!("An error occurred while querying the symbol index:\n{}", err);
+                process::exit(1);
+            }
+        }
+        cli::Commands::Advise { subcommand } => match subcommand {
+            cli::AdviseSubCmd::Linkage { apply } => {
+                if let Err(e) = build_sys::validate_proj_repo(cwd.as_path()) {
+                    println!("{}", e);
+                    process::exit(1);
+                }
+                let config = config.unwrap();
+
+                if let Err(err) = handle_advise_linkage(&config, apply) {
+                    eprintln!("An error occurred while advising on linkage:\n{}", err);
+                    process::exit(1);
+                }
+            }
+        },
+        cli::Commands::Layout { types, cache_line } => {
+            if let Err(e) = build_sys::validate_proj_repo(cwd.as_path()) {
+                println!("{}", e);
+                process::exit(1);
+            }
+            let config = config.unwrap();
+
+            if let Err(err) = handle_layout(&config, &types, cache_line) {
+                eprintln!("An error occurred while reading struct layouts:\n{}", err);
+                process::exit(1);
+            }
+        }
         cli::Commands::Add { dep_uri } => {
             if let Err(e) = build_sys::validate_proj_repo(cwd.as_path()) {
                 println!("{}", e);
@@ -149,20 +219,19 @@ async fn main() {
             }
             let config = config.unwrap();
             handle_check_installs(&config).await;
+            let index = load_source_index(&config);
 
-            if let Err(e) = handle_warnings(&config) {
-                eprintln!("An error occurred during static analysis:\n{}", e);
-                process::exit(1);
-            }
-
-            for &b_type in config.project.build_type.iter() {
-                if let Err(e) = handle_build(&profile, &config, b_type) {
-                    eprintln!(
-                        "An error occurred while building the project (build mode {:?}):\n{}",
-                        b_type, e
-                    );
-                    process::exit(1);
+            let built = build_while_analyzing(&config, &index, |cancel| {
+                for &b_type in config.project.build_type.iter() {
+                    handle_build(&profile, &config, &index, b_type, cancel).map_err(|e| {
+                        anyhow!("An error occurred while building the project (build mode {:?}):\n{}", b_type, e)
+                    })?;
                 }
+                Ok(())
+            });
+            if let Err(e) = built {
+                eprintln!("{}", e);
+                process::exit(1);
             }
         }
         cli::Commands::Run {
@@ -181,13 +250,14 @@ async fn main() {
             }
 
             handle_check_installs(&config).await;
-
-            if let Err(e) = handle_warnings(&config) {
-                eprintln!("An error occurred during static analysis:\n{}", e);
-                process::exit(1);
-            }
-            if let Err(e) = handle_build(&profile, &config, config::BuildType::Exe) {
-                eprintln!("An error occurred while building the project:\n{}", e);
+            let index = load_source_index(&config);
+
+            let built = build_while_analyzing(&config, &index, |cancel| {
+                handle_build(&profile, &config, &index, config::BuildType::Exe, cancel)
+                    .map_err(|e| anyhow!("An error occurred while building the project:\n{}", e))
+            });
+            if let Err(e) = built {
+                eprintln!("{}", e);
                 process::exit(1);
             }
 
@@ -205,8 +275,9 @@ async fn main() {
             }
             let config = config.unwrap();
             handle_check_installs(&config).await;
+            let index = load_source_index(&config);
 
-            if let Err(e) = handle_warnings(&config) {
+            if let Err(e) = handle_warnings(&config, &index) {
                 eprintln!("An error occurred during static analysis:\n{}", e);
                 process::exit(1);
             }
@@ -214,7 +285,7 @@ async fn main() {
             for &b_type in config.project.build_type.iter() {
                 println!("BuildType: {:?}", b_type);
 
-                let comp_cmd = build_compilation_cmd(&profile, &config, b_type);
+                let comp_cmd = build_compilation_cmd(&profile, &config, &index, b_type);
 
                 match comp_cmd {
                     Ok(v) => {
@@ -258,13 +329,14 @@ async fn main() {
                 process::exit(1);
             }
 
+            let index = load_source_index(&config);
             let seperator = "=".repeat(40);
             println!("\n\n");
 
             for file in &files_to_test {
                 println!("{a}\n{b:?}\n{a}", a=seperator, b=file);
 
-                let res = handle_tests("--debug", &config, file);
+                let res = handle_tests("--debug", &config, &index, file);
                 if let Err(err) = res {
                     println!("{}", err);
                 }
@@ -330,31 +402,227 @@ async fn main() {
     }
 }
 
-/// Returns true if there were warnings and false if there was no warnings.
-fn handle_warnings(config: &Config) -> Result<Vec<safety::Warning>> {
+/// Brings `build/source-index.json` up to date with `src/` and returns it. Every phase
+/// of the invocation reads the project's sources through this one index.
+fn load_source_index(config: &Config) -> SourceIndex {
+    let cwd = env::current_dir().unwrap();
+    let index_path = cwd.join("build").join(SOURCE_INDEX_FILE);
+    let mut index = SourceIndex::load(&index_path);
+    let before = index.clone();
+
+    if let Err(e) = index.refresh(&cwd.join(config.get_src_dir())) {
+        eprintln!("Failed to scan the project's sources:\n{}", e);
+        process::exit(1);
+    }
+
+    if index != before {
+        let res = fs::create_dir_all(index_path.parent().unwrap())
+            .map_err(|e| anyhow!(e))
+            .and_then(|_| utils::write_atomic(&index_path, index.to_json()));
+        // A stale index on disk only costs a rescan next time
+        if let Err(e) = res {
+            eprintln!("Failed to save {:?}: {}", index_path, e);
+        }
+    }
+
+    index
+}
+
+/// Brings `build/symbols.idx` up to date with the project's sources (`index`), its
+/// headers and its pots' sources, and maps it. The index is only rebuilt when one of the
+/// source indexes it's built from was saved after it. `pots` are the pot analyses, from
+/// `load_pot_analyses`.
+fn load_symbol_index(config: &Config, index: &SourceIndex, pots: &[(KilnPot, PotAnalysis)]) -> Result<SymbolIndex> {
+    let cwd = env::current_dir()?;
+    let build_dir = cwd.join("build");
+    let symbols_path = build_dir.join(SYMBOL_INDEX_FILE);
+    let sources_path = build_dir.join(SYMBOL_SOURCES_FILE);
+
+    // Headers are keyed by their path in the project and pot sources by their absolute
+    // path, which is how the two are told apart below
+    let inc_dir = config.get_include_dir();
+    let mut paths = vec![];
+    if let Ok(dir) = fs::read_dir(cwd.join(&inc_dir)) {
+        for entry in dir.flatten() {
+            if let Some(name) = entry.file_name().to_str() {
+                if entry.path().is_file() {
+                    paths.push((format!("{}/{}", inc_dir.trim_end_matches('/'), name), entry.path()));
+                }
+            }
+        }
+    }
+    let mut sources = SourceIndex::load(&sources_path);
+    let before = sources.clone();
+    sources.refresh_paths(paths)?;
+
+    // Pots come with their sources already scanned
+    let extensions = build_sys::source_extensions(Language::new(&config.project.language)?);
+    for (_, analysis) in pots {
+        for (path, entry) in analysis.sources(extensions) {
+            sources.insert(path.to_string_lossy().into_owned(), entry.clone());
+        }
+    }
+    if sources != before {
+        fs::create_dir_all(&build_dir)?;
+        utils::write_atomic(&sources_path, sources.to_json())?;
+    }
+
+    let modified = |p: &Path| fs::metadata(p).and_then(|m| m.modified()).ok();
+    let up_to_date = modified(&symbols_path)
+        .is_some_and(|t| [build_dir.join(SOURCE_INDEX_FILE), sources_path].iter().all(|p| modified(p) <= Some(t)));
+    if up_to_date {
+        if let Ok(symbols) = SymbolIndex::open(&symbols_path) {
+            return Ok(symbols);
+        }
+    }
+
+    let files = index.files().map(|(name, entry)| (name, entry, Origin::Project)).chain(
+        sources.files().map(|(name, entry)| {
+            let origin = if Path::new(name).is_absolute() { Origin::Pot } else { Origin::Project };
+            (name, entry, origin)
+        }),
+    );
+    let symbols = SymbolIndex::build(files);
+    fs::create_dir_all(&build_dir)?;
+    utils::write_atomic(&symbols_path, symbols.as_bytes())?;
+
+    SymbolIndex::open(&symbols_path)
+}
+
+/// The stored analysis of every pot the project depends on (see `PotAnalysis`). A pot
+/// that can't be found or analyzed is left out, the build itself reports it properly.
+/// The pots are loaded in parallel.
+fn load_pot_analyses(config: &Config) -> Vec<(KilnPot, PotAnalysis)> {
+    let pots = build_sys::dep_pots(config).unwrap_or_default();
+    let analyses = utils::par_map(&pots, |pot| PotAnalysis::load_or_analyze(pot).ok());
+
+    pots.into_iter()
+        .zip(analyses)
+        .filter_map(|(pot, analysis)| Some((pot, analysis?)))
+        .collect()
+}
+
+/// Prints what the static analysis finds and returns the number of errors among it
+fn handle_warnings(config: &Config, index: &SourceIndex) -> Result<usize> {
     if !config.get_kiln_static_analysis() {
-        return Ok(vec![]);
+        return Ok(0);
+    }
+
+    let cwd = env::current_dir()?;
+    let cache_path = cwd.join("build").join(ANALYSIS_CACHE_FILE);
+    let rules = RuleSet::new(&config.get_static_analysis())?;
+    let mut cache = AnalysisCache::load(&cache_path, rules.fingerprint());
+    let before = cache.clone();
+
+    // Only files that changed since the last run are checked, and only pots that weren't
+    // there on the last run are loaded. A build that changed nothing replays the cache.
+    let files: Vec<(&str, u64)> = index
+        .files()
+        .filter(|(name, _)| name.ends_with(&config.project.language))
+        .map(|(name, entry)| (name, entry.hash))
+        .collect();
+    let stale = cache.stale(&files);
+    let pot_ids: Vec<String> = build_sys::dep_pots(config).unwrap_or_default().iter().map(KilnPot::id).collect();
+    let missing_pots = cache.missing_pots(&pot_ids);
+
+    let stale_set: HashSet<&str> = stale.iter().copied().collect();
+    let checked = safety::check_files(index.files().filter(|(name, _)| stale_set.contains(name)), &rules);
+    cache.set_files(&files, &stale, checked);
+
+    let pots = match missing_pots.is_empty() {
+        true => vec![],
+        false => load_pot_analyses(config),
+    };
+    let checked_pots = pots
+        .iter()
+        .filter(|(pot, _)| missing_pots.contains(&pot.id().as_str()))
+        .map(|(pot, analysis)| (pot.id(), analysis.warnings().to_vec()))
+        .collect();
+    cache.set_pots(&pot_ids, checked_pots);
+
+    if cache != before {
+        let res = fs::create_dir_all(cache_path.parent().unwrap())
+            .map_err(|e| anyhow!(e))
+            .and_then(|_| utils::write_atomic(&cache_path, cache.to_json()));
+        // Without the cache the next build just checks everything again
+        if let Err(e) = res {
+            eprintln!("Failed to save {:?}: {}", cache_path, e);
+        }
+    }
+
+    let src_dir = config.get_src_dir();
+    let mut warnings: Vec<_> = cache
+        .file_warnings()
+        .map(|w| safety::Warning {
+            filename: format!("{}/{}", src_dir.trim_end_matches('/'), w.filename),
+            ..w.clone()
+        })
+        .collect();
+
+    let extensions = build_sys::source_extensions(Language::new(&config.project.language)?);
+    for (pot, w) in cache.pot_warnings() {
+        if extensions.iter().any(|ext| w.filename.ends_with(ext)) && rules.keeps(&w.warning_type, &w.subject) {
+            warnings.push(safety::Warning {
+                filename: format!("{}/{}", pot, w.filename),
+                ..w.clone()
+            });
+        }
     }
 
-    let warnings = safety::check_files(&config.project.language)?;
+    if config.get_layout_warnings() {
+        warnings.extend(layout_warnings(config, index));
+    }
 
+    let mut errors = 0;
     for w in &warnings {
-        utils::print_warning(
-            "Kiln",
-            &w.filename,
-            &format!("{}", w.line),
-            &format!("{:?}", w.warning_type),
-            &w.msg,
-        );
+        let print = match rules.is_error(w) {
+            true => utils::print_error,
+            false => utils::print_warning,
+        };
+        errors += rules.is_error(w) as usize;
+        print("Kiln", &w.filename, &format!("{}", w.line), &format!("{:?}", w.warning_type), &w.msg);
     }
     if warnings.len() > 0 {
         println!("{}", *SEPARATOR);
     }
 
-    Ok(warnings)
+    Ok(errors)
 }
 
-fn build_compilation_cmd(profile: &str, config: &Config, build_type: config::BuildType) -> Result<Vec<String>> {
+/// Runs `build` while the static analysis runs on a thread of its own, so the warnings
+/// come out while the compiler works and a build takes as long as the slower of the two.
+/// The analysis failing or finding errors (`[static_analysis] deny`) sets the flag
+/// `build` is given, which cancels it.
+fn build_while_analyzing(config: &Config, index: &SourceIndex, build: impl FnOnce(&AtomicBool) -> Result<()>) -> Result<()> {
+    let cancel = AtomicBool::new(false);
+    let (analysis, built) = thread::scope(|s| {
+        let analysis = s.spawn(|| {
+            let res = handle_warnings(config, index);
+            if !matches!(res, Ok(0)) {
+                cancel.store(true, Ordering::Relaxed);
+            }
+            res
+        });
+        let built = build(&cancel);
+        (analysis.join().unwrap(), built)
+    });
+
+    match analysis {
+        Err(e) => Err(anyhow!("An error occurred during static analysis:\n{}", e)),
+        Ok(errors) if errors > 0 => Err(anyhow!(
+            "Static analysis found {} error(s), see `deny` in [static_analysis]. The build was canceled.",
+            errors
+        )),
+        Ok(_) => built,
+    }
+}
+
+fn build_compilation_cmd(
+    profile: &str,
+    config: &Config,
+    index: &SourceIndex,
+    build_type: config::BuildType,
+) -> Result<Vec<String>> {
     if !profile.starts_with("--") {
         eprintln!("Error: profile must start with `--`");
         process::exit(1);
@@ -373,7 +641,7 @@ fn build_compilation_cmd(profile: &str, config: &Config, build_type: config::Bui
     build_sys::link_proj_files(&config, &cwd, lang, &mut link_file)
         .map_err(|err| anyhow!("Failed to link source files: {}", err))?;
 
-    let link_lib = build_sys::link_sys_lib(&cwd);
+    let link_lib = build_sys::link_sys_lib(index);
     let opt_flags = build_sys::opt_flags(&profile, config).unwrap();
 
     let header_dirs = build_sys::link_dep_headers(&config)?;
@@ -393,8 +661,15 @@ fn build_compilation_cmd(profile: &str, config: &Config, build_type: config::Bui
     Ok(compilation_cmd)
 }
 
-fn handle_build(profile: &str, config: &Config, build_type: config::BuildType) -> Result<()> {
-    let mut compilation_cmd = build_compilation_cmd(profile, config, build_type)?;
+/// Compiles the project, killing the compiler if `cancel` gets set
+fn handle_build(
+    profile: &str,
+    config: &Config,
+    index: &SourceIndex,
+    build_type: config::BuildType,
+    cancel: &AtomicBool,
+) -> Result<()> {
+    let mut compilation_cmd = build_compilation_cmd(profile, config, index, build_type)?;
 
     #[cfg(debug_assertions)]
     {
@@ -413,29 +688,52 @@ fn handle_build(profile: &str, config: &Config, build_type: config::BuildType) -
     // Ensure that paths with spaces get treated as a single argument
     compilation_cmd = compilation_cmd.into_iter().map(|word| {
         if word.starts_with("/") || word.starts_with("-I/") {
-            format!("\"{}\"", word)
+            // Leave a trailing glob (`obj/*.o`) outside the quotes so the shell still expands it
+            match word.rsplit_once('/') {
+                Some((dir, file)) if file.contains('*') => format!("\"{}\"/{}", dir, file),
+                _ => format!("\"{}\"", word),
+            }
         } else {
             word
         }
     }).collect();
 
     let command = compilation_cmd.join(" ");
-    let (shell, flag) = if cfg!(target_os = "windows") {
-        ("cmd", "/C")
-    } else {
-        ("sh", "-c")
-    };
+    let (shell, flag) = if cfg!(target_os = "windows") { ("cmd", "/C") } else { ("sh", "-c") };
 
-    let child = process::Command::new(shell)
+    let mut compile = process::Command::new(shell);
+    compile
         .arg(flag)
         .arg(&command)
         .stdout(process::Stdio::inherit())
         .stderr(process::Stdio::inherit())
         .stdin(process::Stdio::inherit())
-        .current_dir(&build_dir)
-        .output()?;
+        .current_dir(&build_dir);
+    // The command can chain several tools (`gcc ... && ar ...`), so the shell gets its own process group and
+    // canceling takes down everything it started, not just the shell
+    #[cfg(unix)]
+    std::os::unix::process::CommandExt::process_group(&mut compile, 0);
+    let mut child = compile.spawn()?;
+
+    let status = loop {
+        if let Some(status) = child.try_wait()? {
+            break status;
+        }
+        if cancel.load(Ordering::Relaxed) {
+            let pid = child.id().to_string();
+            if cfg!(target_os = "windows") {
+                let _ = process::Command::new("taskkill").args(["/T", "/F", "/PID", &pid]).output();
+            } else {
+                let _ = process::Command::new("kill").args(["-KILL", "--", &format!("-{}", pid)]).output();
+            }
+            let _ = child.kill();
+            let _ = child.wait();
+            return Err(anyhow!("Canceled"));
+        }
+        thread::sleep(time::Duration::from_millis(10));
+    };
 
-    if !child.status.success() {
+    if !status.success() {
         return Err(anyhow!(
             "Compilation command exited with non-zero exit code"
         ));
@@ -479,8 +777,340 @@ fn handle_execution(
     Ok(())
 }
 
+fn handle_include_graph(
+    config: &Config,
+    format: include_graph::GraphFormat,
+    system: bool,
+    top: Option<usize>,
+) -> Result<()> {
+    let cwd = env::current_dir()?;
+    let lang = Language::new(&config.project.language).unwrap();
+
+    // Same translation units and header dirs that `kiln build` hands to the compiler
+    let mut units = vec![];
+    build_sys::link_dep_files(config, lang, &mut units)?;
+    build_sys::link_proj_files(config, &cwd, lang, &mut units)
+        .map_err(|err| anyhow!("Failed to link source files: {}", err))?;
+    let main_filepath = config.get_main_filepath();
+    if !main_filepath.starts_with(&config.get_src_dir()) {
+        units.push(main_filepath);
+    }
+    let units: Vec<_> = units.iter().map(|u| cwd.join(u)).collect();
+
+    let mut search_dirs = vec![cwd.join(config.get_include_dir())];
+    search_dirs.extend(build_sys::link_dep_headers(config)?.iter().map(|d| cwd.join(d)));
+    if system {
+        search_dirs.extend(include_graph::compiler_search_dirs(&config.get_compiler_path())?);
+    }
+
+    let graph = include_graph::IncludeGraph::build(&units, &search_dirs, &cwd)?;
+    let costs = graph.costs();
+
+    let out = match format {
+        include_graph::GraphFormat::Table => {
+            graph.to_table(&costs[..top.unwrap_or(costs.len()).min(costs.len())])
+        }
+        include_graph::GraphFormat::Dot => graph.to_dot(&costs),
+        include_graph::GraphFormat::Json => graph.to_json(&costs),
+    };
+    print!("{}", out);
+
+    Ok(())
+}
+
+fn handle_symbols(config: &Config, name: Option<&str>, unused: bool, json: bool) -> Result<()> {
+    let index = load_source_index(config);
+    let symbols = load_symbol_index(config, &index, &load_pot_analyses(config))?;
+
+    let found: Vec<_> = match (name, unused) {
+        (Some(name), _) => symbols.lookup(name).collect(),
+        (None, true) => symbols.unreferenced().collect(),
+        (None, false) => symbols.symbols().filter(|s| s.definitions().next().is_some()).collect(),
+    };
+
+    if json {
+        let values: Vec<_> = found.iter().map(|s| s.to_json()).collect();
+        println!("{}", serde_json::to_string_pretty(&values)?);
+        return Ok(());
+    }
+
+    for sym in &found {
+        println!("{} ({:?})", sym.name(), sym.kind());
+        for def in sym.definitions() {
+            println!("    defined  {}:{}", def.file, def.line);
+        }
+        if name.is_some() {
+            for call in sym.references() {
+                println!("    called   {}:{}", call.file, call.line);
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Lists the project's functions that are only called from the file defining them, and
+/// with `apply` marks them `static` and regenerates their headers without them
+fn handle_advise_linkage(config: &Config, apply: bool) -> Result<()> {
+    // The exported functions of a library are its API, called from code kiln never sees
+    let library: Vec<_> = config.project.build_type.iter().filter(|t| **t != config::BuildType::Exe).collect();
+    if apply && !library.is_empty() {
+        return Err(anyhow!(
+            "The project builds {:?}, whose exported functions are its public API. \
+             `--apply` only works for projects that build an executable alone, review the list without it.",
+            library
+        ));
+    }
+
+    let cwd = env::current_dir()?;
+    let src_dir = cwd.join(config.get_src_dir());
+    let index = load_source_index(config);
+    let symbols = load_symbol_index(config, &index, &load_pot_analyses(config))?;
+
+    // Only calls are indexed, so a function whose name appears in another source file at
+    // all (passed as a callback, in a comment, ...) is left alone. Headers are skipped,
+    // they hold the very prototypes that are about to go.
+    let mut sources = vec![];
+    for (name, _) in index.files() {
+        sources.push((name, SourceFile::open(src_dir.join(name))?));
+    }
+    let mentioned_elsewhere = |func: &str, file: &str| {
+        sources.iter().any(|(name, source)| *name != file && mentions(source.as_str(), func))
+    };
+
+    let candidates: Vec<_> = symbols
+        .internal_only()
+        .filter_map(|sym| Some((sym, sym.definitions().next()?)))
+        .filter(|(sym, def)| sources.iter().any(|(name, _)| *name == def.file) && !mentioned_elsewhere(sym.name(), def.file))
+        .collect();
+
+    if candidates.is_empty() {
+        println!("Every exported function is called from outside its own file");
+        return Ok(());
+    }
+
+    println!("{:<32} {:<32} {}", "function", "defined at", "calls");
+    for (sym, def) in &candidates {
+        let location = format!("{}:{}", def.file, def.line);
+        println!("{:<32} {:<32} {}", sym.name(), location, sym.references().count());
+    }
+
+    if !library.is_empty() {
+        println!(
+            "\n{} function(s) aren't called from another file of the project, but it builds {:?}: \
+             keep the ones that are part of its API",
+            candidates.len(),
+            library
+        );
+        return Ok(());
+    }
+    if !apply {
+        println!("\n{} function(s) could be static, `kiln advise linkage --apply` marks them", candidates.len());
+        return Ok(());
+    }
+
+    let mut by_file: std::collections::BTreeMap<&str, Vec<&str>> = Default::default();
+    for (sym, def) in &candidates {
+        by_file.entry(def.file).or_default().push(sym.name());
+    }
+    drop(sources);
+
+    let manifest = HeaderManifest::load(&cwd.join("build").join(HEADER_MANIFEST_FILE));
+    let mut regenerate = vec![];
+    for (file, names) in &by_file {
+        let path = src_dir.join(file);
+        let code = fs::read_to_string(&path)?;
+        let new_code = header_gen::linkage::make_static(&code, names)?;
+        if new_code != code {
+            utils::write_atomic(&path, new_code)?;
+        }
+
+        let raw_name = file.rsplit_once('.').map_or(*file, |(raw, _)| raw);
+        let header = cwd.join(config.get_include_dir()).join(format!("{}.h", raw_name));
+        if manifest.contains(raw_name) {
+            regenerate.push(file.to_string());
+        } else if header.exists() {
+            println!("{:?} isn't generated by kiln, remove the prototypes of {} from it", header, names.join(", "));
+        }
+    }
+
+    // gen-headers only exports non-static functions, so this drops their prototypes
+    if !regenerate.is_empty() {
+        handle_gen_headers(config, Some(regenerate))?;
+    }
+
+    Ok(())
+}
+
+fn handle_layout(config: &Config, types: &[String], cache_line: usize) -> Result<()> {
+    if cache_line == 0 {
+        return Err(anyhow!("The cache line size must be at least 1 byte"));
+    }
+    let index = load_source_index(config);
+    let layouts = project_layouts(config, &index, types)?;
+    if layouts.is_empty() {
+        println!("The project defines no structs");
+    }
+
+    // Structs of a unit that fails to compile all fail the same way, say it once
+    let mut failures = vec![];
+    for (def, layout) in &layouts {
+        match layout {
+            Ok(layout) => println!("{}", layout.to_text(def, cache_line)),
+            Err(e) if !failures.contains(&e.to_string()) => {
+                eprintln!("Failed to read the layout of `{}`:\n{}", def.name, e);
+                failures.push(e.to_string());
+            }
+            Err(_) => eprintln!("Failed to read the layout of `{}`, see above", def.name),
+        }
+    }
+
+    Ok(())
+}
+
+/// Structs that would shrink with their members reordered, as warnings
+fn layout_warnings(config: &Config, index: &SourceIndex) -> Vec<safety::Warning> {
+    let layouts = match project_layouts(config, index, &[]) {
+        Ok(layouts) => layouts,
+        Err(e) => {
+            eprintln!("Failed to check struct layouts: {}", e);
+            return vec![];
+        }
+    };
+
+    // A struct whose unit doesn't compile is the build's to report
+    let mut warnings = vec![];
+    for (def, layout) in layouts {
+        let Ok(layout) = layout else {
+            continue;
+        };
+        if let Some((_, size)) = layout.reordered() {
+            warnings.push(safety::Warning {
+                msg: format!(
+                    "{} would shrink from {} to {} bytes with its members reordered, see `kiln layout {}`",
+                    layout.name, layout.size, size, def.name
+                ),
+                filename: def.file.to_string_lossy().into_owned(),
+                line: def.line,
+                warning_type: safety::WarningType::PaddedStruct,
+                subject: def.name,
+            });
+        }
+    }
+    warnings
+}
+
+/// The project's structs named in `names` (every struct if there are none) and their
+/// layouts. A struct defined in a source file is read from that file's debug info, one
+/// defined in a header from a source file including the header.
+fn project_layouts(
+    config: &Config,
+    index: &SourceIndex,
+    names: &[String],
+) -> Result<Vec<(layout::StructDef, Result<layout::StructLayout>)>> {
+    let cwd = env::current_dir()?;
+    let lang = Language::new(&config.project.language)?;
+    if lang == Language::Cuda {
+        return Err(anyhow!("Struct layouts are only available for C and C++"));
+    }
+    let extensions = build_sys::source_extensions(lang);
+    let src_dir = Path::new(&config.get_src_dir()).to_path_buf();
+    let inc_dir = Path::new(&config.get_include_dir()).to_path_buf();
+
+    let mut files: Vec<PathBuf> = index.files().map(|(name, _)| src_dir.join(name)).collect();
+    if let Ok(dir) = fs::read_dir(cwd.join(&inc_dir)) {
+        for entry in dir.flatten() {
+            if entry.path().is_file() {
+                files.push(inc_dir.join(entry.file_name()));
+            }
+        }
+    }
+
+    let mut structs = vec![];
+    for file in &files {
+        let source = SourceFile::open(cwd.join(file))?;
+        structs.extend(
+            layout::find_structs(file, source.as_str())?
+                .into_iter()
+                .filter(|def| names.is_empty() || names.iter().any(|n| def.is_named(n))),
+        );
+    }
+    if let Some(missing) = names.iter().find(|n| !structs.iter().any(|def| def.is_named(n))) {
+        return Err(anyhow!("The project defines no struct named `{}`", missing));
+    }
+
+    let is_unit = |file: &Path| file.to_str().is_some_and(|f| extensions.iter().any(|ext| f.ends_with(ext)));
+    let structs: Vec<_> = structs
+        .into_iter()
+        .map(|def| {
+            let unit = match is_unit(&def.file) {
+                true => Some(def.file.clone()),
+                false => index
+                    .files()
+                    .filter(|(name, _)| is_unit(Path::new(name)))
+                    .find(|(_, entry)| {
+                        entry.local_includes.iter().any(|inc| Path::new(inc).file_name() == def.file.file_name())
+                    })
+                    .map(|(name, _)| src_dir.join(name)),
+            };
+            (def, unit)
+        })
+        .collect();
+
+    let mut args = vec![];
+    if let Some(standard) = config.get_standard() {
+        args.push(format!("-std={}", standard));
+    }
+    args.push(format!("-I{}", inc_dir.display()));
+    args.extend(build_sys::link_dep_headers(config)?.iter().map(|dir| format!("-I{}", dir)));
+    let compiler = layout::Compiler {
+        program: config.get_compiler_path(),
+        args,
+    };
+
+    let layouts = layout::compile_layouts(&compiler, &structs)?;
+    Ok(structs.into_iter().map(|(def, _)| def).zip(layouts).collect())
+}
+
+/// Returns true if `name` appears in `text` as a whole identifier
+fn mentions(text: &str, name: &str) -> bool {
+    let is_ident = |c: char| c.is_ascii_alphanumeric() || c == '_';
+    text.match_indices(name).any(|(i, _)| {
+        let before = text[..i].chars().next_back();
+        let after = text[i + name.len()..].chars().next();
+        !before.is_some_and(is_ident) && !after.is_some_and(is_ident)
+    })
+}
+
+/// Warns about functions, types and macros defined in more than one of the project's
+/// files, which end up clashing once their headers are included together
+fn report_duplicate_definitions(config: &Config, symbols: &SymbolIndex) {
+    for sym in symbols.duplicates() {
+        let mut defs = sym.definitions().filter(|d| d.origin == Origin::Project);
+        let Some(first) = defs.next() else {
+            continue;
+        };
+        for def in defs.filter(|d| d.file != first.file) {
+            let file = match def.file.starts_with(&config.get_include_dir()) {
+                true => def.file.to_string(),
+                false => format!("{}/{}", config.get_src_dir().trim_end_matches('/'), def.file),
+            };
+            utils::print_warning(
+                "Kiln",
+                &file,
+                &format!("{}", def.line),
+                "DuplicateDefinition",
+                &format!("`{}` is also defined at {}:{}", sym.name(), first.file, first.line),
+            );
+        }
+    }
+}
+
 fn handle_gen_headers(config: &Config, mut files: Option<Vec<String>>) -> Result<()> {
     let cwd = env::current_dir()?;
+    let index = load_source_index(config);
+    report_duplicate_definitions(config, &load_symbol_index(config, &index, &load_pot_analyses(config))?);
+
     let src_dir = config.get_src_dir();
     let inc_dir = config.get_include_dir();
 
@@ -497,10 +1127,13 @@ fn handle_gen_headers(config: &Config, mut files: Option<Vec<String>>) -> Result
         }
     });   
 
-    for file in fs::read_dir(&src_dir).unwrap() {
+    let mut jobs = vec![];
+    for file in fs::read_dir(&src_dir)? {
         if let Ok(file) = file {
-            let raw_name = file.file_name();
-            let (raw_name, file_ext) = raw_name.to_str().unwrap().rsplit_once(".").unwrap();
+            let file_name = file.file_name();
+            let Some((raw_name, file_ext)) = file_name.to_str().and_then(|s| s.rsplit_once(".")) else {
+                continue;
+            };
             if raw_name == "main" || file_ext != "c" {
                 continue;
             }
@@ -512,113 +1145,164 @@ fn handle_gen_headers(config: &Config, mut files: Option<Vec<String>>) -> Result
                 }
             }
 
-            let header_name = format!("{}.h", raw_name);
-
-            let code = fs::read_to_string(file.path())?;
-            let tokens = lexer_c::tokenize(&code)?;
-
-            let code_h = fs::read_to_string(inc_dir.join(&header_name)).unwrap_or("".to_string());
-            let tokens_h = lexer_c::tokenize(&code_h)?;
-
-            let mut defines_h = lexer_c::get_defines(&tokens_h);
-            let mut udts_h = lexer_c::get_udts(&tokens_h);
-            let mut includes_h = lexer_c::get_includes(&tokens_h);
-
-            let fn_defs = lexer_c::get_fn_def(&tokens);
-            let includes = lexer_c::get_includes(&tokens);
-            let defines = lexer_c::get_defines(&tokens);
-            let udts = lexer_c::get_udts(&tokens);
+            let size = file.metadata().map_or(0, |m| m.len());
+            jobs.push((raw_name.to_string(), file.path(), size));
+        }
+    }
 
-            // Ensure headerfiles don't include themselves
-            let includes = header_gen::filter_out_includes(&includes, raw_name);
+    // Largest files first so one big file doesn't start last and hold up the pool
+    jobs.sort_by(|a, b| b.2.cmp(&a.2).then_with(|| a.0.cmp(&b.0)));
 
-            // Skip the first definition to skip the #ifndef NAME_H #define NAME_H
-            if defines_h.len() > 0 {
-                defines_h.remove(0);
+    let manifest_path = cwd.join("build").join(HEADER_MANIFEST_FILE);
+    let inline = InlineOptions {
+        max_lines: config.get_header_inline_max_lines(),
+    };
+    let old_manifest = HeaderManifest::load(&manifest_path);
+    // Files generated with other options are all out of date
+    let current = old_manifest.clone().with_options(&format!("{:?}", inline));
+    let mut manifest = current.clone();
+
+    let results = utils::par_map(&jobs, |(raw_name, path, _)| {
+        gen_headers_for_file(&src_dir, &inc_dir, raw_name, path, &current, &inline)
+    });
+
+    let mut errors = vec![];
+    for ((raw_name, _, _), res) in jobs.iter().zip(results) {
+        match res {
+            // Hashed once every file is written: the headers regenerated by this run are
+            // what the next one will compare against
+            Ok(mut hashes) => {
+                hashes.deps_hash = hash_files(&hashes.deps);
+                manifest.insert(raw_name, hashes);
             }
-
-            let res = header_gen::merge_defines(&mut defines_h, &defines);
-            if let Err(e) = res {
-                eprintln!("Error: {}", e);
-                process::exit(1);
-            }
-
-            let res = header_gen::merge_udts(&mut udts_h, &udts);
-            if let Err(e) = res {
-                eprintln!("Error: {}", e);
-                process::exit(1);
+            Err(e) => {
+                manifest.remove(raw_name);
+                errors.push(format!("[src/{}.c]: {}", raw_name, e));
             }
+        }
+    }
 
-            header_gen::merge_includes(&mut includes_h, &includes);
+    if files.is_none() {
+        let names: Vec<&str> = jobs.iter().map(|j| j.0.as_str()).collect();
+        manifest.retain(&names);
+    }
 
-            let mut headers = String::new();
+    if manifest != old_manifest {
+        fs::create_dir_all(cwd.join("build"))?;
+        utils::write_atomic(&manifest_path, manifest.to_json())?;
+    }
 
-            headers.push_str(&format!("#ifndef {}_H\n", raw_name.to_uppercase()));
-            headers.push_str(&format!("#define {}_H\n\n", raw_name.to_uppercase()));
+    if !errors.is_empty() {
+        errors.sort();
+        return Err(anyhow!("{}", errors.join("\n")));
+    }
 
-            for &inc in &includes {
-                let s = lexer_c::Token::tokens_to_string(inc);
-                headers.push_str(s.trim());
-                headers.push('\n');
-            }
-            headers.push('\n');
+    Ok(())
+}
 
-            for &def in &defines_h {
-                let s = lexer_c::Token::tokens_to_string(def);
-                headers.push_str(&s);
-                headers.push('\n');
-            }
-            headers.push('\n');
+/// Generates `include/<raw_name>.h` from `src/<raw_name>.c` and moves the definitions
+/// that belong in the header out of the source file.
+/// Files are only written when their contents change, so their mtimes don't trigger
+/// rebuilds. Returns the hashes of the resulting source and header.
+fn gen_headers_for_file(
+    src_dir: &Path,
+    inc_dir: &Path,
+    raw_name: &str,
+    path: &Path,
+    manifest: &HeaderManifest,
+    inline: &InlineOptions,
+) -> Result<FileHashes> {
+    let header_name = format!("{}.h", raw_name);
+
+    let source = SourceFile::open(path)?;
+    let code = source.as_str();
+
+    let header = SourceFile::open_or_empty(inc_dir.join(&header_name))?;
+    let code_h = header.as_str();
+
+    // Unchanged since we last generated them, and so are the files they depend on
+    let deps = manifest.deps(raw_name).to_vec();
+    let hashes = FileHashes {
+        source: utils::content_hash(code.as_bytes()),
+        header: utils::content_hash(code_h.as_bytes()),
+        deps_hash: hash_files(&deps),
+        deps,
+    };
+    if manifest.is_fresh(raw_name, &hashes) {
+        return Ok(hashes);
+    }
 
-            for &struc in &udts_h {
-                headers.push_str(&lexer_c::Token::tokens_to_string(struc).trim());
-                headers.push_str("\n\n");
-            }
-            headers.push('\n');
+    // A project header provides what it declares plus what gen-headers is about to move
+    // into it from its own source, so look at both. This gives the same answer whether or
+    // not that header has been regenerated yet. Every path looked at is a dependency: a
+    // header that appears later changes the answer too.
+    // Paths are kept relative to the project, so a copy of it doesn't look at the original
+    let deps = RefCell::new(BTreeSet::new());
+    let cwd = env::current_dir()?;
+    let dep = |path: &Path| path.strip_prefix(&cwd).unwrap_or(path).to_string_lossy().into_owned();
+    let resolve_local = |include: &str| -> Option<String> {
+        let candidates = [src_dir.join(include), inc_dir.join(include)];
+        deps.borrow_mut().extend(candidates.iter().map(|p| dep(p)));
+        let header = candidates.into_iter().find(|p| p.is_file());
+
+        let stem = Path::new(include).file_stem()?.to_str()?;
+        let source = src_dir.join(format!("{}.c", stem));
+        if stem != raw_name {
+            deps.borrow_mut().insert(dep(&source));
+        }
+        let source = (stem != raw_name && source.is_file()).then_some(source);
 
-            for &func in &fn_defs {
-                let inline_idx = func.iter()
-                    .enumerate()
-                    .find(|&i| *(i.1) == lexer_c::Token::Object("inline"));
-                
-                if let Some((inline_idx, _)) = inline_idx {
-                    // turn `inline void XXX() {}` in .c into `extern inline void XXX();` in .h
-                    let mut func = func.to_vec();
-                    func.insert(inline_idx, lexer_c::Token::Space);
-                    func.insert(inline_idx, lexer_c::Token::Object("extern"));
+        if header.is_none() && source.is_none() {
+            return None;
+        }
 
-                    let s = lexer_c::Token::tokens_to_string(&func);
-                    headers.push_str(s.trim());
-                    headers.push_str(";\n\n");
-                } else {
-                    let s = lexer_c::Token::tokens_to_string(func);
-                    headers.push_str(s.trim());
-                    headers.push_str(";\n\n");
-                }
-            }
-            headers.push('\n');
-            headers.push_str(&format!("#endif // {}_H", raw_name.to_uppercase()));
+        let mut text = String::new();
+        for path in header.iter().chain(source.iter()) {
+            text.push_str(&fs::read_to_string(path).ok()?);
+            text.push('\n');
+        }
+        Some(text)
+    };
 
-            fs::write(inc_dir.join(&header_name), headers)?;
+    let generated = header_gen::generate(raw_name, code, code_h, &resolve_local, inline)?;
+    let header_changed = generated.header != code_h;
+    let source_changed = generated.source != code;
 
-            // Remove definitions from original C file to avoid duplicates
-            let mut exclude_tokens = udts;
-            exclude_tokens.extend_from_slice(&defines);
+    // Unmap the inputs before replacing them (Windows won't rename over a mapped file)
+    drop(source);
+    drop(header);
 
-            let mut new_code = lexer_c::reconstruct_source(&tokens, &exclude_tokens);
+    if header_changed {
+        utils::write_atomic(&inc_dir.join(&header_name), &generated.header)?;
+    }
 
-            let header_inc_path = format!("\"../include/{}\"", &header_name);
+    // let new_file = format!("{}.c.tmp", raw_name);
+    let new_file = format!("{}.c", raw_name);
+    let new_filepath = src_dir.join(&new_file);
 
-            new_code = header_gen::insert_self_include(new_code, &header_inc_path);
+    if source_changed {
+        utils::write_atomic(&new_filepath, &generated.source)?;
+    }
 
-            // let new_file = format!("{}.c.tmp", raw_name);
-            let new_file = format!("{}.c", raw_name);
-            let new_filepath = src_dir.join(&new_file);
+    Ok(FileHashes {
+        source: utils::content_hash(generated.source.as_bytes()),
+        header: utils::content_hash(generated.header.as_bytes()),
+        deps: deps.into_inner().into_iter().collect(),
+        deps_hash: 0,
+    })
+}
 
-            fs::write(new_filepath, new_code).unwrap();
-        }
+/// Combined hash of the contents of the files at `paths` (relative ones to the current
+/// directory), missing ones included
+fn hash_files(paths: &[String]) -> u64 {
+    let mut text = Vec::new();
+    for path in paths {
+        let hash = fs::read(path).map_or(0, |bytes| utils::content_hash(&bytes));
+        text.extend_from_slice(path.as_bytes());
+        text.push(0);
+        text.extend_from_slice(&hash.to_le_bytes());
     }
-    Ok(())
+    utils::content_hash(&text)
 }
 
 /// Checks the deps listed in Kiln.Toml config for any that aren't installed globally.
@@ -644,7 +1328,7 @@ async fn handle_check_installs(config: &Config) {
     dbg!(timer.elapsed());
 }
 
-fn handle_tests(profile: &str, config: &Config, test_file: &str) -> Result<()> {
+fn handle_tests(profile: &str, config: &Config, index: &SourceIndex, test_file: &str) -> Result<()> {
     if !profile.starts_with("--") {
         eprintln!("Error: profile must start with `--`");
         process::exit(1);
@@ -671,7 +1355,7 @@ fn handle_tests(profile: &str, config: &Config, test_file: &str) -> Result<()> {
 
     link_file.push(test_file.to_string());
 
-    let link_lib = build_sys::link_sys_lib(&cwd);
+    let link_lib = build_sys::link_sys_lib(index);
     let opt_flags = build_sys::opt_flags(&profile, config).unwrap();
 
     let header_dirs = build_sys::link_dep_headers(&config)?;
@@ -719,4 +1403,42 @@ fn handle_tests(profile: &str, config: &Config, test_file: &str) -> Result<()> {
     fs::remove_file(bin_path)?;
     
     Ok(())
-}
\ No newline at end of file
+}
+
+#[cfg(test)]
+mod main_tests {
+    use super::*;
+
+    #[test]
+    fn test_regenerates_when_an_included_header_changes() {
+        let dir = tempfile::tempdir().unwrap();
+        let (src_dir, inc_dir) = (dir.path().join("src"), dir.path().join("include"));
+        fs::create_dir_all(&src_dir).unwrap();
+        fs::create_dir_all(&inc_dir).unwrap();
+        let a_c = src_dir.join("a.c");
+        fs::write(&a_c, "#include \"b.h\"\n#include \"c.h\"\n\nint area(Rect r) { return r.w * r.h; }\n").unwrap();
+        fs::write(inc_dir.join("b.h"), "typedef struct { int w, h; } Rect;\n").unwrap();
+        fs::write(inc_dir.join("c.h"), "#define UNIT 1\n").unwrap();
+
+        let inline = InlineOptions::default();
+        let mut manifest = HeaderManifest::new();
+        let run = |manifest: &mut HeaderManifest| {
+            let mut hashes = gen_headers_for_file(&src_dir, &inc_dir, "a", &a_c, manifest, &inline).unwrap();
+            hashes.deps_hash = hash_files(&hashes.deps);
+            manifest.insert("a", hashes.clone());
+            hashes
+        };
+
+        let first = run(&mut manifest);
+        let a_h = || fs::read_to_string(inc_dir.join("a.h")).unwrap();
+        assert!(a_h().contains("#include \"b.h\"") && !a_h().contains("#include \"c.h\""), "{}", a_h());
+        assert!(manifest.is_fresh("a", &first));
+
+        // Only the headers change: the type moves from b.h to c.h
+        fs::write(inc_dir.join("b.h"), "#define UNIT 1\n").unwrap();
+        fs::write(inc_dir.join("c.h"), "typedef struct { int w, h; } Rect;\n").unwrap();
+        let second = run(&mut manifest);
+        assert_ne!(second.deps_hash, first.deps_hash);
+        assert!(a_h().contains("#include \"c.h\"") && !a_h().contains("#include \"b.h\""), "{}", a_h());
+    }
+}
@@ -1,6 +1,7 @@
 use crate::config::{self, Config, KilnPot};
 use crate::constants::{CONFIG_FILE, PACKAGE_CONFIG_FILE};
 use crate::packaging::pot::PotConfig;
+use crate::pot_analysis::PotAnalysis;
 
 use std::collections::HashSet;
 use std::fmt::Debug;
@@ -332,6 +333,12 @@ async fn add_package(
         pkg.source_dir = Some(source_dir);
     }
 
+    // Analyzed once here, every build after that reads the stored results. If it fails,
+    // the first build tries again.
+    if let Err(e) = PotAnalysis::load_or_analyze(&pkg) {
+        eprintln!("Failed to analyze {}: {}", repo_name, e);
+    }
+
     let mut chain_dep_ids = vec![];
 
     if let Some(mut cfg) = pkg.get_kiln_cfg()? {
@@ -0,0 +1,131 @@
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Result};
+use serde::{Deserialize, Serialize};
+
+use crate::config::KilnPot;
+use crate::constants::POT_ANALYSIS_FILE;
+use crate::source_index::{FileEntry, SourceIndex};
+use crate::testing::rules::RuleSet;
+use crate::testing::safety::{self, Warning};
+use crate::utils;
+
+// Every source a pot can be built from, whatever the language of the project using it
+const SOURCE_EXTENSIONS: [&str; 3] = [".c", ".cpp", ".cu"];
+
+/// The scanned sources and static analysis warnings of one installed pot version.
+/// A version never changes once it's installed, so it's analyzed once (when it's
+/// installed, or by the first build that needs it) and the result is stored next to it
+/// in `PACKAGE_DIR/<owner>/<repo>/<version>/`. Builds read it back instead of scanning
+/// the pot again.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct PotAnalysis {
+    /// The pot's sources, keyed by their path in the pot's directory
+    index: SourceIndex,
+    /// Warnings in the pot's sources, with the same paths
+    warnings: Vec<Warning>,
+    /// `safety::RULES_VERSION` of the rules that found them
+    #[serde(default)]
+    rules: u32,
+    #[serde(skip)]
+    dir: PathBuf,
+}
+
+impl PotAnalysis {
+    /// The stored analysis of `pot`, analyzing it first if it has none yet (or one by
+    /// another version of kiln)
+    pub fn load_or_analyze(pot: &KilnPot) -> Result<Self> {
+        Self::load_or_analyze_dir(&pot.get_global_path(), || {
+            pot.get_source_dir()?
+                .ok_or_else(|| anyhow!("{} has an ambiguous source dir", &pot.uri))
+        })
+    }
+
+    fn load_or_analyze_dir(dir: &Path, source_dir: impl FnOnce() -> Result<PathBuf>) -> Result<Self> {
+        let path = dir.join(POT_ANALYSIS_FILE);
+        let stored = fs::read_to_string(&path)
+            .ok()
+            .and_then(|s| serde_json::from_str::<Self>(&s).ok());
+        if let Some(analysis) = stored.filter(|a| a.index.is_current() && a.rules == safety::RULES_VERSION) {
+            return Ok(Self {
+                dir: dir.to_path_buf(),
+                ..analysis
+            });
+        }
+
+        let analysis = Self::analyze(dir, &source_dir()?)?;
+        // Without write access to the package dir, the pot is just analyzed again next time
+        if let Err(e) = utils::write_atomic(&path, serde_json::to_string(&analysis)?) {
+            eprintln!("Failed to save the analysis of {:?}: {}", dir, e);
+        }
+        Ok(analysis)
+    }
+
+    fn analyze(dir: &Path, source_dir: &Path) -> Result<Self> {
+        let mut paths = vec![];
+        for entry in fs::read_dir(source_dir).map_err(|e| anyhow!("Failed to read {:?}: {}", source_dir, e))? {
+            let entry = entry?;
+            let is_source = entry
+                .file_name()
+                .to_str()
+                .is_some_and(|name| SOURCE_EXTENSIONS.iter().any(|ext| name.ends_with(ext)));
+            if is_source && entry.file_type()?.is_file() {
+                let path = entry.path();
+                let name = path.strip_prefix(dir).unwrap_or(&path).to_string_lossy().into_owned();
+                paths.push((name, path));
+            }
+        }
+
+        let mut index = SourceIndex::new();
+        index.refresh_paths(paths)?;
+        let warnings = safety::check_files(index.files(), &RuleSet::builtin());
+
+        Ok(Self {
+            index,
+            warnings,
+            rules: safety::RULES_VERSION,
+            dir: dir.to_path_buf(),
+        })
+    }
+
+    /// The pot's sources with the given extensions, by absolute path
+    pub fn sources<'a>(&'a self, extensions: &'a [&str]) -> impl Iterator<Item = (PathBuf, &'a FileEntry)> + 'a {
+        self.index
+            .files()
+            .filter(move |(name, _)| extensions.iter().any(|ext| name.ends_with(ext)))
+            .map(|(name, entry)| (self.dir.join(name), entry))
+    }
+
+    /// The warnings in the pot's sources. Their file names are relative to the pot's
+    /// directory.
+    pub fn warnings(&self) -> &[Warning] {
+        &self.warnings
+    }
+}
+
+#[cfg(test)]
+mod pot_analysis_tests {
+    use super::*;
+
+    #[test]
+    fn test_analyzed_once() {
+        let dir = tempfile::tempdir().unwrap();
+        let src = dir.path().join("src");
+        fs::create_dir_all(&src).unwrap();
+        fs::write(src.join("parse.c"), "#include <stdlib.h>\n\nint parse(const char *s) {\n    return atoi(s);\n}\n").unwrap();
+        fs::write(src.join("README.md"), "atoi(\"1\")\n").unwrap();
+
+        let analysis = PotAnalysis::load_or_analyze_dir(dir.path(), || Ok(src.clone())).unwrap();
+        let warnings: Vec<_> = analysis.warnings().iter().map(|w| (w.filename.as_str(), w.line)).collect();
+        assert_eq!(warnings, [("src/parse.c", 4)]);
+        assert_eq!(analysis.sources(&[".c"]).next().unwrap().0, src.join("parse.c"));
+        assert!(dir.path().join(POT_ANALYSIS_FILE).is_file());
+
+        // The stored analysis is used from then on, the sources aren't looked at again
+        fs::remove_dir_all(&src).unwrap();
+        let stored = PotAnalysis::load_or_analyze_dir(dir.path(), || panic!("analyzed again")).unwrap();
+        assert_eq!(stored.warnings().len(), 1);
+        assert_eq!(stored.sources(&[".cpp"]).count(), 0);
+    }
+}
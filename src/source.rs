@@ -0,0 +1,73 @@
+use std::fs::{self, File};
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Result};
+use memmap2::Mmap;
+
+/// Files at least this large are memory mapped instead of read into a `String`
+pub const MMAP_THRESHOLD: u64 = 64 * 1024;
+
+/// A source file loaded for lexing. Small files are read into memory; large ones are
+/// memory mapped, so the lexer reads straight from the page cache with no copy.
+/// The contents are checked to be UTF-8 once, when the file is opened.
+pub struct SourceFile {
+    path: PathBuf,
+    data: SourceData,
+}
+
+enum SourceData {
+    Owned(String),
+    Mapped(Mmap),
+}
+
+impl SourceFile {
+    pub fn open(path: impl AsRef<Path>) -> Result<Self> {
+        let path = path.as_ref();
+        let file = File::open(path).map_err(|e| anyhow!("Failed to open {:?}: {}", path, e))?;
+        let len = file.metadata()?.len();
+
+        let data = if len >= MMAP_THRESHOLD {
+            // Safety: kiln never writes to a source file in place (it replaces them with
+            // a rename), so the mapping can't change under us unless another process
+            // truncates the file while we're reading it
+            let map = unsafe { Mmap::map(&file) }
+                .map_err(|e| anyhow!("Failed to map {:?}: {}", path, e))?;
+            std::str::from_utf8(&map).map_err(|e| anyhow!("{:?} is not valid UTF-8: {}", path, e))?;
+            SourceData::Mapped(map)
+        } else {
+            let text = fs::read_to_string(path)
+                .map_err(|e| anyhow!("Failed to read {:?}: {}", path, e))?;
+            SourceData::Owned(text)
+        };
+
+        Ok(Self {
+            path: path.to_path_buf(),
+            data,
+        })
+    }
+
+    /// Opens `path`, or returns an empty source if it doesn't exist
+    pub fn open_or_empty(path: impl AsRef<Path>) -> Result<Self> {
+        let path = path.as_ref();
+        if !path.exists() {
+            return Ok(Self {
+                path: path.to_path_buf(),
+                data: SourceData::Owned(String::new()),
+            });
+        }
+        Self::open(path)
+    }
+
+    pub fn as_str(&self) -> &str {
+        match &self.data {
+            SourceData::Owned(s) => s,
+            // Validated in `open`
+            SourceData::Mapped(map) => unsafe { std::str::from_utf8_unchecked(map) },
+        }
+    }
+
+    #[allow(unused)]
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+}
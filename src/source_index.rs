@@ -0,0 +1,434 @@
+use std::collections::{BTreeMap, BTreeSet};
+use std::fs;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Result};
+use serde::{Deserialize, Serialize};
+
+use crate::header_gen::context::{self, LexerContext};
+use crate::header_gen::includes::{self, include_target, IncludeTarget};
+use crate::header_gen::lexer_c::{self, Token, TokenBuffer, TokenSource, TokenView};
+use crate::header_gen::stream::{self, ChunkStart, ChunkedLexer};
+use crate::source::SourceFile;
+use crate::testing::perf_lints;
+use crate::utils;
+
+const SCAN_VERSION: u32 = 4;
+
+/// What the build needs to know about each file in `src/`, gathered from one read and
+/// one tokenization per file and shared by every phase of a kiln invocation (linking
+/// system libraries, static analysis, ...). It's persisted in `build/` keyed by content
+/// hash, so files that haven't changed since the last run aren't even tokenized.
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct SourceIndex {
+    version: String,
+    files: BTreeMap<String, FileEntry>,
+}
+
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct FileEntry {
+    pub hash: u64,
+    /// `#include <...>` targets, in the form `<stdio.h>`
+    pub system_includes: Vec<String>,
+    /// `#include "..."` targets, without the quotes
+    pub local_includes: Vec<String>,
+    /// The non-static functions, types (struct/union/enum tags and typedefs) and macros
+    /// the file defines
+    pub functions: Vec<Definition>,
+    pub types: Vec<Definition>,
+    pub macros: Vec<Definition>,
+    /// Every `name(` outside of function signatures and include lines, in source order
+    pub calls: Vec<CallSite>,
+    /// What the performance lints found, whether they're on or not, in source order
+    pub hazards: Vec<Hazard>,
+}
+
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct Definition {
+    pub name: String,
+    /// 1-based line the definition starts on
+    pub line: usize,
+}
+
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct CallSite {
+    pub name: String,
+    /// Index of the name's token in the file
+    pub token: usize,
+    /// 1-based line the call is on
+    pub line: usize,
+}
+
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct Hazard {
+    /// The lint that found it, one of `perf_lints::LINTS`
+    pub lint: String,
+    pub line: usize,
+    pub msg: String,
+}
+
+impl SourceIndex {
+    /// Loads the index at `path`. A missing, unreadable or outdated index is treated as
+    /// empty, which just means every file gets scanned again.
+    pub fn load(path: &Path) -> Self {
+        let index = fs::read_to_string(path)
+            .ok()
+            .and_then(|s| serde_json::from_str::<SourceIndex>(&s).ok());
+
+        match index {
+            Some(i) if i.version == Self::current_version() => i,
+            _ => Self::new(),
+        }
+    }
+
+    pub fn new() -> Self {
+        Self {
+            version: Self::current_version(),
+            files: BTreeMap::new(),
+        }
+    }
+
+    pub fn to_json(&self) -> String {
+        serde_json::to_string(self).unwrap()
+    }
+
+    /// Brings the index up to date with the files in `src_dir`: changed and new files
+    /// are scanned (in parallel), unchanged ones keep their entry, deleted ones are dropped.
+    pub fn refresh(&mut self, src_dir: &Path) -> Result<()> {
+        let mut paths = vec![];
+        for entry in fs::read_dir(src_dir).map_err(|e| anyhow!("Failed to read {:?}: {}", src_dir, e))? {
+            let entry = entry?;
+            if entry.file_type()?.is_file() {
+                if let Some(name) = entry.file_name().to_str() {
+                    paths.push((name.to_string(), entry.path()));
+                }
+            }
+        }
+
+        self.refresh_paths(paths)
+    }
+
+    /// Same as `refresh`, for an explicit list of `(name, path)` files
+    pub fn refresh_paths(&mut self, paths: Vec<(String, PathBuf)>) -> Result<()> {
+        let old_files = std::mem::take(&mut self.files);
+        let entries = utils::par_map(&paths, |(name, path)| -> Result<FileEntry> {
+            let source = SourceFile::open(path)?;
+            let hash = utils::content_hash(source.as_str().as_bytes());
+            match old_files.get(name) {
+                Some(entry) if entry.hash == hash => Ok(entry.clone()),
+                _ => scan_file(source.as_str(), hash).map_err(|e| anyhow!("[{}]: {}", name, e)),
+            }
+        });
+
+        for ((name, _), entry) in paths.into_iter().zip(entries) {
+            self.files.insert(name, entry?);
+        }
+        Ok(())
+    }
+
+    /// Adds (or replaces) the entry of one file, scanned elsewhere
+    pub fn insert(&mut self, name: String, entry: FileEntry) {
+        self.files.insert(name, entry);
+    }
+
+    /// Whether the entries were scanned by this version of kiln. `load` drops older
+    /// indexes, this is for indexes stored as part of something else.
+    pub fn is_current(&self) -> bool {
+        self.version == Self::current_version()
+    }
+
+    /// The files in the index by name (relative to `src/`), in name order
+    pub fn files(&self) -> impl Iterator<Item = (&str, &FileEntry)> {
+        self.files.iter().map(|(name, entry)| (name.as_str(), entry))
+    }
+
+    /// Every `#include <...>` in the project, in the form `<stdio.h>`
+    pub fn system_includes(&self) -> BTreeSet<&str> {
+        self.files
+            .values()
+            .flat_map(|f| f.system_includes.iter().map(|s| s.as_str()))
+            .collect()
+    }
+
+    // The scan may change between kiln versions, so entries are only trusted when they
+    // were written by this one. `SCAN_VERSION` covers changes within a release.
+    fn current_version() -> String {
+        format!("{}+{}", env!("CARGO_PKG_VERSION"), SCAN_VERSION)
+    }
+}
+
+fn scan_file(code: &str, hash: u64) -> Result<FileEntry> {
+    if code.len() >= stream::STREAM_THRESHOLD {
+        return scan_chunked(code, hash, stream::DEFAULT_CHUNK_SIZE);
+    }
+
+    let mut entry = FileEntry {
+        hash,
+        ..Default::default()
+    };
+    let mut ctx = context::thread_context();
+    let tokens = ctx.tokenize(code)?;
+    scan_tokens(&mut ctx, &mut entry, &tokens, ChunkStart::default());
+    ctx.recycle_tokens(tokens);
+    Ok(entry)
+}
+
+/// Same as `scan_file`, a chunk of tokens at a time, so a huge generated file never has
+/// all of its tokens in memory at once
+fn scan_chunked(code: &str, hash: u64, chunk_size: usize) -> Result<FileEntry> {
+    let mut entry = FileEntry {
+        hash,
+        ..Default::default()
+    };
+    let mut ctx = context::thread_context();
+    let mut chunks = ChunkedLexer::with_chunk_size(code.as_bytes(), chunk_size);
+    while let Some(chunk) = chunks.next_chunk(&mut ctx)? {
+        scan_tokens(&mut ctx, &mut entry, &chunk.tokens, chunk.start);
+        ctx.recycle_tokens(chunk.tokens);
+    }
+    Ok(entry)
+}
+
+/// Adds what `tokens` (all of a file or one chunk of it, starting at `start`) include,
+/// define and call to `entry`, and the hazards the performance lints find in them
+fn scan_tokens(ctx: &mut LexerContext, entry: &mut FileEntry, tokens: &TokenBuffer, start: ChunkStart) {
+    let decls = ctx.declarations(tokens);
+
+    for span in &decls.includes {
+        match include_target(&tokens.view(span.clone())) {
+            Some(IncludeTarget::System(name)) => entry.system_includes.push(format!("<{}>", name)),
+            Some(IncludeTarget::Local(name)) => entry.local_includes.push(name),
+            None => {}
+        }
+    }
+
+    let lines = LineTable::new(tokens.src(), start.line);
+    entry.functions.extend(definitions(tokens, &decls.fn_defs, &lines, |v| lexer_c::get_fn_name(v)));
+    entry.types.extend(definitions(tokens, &decls.udts, &lines, |v| udt_name(v)));
+    entry.macros.extend(definitions(tokens, &decls.defines, &lines, |v| define_name(v)));
+
+    // Function signatures and include lines aren't calls, so a project defining its own
+    // `atoi()` isn't flagged for it
+    let mut skip: Vec<_> = decls.fn_defs.iter().chain(&decls.includes).cloned().collect();
+    skip.sort_unstable_by_key(|r| r.start);
+    entry.calls.extend(find_calls(tokens, &skip, &lines, start));
+
+    entry.hazards.extend(perf_lints::scan(tokens, &decls.udts, start.depth).into_iter().map(|f| Hazard {
+        lint: f.lint.to_string(),
+        line: lines.line_of(tokens.span(f.token).start),
+        msg: f.msg,
+    }));
+
+    ctx.recycle_declarations(decls);
+}
+
+fn definitions<'a>(
+    tokens: &TokenBuffer<'a>,
+    spans: &[Range<usize>],
+    lines: &LineTable,
+    name: impl Fn(&TokenView<'_, 'a>) -> Option<&'a str>,
+) -> Vec<Definition> {
+    spans
+        .iter()
+        .filter_map(|span| {
+            Some(Definition {
+                name: name(&tokens.view(span.clone()))?.to_string(),
+                line: lines.line_of(tokens.span(span.start).start),
+            })
+        })
+        .collect()
+}
+
+/// Every identifier directly followed by `(` outside of the (sorted) `skip` ranges, that
+/// isn't declaring something: outside of function bodies and preprocessor directives
+/// `name(` is a prototype, and so is one right after a type (`int name(`)
+fn find_calls(tokens: &TokenBuffer, skip: &[Range<usize>], lines: &LineTable, start: ChunkStart) -> Vec<CallSite> {
+    let mut calls = vec![];
+    let mut skip = skip.iter().peekable();
+    let (mut depth, mut directive, mut continued) = (start.depth, start.directive, false);
+    let mut prev = None;
+
+    for idx in 0..tokens.len().saturating_sub(1) {
+        let token = tokens.token_at(idx);
+        match token {
+            Token::OpenCurlyBrace => depth += 1,
+            Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+            Token::HashTag if prev.is_none_or(|p| p == Token::NewLine) => directive = true,
+            Token::NewLine if !continued => directive = false,
+            _ => {}
+        }
+        continued = token == Token::BackSlash || (continued && matches!(token, Token::Space | Token::Tab));
+        let before = prev;
+        if !matches!(token, Token::Space | Token::Tab | Token::Comment(_)) {
+            prev = Some(token);
+        }
+
+        while skip.peek().is_some_and(|r| r.end <= idx) {
+            skip.next();
+        }
+        if skip.peek().is_some_and(|r| r.contains(&idx)) {
+            continue;
+        }
+
+        let Token::Object(name) = token else {
+            continue;
+        };
+        if tokens.token_at(idx + 1) != Token::OpenParen || !is_identifier(name) || includes::is_keyword(name) {
+            continue;
+        }
+        if depth == 0 && !directive {
+            continue;
+        }
+        // A type before the name (which includes `define` before the name of a
+        // function-like macro), rather than a statement keyword
+        let declared = match before {
+            Some(Token::Object(word)) => !matches!(word, "return" | "else" | "case" | "do" | "goto" | "sizeof"),
+            _ => false,
+        };
+        if declared {
+            continue;
+        }
+
+        calls.push(CallSite {
+            name: name.to_string(),
+            token: start.token + idx,
+            line: lines.line_of(tokens.span(idx).start),
+        });
+    }
+    calls
+}
+
+/// Byte offset -> line number, by binary search over the offsets of the file's newlines
+struct LineTable {
+    newlines: Vec<usize>,
+    first_line: usize,
+}
+
+impl LineTable {
+    /// The lines of `code`, which starts on line `first_line` of its file
+    fn new(code: &str, first_line: usize) -> Self {
+        Self {
+            newlines: code.bytes().enumerate().filter(|&(_, b)| b == b'\n').map(|(i, _)| i).collect(),
+            first_line,
+        }
+    }
+
+    /// Line of the byte at `offset`
+    fn line_of(&self, offset: usize) -> usize {
+        self.newlines.partition_point(|&nl| nl < offset) + self.first_line
+    }
+}
+
+fn is_identifier(s: &str) -> bool {
+    s.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_')
+}
+
+fn significant<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> impl Iterator<Item = (usize, Token<'a>)> + '_ {
+    (0..tokens.len())
+        .map(|i| (i, tokens.token_at(i)))
+        .filter(|(_, t)| !matches!(t, Token::Space | Token::Tab | Token::NewLine | Token::Comment(_)))
+}
+
+/// `typedef struct {..} Foo;` -> `Foo`, `struct Foo {..};` -> `Foo`
+fn udt_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Option<&'a str> {
+    let mut toks = significant(tokens).map(|(_, t)| t);
+    match toks.next()? {
+        Token::Object("typedef") => {
+            let mut depth = 0usize;
+            let mut name = None;
+            for tok in toks {
+                match tok {
+                    Token::OpenCurlyBrace => depth += 1,
+                    Token::CloseCurlyBrace => depth = depth.saturating_sub(1),
+                    Token::Object(obj) if depth == 0 && is_identifier(obj) => name = Some(obj),
+                    _ => {}
+                }
+            }
+            name
+        }
+        Token::Object("struct" | "union" | "enum") => match toks.next()? {
+            Token::Object(tag) if is_identifier(tag) => Some(tag),
+            _ => None,
+        },
+        _ => None,
+    }
+}
+
+/// `#define FOO 42` -> `FOO`
+fn define_name<'a, T: TokenSource<'a> + ?Sized>(tokens: &T) -> Option<&'a str> {
+    let mut toks = significant(tokens).map(|(_, t)| t).skip_while(|t| *t != Token::Object("define"));
+    toks.next()?;
+    match toks.next()? {
+        Token::Object(name) => Some(name),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod source_index_tests {
+    use super::*;
+
+    #[test]
+    fn test_refresh() {
+        let dir = tempfile::tempdir().unwrap();
+        let code = "#include <math.h>\n#include \"util.h\"\n#define LIMIT 4\n\ntypedef struct { int x; } Point;\n\n\
+                    int scale(int x) {\n    return atoi(\"2\") * sqrt(x);\n}\n";
+        fs::write(dir.path().join("a.c"), code).unwrap();
+        fs::write(dir.path().join("b.c"), "#include <pthread.h>\n").unwrap();
+
+        let mut index = SourceIndex::new();
+        index.refresh(dir.path()).unwrap();
+
+        let (_, a) = index.files().next().unwrap();
+        assert_eq!(a.system_includes, ["<math.h>"]);
+        assert_eq!(a.local_includes, ["util.h"]);
+        let names = |defs: &[Definition]| defs.iter().map(|d| (d.name.clone(), d.line)).collect::<Vec<_>>();
+        assert_eq!(names(&a.functions), [("scale".to_string(), 7)]);
+        assert_eq!(names(&a.types), [("Point".to_string(), 5)]);
+        assert_eq!(names(&a.macros), [("LIMIT".to_string(), 3)]);
+        let calls: Vec<_> = a.calls.iter().map(|c| (c.name.as_str(), c.line)).collect();
+        assert_eq!(calls, [("atoi", 8), ("sqrt", 8)]);
+        assert_eq!(index.system_includes().into_iter().collect::<Vec<_>>(), ["<math.h>", "<pthread.h>"]);
+
+        // Unchanged files are taken from the saved index without a rescan (the cleared
+        // calls stay cleared), deleted ones are dropped
+        let mut reloaded: SourceIndex = serde_json::from_str(&index.to_json()).unwrap();
+        reloaded.files.get_mut("a.c").unwrap().calls.clear();
+        fs::remove_file(dir.path().join("b.c")).unwrap();
+        reloaded.refresh(dir.path()).unwrap();
+        assert_eq!(reloaded.files().count(), 1);
+        assert!(reloaded.files["a.c"].calls.is_empty());
+    }
+
+    #[test]
+    fn test_calls_in_control_statements() {
+        // The conditions of control statements in a body aren't function signatures
+        let code = "int parse(const char *s) {\n    switch (atoi(s)) {\n    case 0:\n        return 0;\n    }\n    \
+                    do { s++; } while (isspace(*s));\n    if (x) {} else switch (atol(s)) {}\n    return 1;\n}\n";
+        let entry = scan_file(code, 0).unwrap();
+        let calls: Vec<_> = entry.calls.iter().map(|c| (c.name.as_str(), c.line)).collect();
+        assert_eq!(calls, [("atoi", 2), ("isspace", 6), ("atol", 7)]);
+        let names: Vec<_> = entry.functions.iter().map(|d| d.name.as_str()).collect();
+        assert_eq!(names, ["parse"]);
+    }
+
+    #[test]
+    fn test_chunked_scan_matches() {
+        let mut code = fs::read_to_string("tests/lexer-UDT.c").unwrap();
+        code.push_str("#include <math.h>\n#define LIMIT 4\n\nint scale(int x) {\n    return atoi(\"2\") * sqrt(x);\n}\n");
+        code.push_str("static const int table[] = {");
+        for i in 0..200 {
+            code.push_str(&format!("f({}), ", i));
+        }
+        code.push_str("};\n");
+
+        let whole = scan_file(&code, 0).unwrap();
+        assert_eq!(whole.calls.iter().filter(|c| c.name == "f").count(), 200);
+        // Chunks cut between declarations, so any size that fits the largest one gives
+        // the same entry
+        for chunk_size in [512, 4096] {
+            assert_eq!(scan_chunked(&code, 0, chunk_size).unwrap(), whole, "chunk size {}", chunk_size);
+        }
+    }
+}
@@ -0,0 +1,428 @@
+// Project-wide symbol index: every function, type and macro defined in the project and
+// its pots, with where it's defined and where it's called.
+//
+// The index is assembled from the per-file entries of `SourceIndex`, so only files that
+// changed get rescanned, and stored in `build/` as one flat binary file that's memory
+// mapped and queried in place. Nothing is deserialized: a lookup is a binary search
+// over fixed-size records.
+//
+// Layout, every field a little-endian u32:
+//   header     magic "KSYM", format version, #files, #symbols, #locations, #string bytes
+//   files      [name offset, name length, origin]
+//   symbols    [name offset, name length, kind, first definition, #definitions,
+//               first reference, #references], sorted by (name, kind)
+//   locations  [file, line]
+//   strings    UTF-8 names, referenced by (offset, length)
+
+use std::collections::{BTreeMap, HashSet};
+use std::fs::File;
+use std::path::Path;
+
+use anyhow::{anyhow, Result};
+use memmap2::Mmap;
+
+use crate::source_index::FileEntry;
+
+const MAGIC: &[u8; 4] = b"KSYM";
+const FORMAT_VERSION: u32 = 1;
+
+const HEADER_LEN: usize = 6;
+const FILE_LEN: usize = 3;
+const SYMBOL_LEN: usize = 7;
+const LOCATION_LEN: usize = 2;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum SymbolKind {
+    Function,
+    Type,
+    Macro,
+}
+
+/// Whether a file belongs to the project or to one of its pots
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Origin {
+    Project,
+    Pot,
+}
+
+pub struct SymbolIndex {
+    data: SymbolData,
+    files: usize,
+    symbols: usize,
+    locations: usize,
+}
+
+enum SymbolData {
+    Owned(Vec<u8>),
+    Mapped(Mmap),
+}
+
+#[derive(Clone, Copy)]
+pub struct Symbol<'i> {
+    index: &'i SymbolIndex,
+    record: usize,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Location<'i> {
+    pub file: &'i str,
+    /// 1-based
+    pub line: usize,
+    pub origin: Origin,
+}
+
+impl SymbolIndex {
+    /// Builds the index from the scanned files. Calls resolve to a macro only when the
+    /// name is a macro and never a function; calls to functions the index doesn't define
+    /// (the C library, ...) still get a `Function` symbol with no definitions.
+    pub fn build<'e>(files: impl IntoIterator<Item = (&'e str, &'e FileEntry, Origin)>) -> Self {
+        type Locations = (Vec<(u32, u32)>, Vec<(u32, u32)>);
+
+        let files: Vec<_> = files.into_iter().collect();
+        let mut symbols: BTreeMap<(&str, SymbolKind), Locations> = BTreeMap::new();
+
+        for (file, &(_, entry, _)) in files.iter().enumerate() {
+            let defined = [
+                (SymbolKind::Function, &entry.functions),
+                (SymbolKind::Type, &entry.types),
+                (SymbolKind::Macro, &entry.macros),
+            ];
+            for (kind, defs) in defined {
+                for def in defs {
+                    let locations = symbols.entry((&def.name, kind)).or_default();
+                    locations.0.push((file as u32, def.line as u32));
+                }
+            }
+        }
+
+        let macros: HashSet<&str> = symbols
+            .keys()
+            .filter(|(_, kind)| *kind == SymbolKind::Macro)
+            .map(|(name, _)| *name)
+            .collect();
+        for (file, &(_, entry, _)) in files.iter().enumerate() {
+            for call in &entry.calls {
+                let name = call.name.as_str();
+                let kind = match macros.contains(name) && !symbols.contains_key(&(name, SymbolKind::Function)) {
+                    true => SymbolKind::Macro,
+                    false => SymbolKind::Function,
+                };
+                let locations = symbols.entry((name, kind)).or_default();
+                locations.1.push((file as u32, call.line as u32));
+            }
+        }
+
+        let mut strings = Vec::new();
+        let mut push_str = |s: &str| {
+            let offset = strings.len() as u32;
+            strings.extend_from_slice(s.as_bytes());
+            [offset, s.len() as u32]
+        };
+
+        let mut file_words = Vec::with_capacity(files.len() * FILE_LEN);
+        for &(name, _, origin) in &files {
+            file_words.extend(push_str(name));
+            file_words.push(origin as u32);
+        }
+
+        let mut symbol_words = Vec::with_capacity(symbols.len() * SYMBOL_LEN);
+        let mut location_words = vec![];
+        let mut prev_name: Option<(&str, [u32; 2])> = None;
+        for ((name, kind), (defs, refs)) in &symbols {
+            // The same name as a function and a macro shares its string
+            let name_ref = match prev_name {
+                Some((prev, name_ref)) if prev == *name => name_ref,
+                _ => push_str(name),
+            };
+            prev_name = Some((name, name_ref));
+
+            symbol_words.extend(name_ref);
+            symbol_words.push(*kind as u32);
+            for locations in [defs, refs] {
+                symbol_words.push((location_words.len() / LOCATION_LEN) as u32);
+                symbol_words.push(locations.len() as u32);
+                location_words.extend(locations.iter().flat_map(|&(file, line)| [file, line]));
+            }
+        }
+
+        let header = [
+            u32::from_le_bytes(*MAGIC),
+            FORMAT_VERSION,
+            files.len() as u32,
+            symbols.len() as u32,
+            (location_words.len() / LOCATION_LEN) as u32,
+            strings.len() as u32,
+        ];
+        let words = header.iter().chain(&file_words).chain(&symbol_words).chain(&location_words);
+
+        let mut data = Vec::with_capacity((HEADER_LEN + file_words.len() + symbol_words.len() + location_words.len()) * 4 + strings.len());
+        for word in words {
+            data.extend_from_slice(&word.to_le_bytes());
+        }
+        data.extend_from_slice(&strings);
+
+        Self::from_data(SymbolData::Owned(data)).expect("a freshly built index is well formed")
+    }
+
+    /// Maps the index written at `path` by `as_bytes`
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path).map_err(|e| anyhow!("Failed to open {:?}: {}", path, e))?;
+        // Safety: kiln replaces the index with a rename and never writes it in place
+        let map = unsafe { Mmap::map(&file) }.map_err(|e| anyhow!("Failed to map {:?}: {}", path, e))?;
+        Self::from_data(SymbolData::Mapped(map)).map_err(|e| anyhow!("{:?}: {}", path, e))
+    }
+
+    /// Checks the header and that every section fits; the records themselves are only
+    /// read on lookup, and a record pointing out of bounds reads as empty
+    fn from_data(data: SymbolData) -> Result<Self> {
+        let bytes = match &data {
+            SymbolData::Owned(v) => v.as_slice(),
+            SymbolData::Mapped(m) => m,
+        };
+        if bytes.len() < HEADER_LEN * 4 || &bytes[..4] != MAGIC {
+            return Err(anyhow!("Not a kiln symbol index"));
+        }
+
+        let word = |i: usize| u32::from_le_bytes(bytes[i * 4..i * 4 + 4].try_into().unwrap()) as usize;
+        if word(1) != FORMAT_VERSION as usize {
+            return Err(anyhow!("Symbol index format {} is not supported", word(1)));
+        }
+        let (files, symbols, locations, strings) = (word(2), word(3), word(4), word(5));
+        let len = (HEADER_LEN + files * FILE_LEN + symbols * SYMBOL_LEN + locations * LOCATION_LEN) * 4 + strings;
+        if bytes.len() != len {
+            return Err(anyhow!("Truncated symbol index"));
+        }
+
+        Ok(Self {
+            data,
+            files,
+            symbols,
+            locations,
+        })
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        match &self.data {
+            SymbolData::Owned(v) => v,
+            SymbolData::Mapped(m) => m,
+        }
+    }
+
+    /// Every symbol in name order
+    pub fn symbols(&self) -> impl Iterator<Item = Symbol<'_>> {
+        (0..self.symbols).map(move |record| Symbol { index: self, record })
+    }
+
+    /// The symbols called `name` (at most one of each kind)
+    pub fn lookup<'i>(&'i self, name: &'i str) -> impl Iterator<Item = Symbol<'i>> + 'i {
+        let start = partition_point(self.symbols, |i| self.symbol_name(i).as_bytes() < name.as_bytes());
+        (start..self.symbols)
+            .take_while(move |&i| self.symbol_name(i) == name)
+            .map(move |record| Symbol { index: self, record })
+    }
+
+    /// Symbols defined more than once across the project's files. Pots are left out,
+    /// they're built on their own and their names don't clash with the project's headers.
+    pub fn duplicates(&self) -> impl Iterator<Item = Symbol<'_>> {
+        self.symbols().filter(|sym| {
+            let mut files: Vec<_> = sym.definitions().filter(|d| d.origin == Origin::Project).map(|d| d.file).collect();
+            files.dedup();
+            files.len() > 1
+        })
+    }
+
+    /// Project functions that nothing in the project or its pots calls, except `main`
+    pub fn unreferenced(&self) -> impl Iterator<Item = Symbol<'_>> {
+        self.symbols().filter(|sym| {
+            sym.kind() == SymbolKind::Function
+                && sym.name() != "main"
+                && sym.references().next().is_none()
+                && sym.definitions().any(|d| d.origin == Origin::Project)
+        })
+    }
+
+    /// Project functions defined in one file and called only from that same file, which
+    /// could be `static`. Only calls are tracked, so a function whose address is taken
+    /// elsewhere still shows up here.
+    pub fn internal_only(&self) -> impl Iterator<Item = Symbol<'_>> {
+        self.symbols().filter(|sym| {
+            let mut defs = sym.definitions();
+            let (Some(def), None) = (defs.next(), defs.next()) else {
+                return false;
+            };
+            let mut refs = sym.references().peekable();
+            sym.kind() == SymbolKind::Function
+                && def.origin == Origin::Project
+                && sym.name() != "main"
+                && refs.peek().is_some()
+                && refs.all(|r| r.file == def.file)
+        })
+    }
+
+    fn word(&self, idx: usize) -> usize {
+        let bytes = self.as_bytes();
+        u32::from_le_bytes(bytes[idx * 4..idx * 4 + 4].try_into().unwrap()) as usize
+    }
+
+    fn files_at(&self) -> usize {
+        HEADER_LEN
+    }
+
+    fn symbols_at(&self) -> usize {
+        self.files_at() + self.files * FILE_LEN
+    }
+
+    fn locations_at(&self) -> usize {
+        self.symbols_at() + self.symbols * SYMBOL_LEN
+    }
+
+    fn string(&self, offset: usize, len: usize) -> &str {
+        let strings = &self.as_bytes()[(self.locations_at() + self.locations * LOCATION_LEN) * 4..];
+        strings
+            .get(offset..offset + len)
+            .and_then(|s| std::str::from_utf8(s).ok())
+            .unwrap_or("")
+    }
+
+    fn symbol_field(&self, symbol: usize, field: usize) -> usize {
+        self.word(self.symbols_at() + symbol * SYMBOL_LEN + field)
+    }
+
+    fn symbol_name(&self, symbol: usize) -> &str {
+        self.string(self.symbol_field(symbol, 0), self.symbol_field(symbol, 1))
+    }
+
+    fn locations(&self, start: usize, len: usize) -> impl Iterator<Item = Location<'_>> {
+        let range = match start.checked_add(len) {
+            Some(end) if end <= self.locations => start..end,
+            _ => 0..0,
+        };
+        range.filter_map(move |i| {
+            let at = self.locations_at() + i * LOCATION_LEN;
+            let file = self.word(at);
+            if file >= self.files {
+                return None;
+            }
+            let record = self.files_at() + file * FILE_LEN;
+            Some(Location {
+                file: self.string(self.word(record), self.word(record + 1)),
+                line: self.word(at + 1),
+                origin: match self.word(record + 2) {
+                    0 => Origin::Project,
+                    _ => Origin::Pot,
+                },
+            })
+        })
+    }
+}
+
+impl<'i> Symbol<'i> {
+    pub fn name(&self) -> &'i str {
+        self.index.symbol_name(self.record)
+    }
+
+    pub fn kind(&self) -> SymbolKind {
+        match self.index.symbol_field(self.record, 2) {
+            0 => SymbolKind::Function,
+            1 => SymbolKind::Type,
+            _ => SymbolKind::Macro,
+        }
+    }
+
+    /// Where the symbol is defined, in file order
+    pub fn definitions(&self) -> impl Iterator<Item = Location<'i>> {
+        let index = self.index;
+        index.locations(index.symbol_field(self.record, 3), index.symbol_field(self.record, 4))
+    }
+
+    /// Where the symbol is called, in file and line order
+    pub fn references(&self) -> impl Iterator<Item = Location<'i>> {
+        let index = self.index;
+        index.locations(index.symbol_field(self.record, 5), index.symbol_field(self.record, 6))
+    }
+
+    pub fn to_json(&self) -> serde_json::Value {
+        let locations = |locs: &mut dyn Iterator<Item = Location>| -> Vec<serde_json::Value> {
+            locs.map(|l| {
+                serde_json::json!({
+                    "file": l.file,
+                    "line": l.line,
+                    "pot": l.origin == Origin::Pot,
+                })
+            })
+            .collect()
+        };
+        serde_json::json!({
+            "name": self.name(),
+            "kind": format!("{:?}", self.kind()).to_lowercase(),
+            "definitions": locations(&mut self.definitions()),
+            "references": locations(&mut self.references()),
+        })
+    }
+}
+
+/// `slice::partition_point` over the indices `0..len`
+fn partition_point(len: usize, pred: impl Fn(usize) -> bool) -> usize {
+    let (mut lo, mut hi) = (0, len);
+    while lo < hi {
+        let mid = lo + (hi - lo) / 2;
+        if pred(mid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    lo
+}
+
+#[cfg(test)]
+mod symbol_index_tests {
+    use std::fs;
+
+    use super::*;
+    use crate::source_index::SourceIndex;
+
+    #[test]
+    fn test_build_and_query() {
+        let dir = tempfile::tempdir().unwrap();
+        let src = dir.path().join("src");
+        let pot = dir.path().join("pot");
+        fs::create_dir_all(&src).unwrap();
+        fs::create_dir_all(&pot).unwrap();
+        fs::write(src.join("a.c"), "#define SQ(x) ((x) * (x))\nstruct Vec { int x; };\n\nint used(int x) {\n    return SQ(x);\n}\n\nint local(void) {\n    return 1;\n}\n\nint orphan(void) {\n    return local();\n}\n").unwrap();
+        fs::write(src.join("b.c"), "struct Vec { int y; };\n\nint unused(void) {\n    return 0;\n}\n\nint main() {\n    return used(atoi(\"1\"));\n}\n").unwrap();
+        fs::write(pot.join("lib.c"), "int helper(void) {\n    return unused();\n}\n").unwrap();
+
+        let mut project = SourceIndex::new();
+        project.refresh(&src).unwrap();
+        let mut pots = SourceIndex::new();
+        pots.refresh(&pot).unwrap();
+
+        let files = project
+            .files()
+            .map(|(name, entry)| (name, entry, Origin::Project))
+            .chain(pots.files().map(|(name, entry)| (name, entry, Origin::Pot)));
+        let path = dir.path().join("symbols.idx");
+        fs::write(&path, SymbolIndex::build(files).as_bytes()).unwrap();
+        let index = SymbolIndex::open(&path).unwrap();
+
+        let used: Vec<_> = index.lookup("used").collect();
+        assert_eq!(used.len(), 1);
+        let loc = |file, line, origin| Location { file, line, origin };
+        assert_eq!(used[0].definitions().collect::<Vec<_>>(), [loc("a.c", 4, Origin::Project)]);
+        assert_eq!(used[0].references().collect::<Vec<_>>(), [loc("b.c", 8, Origin::Project)]);
+
+        let sq: Vec<_> = index.lookup("SQ").map(|s| (s.kind(), s.references().count())).collect();
+        assert_eq!(sq, [(SymbolKind::Macro, 1)]);
+        let atoi: Vec<_> = index.lookup("atoi").map(|s| (s.kind(), s.definitions().count())).collect();
+        assert_eq!(atoi, [(SymbolKind::Function, 0)]);
+        assert_eq!(index.lookup("missing").count(), 0);
+
+        // `unused` is only called from a pot, which still counts; `helper` lives in the pot
+        assert_eq!(index.unreferenced().map(|s| s.name()).collect::<Vec<_>>(), ["orphan"]);
+        assert_eq!(index.duplicates().map(|s| s.name()).collect::<Vec<_>>(), ["Vec"]);
+        assert_eq!(index.internal_only().map(|s| s.name()).collect::<Vec<_>>(), ["local"]);
+
+        assert!(SymbolIndex::open(&src.join("a.c")).is_err());
+    }
+}
@@ -1,2 +1,4 @@
+pub mod perf_lints;
+pub mod rules;
 pub mod safety;
 pub mod unit_testing;
@@ -0,0 +1,788 @@
+// Performance lints that work on the token stream.
+//
+// They run while the source index scans a file, so a file is lexed once for everything,
+// and what they find is stored with the file's entry. Whether a lint is on is only decided
+// when the entries are checked (`safety::check_files`), so turning one off or on doesn't
+// mean scanning again.
+//
+// Each lint is a heuristic over the tokens of one function at a time: no types, no macro
+// expansion. They lean towards saying nothing when the code doesn't clearly show the
+// hazard.
+
+use std::collections::HashMap;
+use std::ops::Range;
+
+use crate::header_gen::lexer_c::{Token, TokenSource};
+
+/// Every lint, by the name `[static_analysis] disable` knows it by
+pub const LINTS: [&str; 6] = [
+    "strlen_in_loop_condition",
+    "alloc_in_loop",
+    "struct_by_value",
+    "printf_in_hot_function",
+    "missing_restrict_const",
+    "endl_in_loop",
+];
+
+/// Structs at least this large (as far as the tokens tell) are worth passing by pointer
+pub const LARGE_STRUCT: usize = 64;
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Finding {
+    /// One of `LINTS`
+    pub lint: &'static str,
+    /// Index of the token the finding is about
+    pub token: usize,
+    pub msg: String,
+}
+
+/// Runs every lint over `tokens`, which start at brace depth `depth`. `udts` are the
+/// struct definitions among them (as from `get_declarations`), so parameters of those
+/// types can be sized.
+pub fn scan<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, udts: &[Range<usize>], depth: usize) -> Vec<Finding> {
+    let code = Code::new(tokens);
+    let sizes = struct_sizes(tokens, udts);
+    let mut findings = vec![];
+
+    for func in code.functions(depth) {
+        let loops = code.loops(func.body.clone());
+        let mut in_loop = vec![false; func.body.len()];
+        for l in &loops {
+            in_loop[l.body.start - func.body.start..l.body.end - func.body.start].fill(true);
+        }
+
+        for l in &loops {
+            if let Some(i) = l.condition.clone().find(|&i| code.is_call(i, &["strlen", "wcslen"])) {
+                findings.push(code.finding(
+                    "strlen_in_loop_condition",
+                    i,
+                    format!(
+                        "{}() in a loop condition walks the whole string on every iteration, compute it once before the loop",
+                        code.name(i)
+                    ),
+                ));
+            }
+        }
+
+        for i in func.body.clone().filter(|&i| in_loop[i - func.body.start]) {
+            if code.is_call(i, &["malloc", "calloc", "realloc", "aligned_alloc"]) {
+                let msg = format!(
+                    "{}() inside a loop allocates on every iteration, allocate once before the loop and reuse the memory",
+                    code.name(i)
+                );
+                findings.push(code.finding("alloc_in_loop", i, msg));
+            } else if code.name(i) == "new"
+                && code.get(i + 1).is_some_and(|t| matches!(t, Token::Object(n) if is_identifier(n)))
+            {
+                let msg = "`new` inside a loop allocates on every iteration, allocate once before the loop and reuse the memory";
+                findings.push(code.finding("alloc_in_loop", i, msg.to_string()));
+            } else if code.name(i) == "endl"
+                && matches!(code.get(i.wrapping_sub(1)), Some(Token::LessThan | Token::Colon))
+            {
+                let msg = "std::endl inside a loop flushes the stream on every iteration, write '\\n' instead";
+                findings.push(code.finding("endl_in_loop", i, msg.to_string()));
+            }
+        }
+
+        let params = code.params(&func);
+        for param in &params {
+            if param.pointers > 0 || param.by_reference {
+                continue;
+            }
+            let Some((ty, size)) = param.types.iter().find_map(|ty| Some((ty, *sizes.get(ty.as_str())?))) else {
+                continue;
+            };
+            if size >= LARGE_STRUCT {
+                let msg = format!(
+                    "`{}` of {}() passes {} (at least {} bytes) by value, copying it on every call. Pass a const pointer instead.",
+                    param.name,
+                    func.name,
+                    ty,
+                    size
+                );
+                findings.push(code.finding("struct_by_value", param.token, msg));
+            }
+        }
+
+        if code.is_hot(&func) {
+            let printing = ["printf", "fprintf", "vprintf", "vfprintf", "puts", "fputs"];
+            for i in func.body.clone().filter(|&i| code.is_call(i, &printing)) {
+                let msg = format!(
+                    "{}() in hot function {}() formats and locks stdio on every call, keep reporting out of the hot path",
+                    code.name(i),
+                    func.name
+                );
+                findings.push(code.finding("printf_in_hot_function", i, msg));
+            }
+        }
+
+        if !loops.is_empty() && code.is_leaf(&func) {
+            findings.extend(code.restrict_const(&func, &params));
+        }
+    }
+
+    findings.sort_by_key(|f| f.token);
+    findings
+}
+
+/// A function definition, in indexes of `Code::toks`
+struct Function<'a> {
+    name: &'a str,
+    signature: Range<usize>,
+    /// From `{` to `}`, both included
+    body: Range<usize>,
+}
+
+struct Loop {
+    /// What's evaluated before every iteration: the whole condition of a `while`, the
+    /// middle of a `for`
+    condition: Range<usize>,
+    body: Range<usize>,
+}
+
+struct Param<'a> {
+    name: &'a str,
+    token: usize,
+    /// The names its type is spelled with, `struct Tag` for a tag
+    types: Vec<String>,
+    pointers: usize,
+    by_reference: bool,
+    /// `const` before the first `*`, `restrict` after it
+    pointee_const: bool,
+    restrict: bool,
+}
+
+/// The significant tokens of the input outside of preprocessor directives, with where
+/// each bracket closes
+struct Code<'a> {
+    toks: Vec<(usize, Token<'a>)>,
+    /// Index of the matching closing bracket of each opening one, `toks.len()` when unclosed
+    closing: Vec<usize>,
+}
+
+impl<'a> Code<'a> {
+    fn new<T: TokenSource<'a> + ?Sized>(tokens: &T) -> Self {
+        let mut toks = vec![];
+        let (mut directive, mut continued, mut line_start) = (false, false, true);
+        for idx in 0..tokens.len() {
+            let token = tokens.token_at(idx);
+            match token {
+                Token::HashTag if line_start => directive = true,
+                Token::NewLine if !continued => directive = false,
+                _ => {}
+            }
+            continued = token == Token::BackSlash || (continued && matches!(token, Token::Space | Token::Tab));
+            line_start = token == Token::NewLine || (line_start && matches!(token, Token::Space | Token::Tab));
+            if !directive && !matches!(token, Token::Space | Token::Tab | Token::NewLine | Token::Comment(_)) {
+                toks.push((idx, token));
+            }
+        }
+
+        let mut closing = vec![toks.len(); toks.len()];
+        let mut open = vec![];
+        for (i, &(_, token)) in toks.iter().enumerate() {
+            match token {
+                Token::OpenParen | Token::OpenSquareBracket | Token::OpenCurlyBrace => open.push(i),
+                Token::CloseParen | Token::CloseSquareBracket | Token::CloseCurlyBrace => {
+                    if let Some(o) = open.pop() {
+                        closing[o] = i;
+                    }
+                }
+                _ => {}
+            }
+        }
+        Self { toks, closing }
+    }
+
+    fn get(&self, i: usize) -> Option<Token<'a>> {
+        self.toks.get(i).map(|&(_, t)| t)
+    }
+
+    fn name(&self, i: usize) -> &'a str {
+        match self.get(i) {
+            Some(Token::Object(name)) => name,
+            _ => "",
+        }
+    }
+
+    fn is_call(&self, i: usize, names: &[&str]) -> bool {
+        names.contains(&self.name(i)) && self.get(i + 1) == Some(Token::OpenParen)
+    }
+
+    fn finding(&self, lint: &'static str, i: usize, msg: String) -> Finding {
+        Finding { lint, token: self.toks[i].0, msg }
+    }
+
+    /// The function definitions at the top level (or in a namespace or `extern "C"`
+    /// block), for tokens starting at brace depth `depth`
+    fn functions(&self, depth: usize) -> Vec<Function<'a>> {
+        let mut functions = vec![];
+        // Braces that are still open, and whether each one is a namespace-like block
+        let mut open = vec![false; depth];
+        let mut start = 0;
+
+        let mut i = 0;
+        while i < self.toks.len() {
+            match self.toks[i].1 {
+                Token::Semicolon if !open.contains(&false) => start = i + 1,
+                Token::CloseCurlyBrace => {
+                    open.pop();
+                    start = i + 1;
+                }
+                Token::OpenCurlyBrace if open.contains(&false) => open.push(false),
+                Token::OpenCurlyBrace => {
+                    let signature = start..i;
+                    let transparent = matches!(self.name(start), "namespace" | "extern");
+                    match self.fn_name(signature.clone()) {
+                        Some(name) if !transparent => {
+                            let end = self.closing[i].min(self.toks.len() - 1);
+                            functions.push(Function { name, signature, body: i..end + 1 });
+                            i = end + 1;
+                            start = i;
+                            continue;
+                        }
+                        _ => {
+                            open.push(transparent);
+                            start = i + 1;
+                        }
+                    }
+                }
+                _ => {}
+            }
+            i += 1;
+        }
+        functions
+    }
+
+    /// Where the parameter list of the function signature `signature` opens: the last
+    /// parenthesis at its top level right after a name that isn't an attribute
+    fn param_list(&self, signature: Range<usize>) -> Option<usize> {
+        let mut found = None;
+        let mut i = signature.start;
+        while i < signature.end {
+            if self.get(i) == Some(Token::OpenParen) {
+                let name = self.name(i.wrapping_sub(1));
+                if i > signature.start && is_identifier(name) && !ATTRIBUTES.contains(&name) {
+                    found = Some(i);
+                }
+                i = self.closing[i];
+            }
+            i += 1;
+        }
+        found.filter(|&open| self.closing[open] < signature.end)
+    }
+
+    fn fn_name(&self, signature: Range<usize>) -> Option<&'a str> {
+        let open = self.param_list(signature.clone())?;
+        // `) {`, `) const {`, ... but not `= {` or `struct Foo {`
+        let tail = self.closing[open] + 1..signature.end;
+        let tail_ok = tail.clone().all(|i| match self.toks[i].1 {
+            Token::Object(word) => {
+                matches!(word, "const" | "noexcept" | "override" | "final") || ATTRIBUTES.contains(&word)
+            }
+            Token::OpenParen | Token::CloseParen => true,
+            _ => false,
+        });
+        let name = self.name(open - 1);
+        (tail_ok && !KEYWORDS.contains(&name)).then_some(name)
+    }
+
+    /// The loops in `body`, nested ones included
+    fn loops(&self, body: Range<usize>) -> Vec<Loop> {
+        let mut loops = vec![];
+        for i in body.clone() {
+            let (condition, after) = match self.name(i) {
+                "for" | "while" if self.get(i + 1) == Some(Token::OpenParen) => {
+                    let (open, close) = (i + 1, self.closing[i + 1]);
+                    let condition = match self.name(i) {
+                        "for" => {
+                            let semis: Vec<_> =
+                                (open + 1..close).filter(|&j| self.is_top_level_semi(open, j)).collect();
+                            match semis[..] {
+                                [first, second, ..] => first + 1..second,
+                                _ => open + 1..close,
+                            }
+                        }
+                        _ => open + 1..close,
+                    };
+                    (condition, close + 1)
+                }
+                "do" => (0..0, i + 1),
+                _ => continue,
+            };
+            if after >= body.end {
+                continue;
+            }
+            loops.push(Loop { condition, body: after..self.statement_end(after, body.end) });
+        }
+        loops
+    }
+
+    fn is_top_level_semi(&self, open: usize, j: usize) -> bool {
+        if self.get(j) != Some(Token::Semicolon) {
+            return false;
+        }
+        let mut k = open + 1;
+        while k < j {
+            if matches!(self.get(k), Some(Token::OpenParen | Token::OpenSquareBracket | Token::OpenCurlyBrace)) {
+                k = self.closing[k];
+                if k > j {
+                    return false;
+                }
+            }
+            k += 1;
+        }
+        true
+    }
+
+    /// End (exclusive) of the statement starting at `i`: a block, or everything up to
+    /// the next `;` outside of brackets
+    fn statement_end(&self, i: usize, limit: usize) -> usize {
+        let mut j = i;
+        while j < limit {
+            match self.toks[j].1 {
+                Token::OpenCurlyBrace if j == i => return (self.closing[j] + 1).min(limit),
+                Token::OpenParen | Token::OpenSquareBracket | Token::OpenCurlyBrace => {
+                    j = self.closing[j];
+                    // A block ends a statement like `for (..) { .. }` nested in this one
+                    if self.get(j) == Some(Token::CloseCurlyBrace) {
+                        return (j + 1).min(limit);
+                    }
+                }
+                Token::Semicolon => return j + 1,
+                _ => {}
+            }
+            j += 1;
+        }
+        limit
+    }
+
+    fn params(&self, func: &Function<'a>) -> Vec<Param<'a>> {
+        let Some(open) = self.param_list(func.signature.clone()) else {
+            return vec![];
+        };
+        let close = self.closing[open];
+
+        let mut params = vec![];
+        let mut start = open + 1;
+        let mut i = open + 1;
+        while i <= close {
+            match self.toks[i].1 {
+                Token::OpenParen | Token::OpenSquareBracket if i < close => i = self.closing[i],
+                Token::Comma | Token::CloseParen => {
+                    params.extend(self.param(start..i));
+                    start = i + 1;
+                }
+                _ => {}
+            }
+            i += 1;
+        }
+        params
+    }
+
+    /// The parameter declared by the tokens in `range`. Function pointers, arrays and
+    /// unnamed parameters aren't of interest.
+    fn param(&self, range: Range<usize>) -> Option<Param<'a>> {
+        if range.clone().any(|i| matches!(self.toks[i].1, Token::OpenParen | Token::OpenSquareBracket)) {
+            return None;
+        }
+        let token = range.clone().rev().find(|&i| matches!(self.toks[i].1, Token::Object(_)))?;
+        let name = self.name(token);
+        let before = range.start..token;
+        if before.is_empty() || !is_identifier(name) || KEYWORDS.contains(&name) {
+            return None;
+        }
+
+        let first_pointer = before.clone().find(|&i| self.get(i) == Some(Token::Asterisk));
+        let mut types = vec![];
+        for i in before.clone() {
+            let word = self.name(i);
+            if !is_identifier(word) || QUALIFIERS.contains(&word) || matches!(word, "struct" | "union" | "enum") {
+                continue;
+            }
+            types.push(match self.name(i.wrapping_sub(1)) {
+                "struct" => format!("struct {}", word),
+                _ => word.to_string(),
+            });
+        }
+
+        Some(Param {
+            name,
+            token,
+            types,
+            pointers: before.clone().filter(|&i| self.get(i) == Some(Token::Asterisk)).count(),
+            by_reference: before.clone().any(|i| self.get(i) == Some(Token::Ampersand)),
+            pointee_const: first_pointer.is_some_and(|p| (range.start..p).any(|i| self.name(i) == "const")),
+            restrict: first_pointer.is_some_and(|p| {
+                (p..token).any(|i| matches!(self.name(i), "restrict" | "__restrict" | "__restrict__"))
+            }),
+        })
+    }
+
+    /// `__attribute__((hot))` or `[[gnu::hot]]` on the definition
+    fn is_hot(&self, func: &Function) -> bool {
+        func.signature.clone().any(|i| {
+            matches!(self.name(i), "hot" | "__hot__")
+                && matches!(self.get(i.wrapping_sub(1)), Some(Token::OpenParen | Token::Colon | Token::Comma))
+        })
+    }
+
+    /// Whether the body of `func` calls nothing, so its pointers can only alias through
+    /// its parameters
+    fn is_leaf(&self, func: &Function) -> bool {
+        !func.body.clone().any(|i| {
+            let name = self.name(i);
+            is_identifier(name) && self.get(i + 1) == Some(Token::OpenParen) && !KEYWORDS.contains(&name)
+        })
+    }
+
+    /// Pointer parameters of the leaf kernel `func` that should be `restrict` (when
+    /// several may alias) or point to const (when it only reads through them)
+    fn restrict_const(&self, func: &Function, params: &[Param]) -> Vec<Finding> {
+        let pointers: Vec<_> = params.iter().filter(|p| p.pointers > 0).collect();
+        let mut findings = vec![];
+
+        let unrestricted: Vec<_> = pointers.iter().filter(|p| !p.restrict).map(|p| p.name).collect();
+        if pointers.len() >= 2 && !unrestricted.is_empty() {
+            let msg = format!(
+                "{}() is a leaf loop kernel whose pointer parameters may alias, declaring {} `restrict` \
+                 (`__restrict` in C++) lets the compiler keep values in registers and vectorize",
+                func.name,
+                unrestricted.join(", ")
+            );
+            findings.push(self.finding("missing_restrict_const", pointers[0].token, msg));
+        }
+
+        for p in pointers.iter().filter(|p| p.pointers == 1 && !p.pointee_const) {
+            if self.only_read(func, p.name) {
+                let msg = format!("{}() only reads through `{}`, declare it a pointer to const", func.name, p.name);
+                findings.push(self.finding("missing_restrict_const", p.token, msg));
+            }
+        }
+        findings
+    }
+
+    /// Whether every use of `name` in the body of `func` reads through it (`name[i]`,
+    /// `*name`, `name->x`). Any other use (arithmetic, copies, ...) may lead to a write.
+    fn only_read(&self, func: &Function, name: &str) -> bool {
+        let mut used = false;
+        for i in func.body.clone().filter(|&i| self.name(i) == name) {
+            used = true;
+            let deref = self.get(i.wrapping_sub(1)) == Some(Token::Asterisk)
+                && !matches!(
+                    self.get(i.wrapping_sub(2)),
+                    Some(Token::Object(_) | Token::Literal(_) | Token::CloseParen | Token::CloseSquareBracket)
+                );
+            let start = if deref { i - 1 } else { i };
+
+            let mut end = i + 1;
+            loop {
+                match (self.get(end), self.get(end + 1)) {
+                    (Some(Token::OpenSquareBracket), _) => end = self.closing[end] + 1,
+                    (Some(Token::Minus), Some(Token::GreaterThan)) => end += 3,
+                    (Some(Token::Period), _) if end > i + 1 => end += 2,
+                    _ => break,
+                }
+            }
+            if !deref && end == i + 1 {
+                return false;
+            }
+            if self.is_assigned(start, end) {
+                return false;
+            }
+        }
+        used
+    }
+
+    /// Whether the lvalue spanning `start..end` is assigned, incremented or decremented
+    fn is_assigned(&self, start: usize, end: usize) -> bool {
+        let before = (self.get(start.wrapping_sub(2)), self.get(start.wrapping_sub(1)));
+        if matches!(before, (Some(Token::Plus), Some(Token::Plus)) | (Some(Token::Minus), Some(Token::Minus))) {
+            return true;
+        }
+        match (self.get(end), self.get(end + 1), self.get(end + 2)) {
+            (Some(Token::Equal), next, _) => next != Some(Token::Equal),
+            (Some(Token::Plus), Some(Token::Plus), _) | (Some(Token::Minus), Some(Token::Minus), _) => true,
+            (Some(Token::LessThan), Some(Token::LessThan), Some(Token::Equal))
+            | (Some(Token::GreaterThan), Some(Token::GreaterThan), Some(Token::Equal)) => true,
+            (Some(op), Some(Token::Equal), _) => matches!(
+                op,
+                Token::Plus
+                    | Token::Minus
+                    | Token::Asterisk
+                    | Token::ForwardSlash
+                    | Token::ModOperator
+                    | Token::Ampersand
+                    | Token::Pipe
+                    | Token::Carrot
+            ),
+            _ => false,
+        }
+    }
+}
+
+/// Words that come right before a parenthesis without being a function name
+const KEYWORDS: [&str; 12] =
+    ["if", "for", "while", "switch", "return", "sizeof", "alignof", "_Alignof", "do", "else", "case", "defined"];
+
+const ATTRIBUTES: [&str; 6] = ["__attribute__", "__declspec", "alignas", "_Alignas", "noexcept", "throw"];
+
+const QUALIFIERS: [&str; 10] = [
+    "const",
+    "volatile",
+    "restrict",
+    "__restrict",
+    "__restrict__",
+    "register",
+    "static",
+    "inline",
+    "extern",
+    "unsigned",
+];
+
+/// Sizes of the structs defined in `udts` by name (typedef names and `struct Tag`), as the
+/// sum of their members. Members of unknown types count as a pointer and arrays of
+/// unknown length as one element, so the sizes are lower bounds.
+fn struct_sizes<'a, T: TokenSource<'a> + ?Sized>(tokens: &T, udts: &[Range<usize>]) -> HashMap<String, usize> {
+    let mut sizes = HashMap::new();
+    for span in udts {
+        let code = Code::new(&Span { tokens, range: span.clone() });
+        let (Some(open), Some(first)) = (code.toks.iter().position(|&(_, t)| t == Token::OpenCurlyBrace), code.get(0))
+        else {
+            continue;
+        };
+        let kind = code.name(if first == Token::Object("typedef") { 1 } else { 0 });
+        if kind != "struct" {
+            continue;
+        }
+        let close = code.closing[open];
+        let size = members_size(&code, open + 1..close, &sizes);
+
+        if is_identifier(code.name(open - 1)) && code.name(open - 1) != "struct" {
+            sizes.insert(format!("struct {}", code.name(open - 1)), size);
+        }
+        if first == Token::Object("typedef") {
+            for i in close + 1..code.toks.len() {
+                if is_identifier(code.name(i))
+                    && matches!(code.get(i + 1), Some(Token::Semicolon | Token::Comma) | None)
+                {
+                    sizes.insert(code.name(i).to_string(), size);
+                }
+            }
+        }
+    }
+    sizes
+}
+
+fn members_size(code: &Code, members: Range<usize>, sizes: &HashMap<String, usize>) -> usize {
+    let mut total = 0;
+    let mut start = members.start;
+    let mut i = members.start;
+    while i < members.end {
+        match code.toks[i].1 {
+            Token::OpenCurlyBrace => {
+                // A nested struct or union, counted as its members
+                total += members_size(code, i + 1..code.closing[i], sizes);
+                i = code.closing[i];
+                start = i + 1;
+            }
+            Token::Semicolon => {
+                total += declaration_size(code, start..i, sizes);
+                start = i + 1;
+            }
+            _ => {}
+        }
+        i += 1;
+    }
+    total
+}
+
+/// Size of the members declared by `int a, *b, c[4]`
+fn declaration_size(code: &Code, decl: Range<usize>, sizes: &HashMap<String, usize>) -> usize {
+    if decl.is_empty() {
+        return 0;
+    }
+    if decl.clone().any(|i| code.get(i) == Some(Token::Colon)) {
+        // Bit-fields, as if they shared an int
+        return 4;
+    }
+    // The type ends where the first declarator starts: its `*` or its name
+    let type_end = decl
+        .clone()
+        .find(|&i| {
+            code.get(i) == Some(Token::Asterisk)
+                || matches!(code.get(i + 1), Some(Token::Comma | Token::OpenSquareBracket) | None)
+                || i + 1 == decl.end
+        })
+        .unwrap_or(decl.end);
+    let words: Vec<&str> = (decl.start..type_end).map(|i| code.name(i)).collect();
+    let base = scalar_size(&words, sizes);
+
+    let mut total = 0;
+    let mut declarator = type_end..type_end;
+    for i in type_end..=decl.end {
+        if i < decl.end && code.get(i) != Some(Token::Comma) {
+            continue;
+        }
+        declarator.end = i;
+        let pointer = declarator.clone().any(|j| code.get(j) == Some(Token::Asterisk));
+        let mut size = if pointer { 8 } else { base };
+        for j in declarator.clone().filter(|&j| code.get(j) == Some(Token::OpenSquareBracket)) {
+            let len = match (code.name(j + 1).parse::<usize>(), code.get(j + 2)) {
+                (Ok(len), Some(Token::CloseSquareBracket)) => len,
+                _ => 1,
+            };
+            size *= len;
+        }
+        total += size;
+        declarator = i + 1..i + 1;
+    }
+    total
+}
+
+fn scalar_size(words: &[&str], sizes: &HashMap<String, usize>) -> usize {
+    let has = |w: &str| words.contains(&w);
+    if let Some(pos) = words.iter().position(|&w| w == "struct") {
+        let tag = words.get(pos + 1).copied().unwrap_or("");
+        return sizes.get(&format!("struct {}", tag)).copied().unwrap_or(8);
+    }
+    if let Some(size) = words.iter().find_map(|w| sizes.get(*w)) {
+        return *size;
+    }
+    match () {
+        _ if has("char") || has("bool") || has("_Bool") || has("int8_t") || has("uint8_t") => 1,
+        _ if has("short") || has("int16_t") || has("uint16_t") => 2,
+        _ if has("double") && has("long") => 16,
+        _ if has("double") || has("long") || has("int64_t") || has("uint64_t") || has("size_t") => 8,
+        _ if has("float") || has("int") || has("int32_t") || has("uint32_t") || has("unsigned") => 4,
+        _ => 8,
+    }
+}
+
+fn is_identifier(s: &str) -> bool {
+    s.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_')
+}
+
+/// The tokens of `range` in `tokens`, indexed from 0
+struct Span<'t, T: ?Sized> {
+    tokens: &'t T,
+    range: Range<usize>,
+}
+
+impl<'a, T: TokenSource<'a> + ?Sized> TokenSource<'a> for Span<'_, T> {
+    fn len(&self) -> usize {
+        self.range.len()
+    }
+
+    fn token_at(&self, idx: usize) -> Token<'a> {
+        self.tokens.token_at(self.range.start + idx)
+    }
+}
+
+#[cfg(test)]
+mod perf_lints_tests {
+    use super::*;
+    use crate::header_gen::lexer_c::{get_declarations, tokenize_compact};
+    use crate::source_index::{FileEntry, Hazard};
+    use crate::testing::rules::{RuleSet, StaticAnalysisConfig};
+    use crate::testing::safety::check_files;
+
+    #[test]
+    fn test_lints() {
+        let code = r#"#include <stdio.h>
+typedef struct {
+    double m[4][4];
+    char name[32];
+} Matrix;
+struct Small { int x, y; };
+
+void upper(char *s) {
+    for (size_t i = 0; i < strlen(s); i++) {
+        char *tmp = malloc(16);
+        s[i] = toupper(s[i]);
+        free(tmp);
+    }
+}
+
+int trace(Matrix m, struct Small s, const Matrix *p) {
+    return m.m[0][0] + s.x;
+}
+
+__attribute__((hot)) void step(int n) {
+    printf("%d\n", n);
+}
+
+static void axpy(float *y, float *x, float a, int n) {
+    for (int i = 0; i < n; i++)
+        y[i] += a * x[i];
+}
+
+void copy(const float *restrict src, float *restrict dst, int n) {
+    while (n--) *dst++ = *src++;
+}
+"#;
+        let tokens = tokenize_compact(code).unwrap();
+        let decls = get_declarations(&tokens);
+        let findings: Vec<_> = scan(&tokens, &decls.udts, 0)
+            .into_iter()
+            .map(|f| (f.lint, code[..tokens.span(f.token).start].matches('\n').count() + 1))
+            .collect();
+
+        assert_eq!(
+            findings,
+            [
+                ("strlen_in_loop_condition", 9),
+                ("alloc_in_loop", 10),
+                ("struct_by_value", 16),
+                ("printf_in_hot_function", 21),
+                ("missing_restrict_const", 24),
+                ("missing_restrict_const", 24),
+            ]
+        );
+        let msgs: Vec<_> = scan(&tokens, &decls.udts, 0).into_iter().map(|f| f.msg).collect();
+        assert!(msgs[2].contains("passes Matrix (at least 160 bytes)"), "{}", msgs[2]);
+        assert!(msgs[5].contains("only reads through `x`"), "{}", msgs[5]);
+    }
+
+    #[test]
+    fn test_loop_lints_and_disabling_them() {
+        let code = r#"void log_all(const std::vector<int> &v) {
+    for (int x : v) {
+        std::cout << x << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void fill(Node **nodes, int n) {
+    int i = 0;
+    do {
+        nodes[i] = new Node;
+        nodes[i]->buf = (char *)malloc(8);
+    } while (++i < n);
+    Node *last = new Node;
+}
+"#;
+        let tokens = tokenize_compact(code).unwrap();
+        let decls = get_declarations(&tokens);
+        let hazards = scan(&tokens, &decls.udts, 0).into_iter().map(|f| Hazard {
+            lint: f.lint.to_string(),
+            line: code[..tokens.span(f.token).start].matches('\n').count() + 1,
+            msg: f.msg,
+        });
+        let entry = FileEntry { hazards: hazards.collect(), ..Default::default() };
+        let warnings = |rules: &RuleSet| -> Vec<String> {
+            check_files([("a.cpp", &entry)].into_iter(), rules)
+                .into_iter()
+                .map(|w| format!("{}:{}", w.subject, w.line))
+                .collect()
+        };
+
+        // Only what runs on every iteration: `new` and malloc() in a do loop, std::endl in a for
+        assert_eq!(warnings(&RuleSet::builtin()), ["endl_in_loop:3", "alloc_in_loop:11", "alloc_in_loop:12"]);
+
+        let config = StaticAnalysisConfig { disable: vec!["endl_in_loop".to_string()], ..Default::default() };
+        let rules = RuleSet::new(&config).unwrap();
+        assert!(!rules.lint_enabled("endl_in_loop") && rules.lint_enabled("alloc_in_loop"));
+        assert_eq!(warnings(&rules), ["alloc_in_loop:11", "alloc_in_loop:12"]);
+    }
+}
@@ -0,0 +1,455 @@
+use std::borrow::Cow;
+use std::collections::BTreeMap;
+
+use anyhow::{anyhow, Result};
+use serde::{Deserialize, Serialize};
+
+use super::perf_lints::LINTS;
+use super::safety::{Warning, WarningType};
+use crate::utils;
+
+/// The built-in rule sets, by the name `[static_analysis] disable` knows them by
+pub const RULE_SETS: [&str; 2] = ["unsafe_functions", "performance"];
+
+/// Functions that are easy to misuse, and what to call instead
+const UNSAFE_FUNCTIONS: [(&str, &str); 14] = [
+    // String Functions
+    ("strcpy", "strncpy"),
+    ("strcat", "strncat"),
+    ("strtok", "strtok_r"),
+    ("vsprintf", "vsnprintf"),
+    // I/O Functions
+    ("gets", "fgets"),
+    ("sprintf", "snprintf"),
+    // DType conversions
+    ("atoi", "strtol"),
+    ("atol", "strtol"),
+    ("atoll", "strtoll"),
+    ("atof", "strtof"),
+    // Time related functions
+    ("gmtime", "gmtime_r"),
+    ("localtime", "localtime_r"),
+    ("ctime", "ctime_r"),
+    ("asctime", "asctime_r"),
+];
+
+const UNSAFE_NAMES: [&str; UNSAFE_FUNCTIONS.len()] = {
+    let mut names = [""; UNSAFE_FUNCTIONS.len()];
+    let mut i = 0;
+    while i < names.len() {
+        names[i] = UNSAFE_FUNCTIONS[i].0;
+        i += 1;
+    }
+    names
+};
+
+const UNSAFE_BUCKETS: usize = table_size(UNSAFE_NAMES.len()).0;
+const UNSAFE_SLOTS: usize = table_size(UNSAFE_NAMES.len()).1;
+
+/// Perfect hash table of the unsafe functions, built by the compiler
+static UNSAFE_TABLE: (u64, [u16; UNSAFE_BUCKETS], [u16; UNSAFE_SLOTS]) = perfect_table(&UNSAFE_NAMES);
+
+/// The `[static_analysis]` section of Kiln.toml
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct StaticAnalysisConfig {
+    /// Built-in rule sets or single rules (by function name, or lint name for the
+    /// performance lints) to turn off
+    #[serde(default)]
+    pub disable: Vec<String>,
+    /// Functions the project must not call
+    #[serde(default)]
+    pub banned: Vec<String>,
+    /// Functions to flag, with the message to show
+    #[serde(default)]
+    pub rules: BTreeMap<String, String>,
+    /// Rule sets or single rules (the project's own included) whose findings are errors,
+    /// which cancel the build
+    #[serde(default)]
+    pub deny: Vec<String>,
+}
+
+/// Flags every call to `name`
+#[derive(Debug, Clone, PartialEq)]
+pub struct Rule {
+    pub name: Cow<'static, str>,
+    pub kind: WarningType,
+    pub msg: Cow<'static, str>,
+}
+
+/// Every enabled rule behind one perfect hash table, so matching a call costs one hash
+/// and one string comparison however many rules there are
+#[derive(Debug, Clone)]
+pub struct RuleSet {
+    rules: Vec<Rule>,
+    seed: u64,
+    /// Displacement of each bucket of names. The length is a power of two.
+    displacements: Cow<'static, [u16]>,
+    /// Index + 1 of the rule in each slot, 0 for none. The length is a power of two.
+    slots: Cow<'static, [u16]>,
+    /// The performance lints that are on
+    lints: Vec<&'static str>,
+    /// `deny` of the config
+    denied: Vec<String>,
+}
+
+impl RuleSet {
+    /// The built-in rules, on the table computed at compile time
+    pub fn builtin() -> Self {
+        let (seed, displacements, slots) = &UNSAFE_TABLE;
+        Self {
+            rules: UNSAFE_FUNCTIONS.iter().map(|&(func, safe_fn)| unsafe_function(func, safe_fn)).collect(),
+            seed: *seed,
+            displacements: Cow::Borrowed(displacements),
+            slots: Cow::Borrowed(slots),
+            lints: LINTS.to_vec(),
+            denied: vec![],
+        }
+    }
+
+    /// The built-in rules less the disabled ones, plus the project's own
+    pub fn new(config: &StaticAnalysisConfig) -> Result<Self> {
+        if *config == StaticAnalysisConfig::default() {
+            return Ok(Self::builtin());
+        }
+
+        for name in &config.disable {
+            let name = name.as_str();
+            if !RULE_SETS.contains(&name) && !UNSAFE_NAMES.contains(&name) && !LINTS.contains(&name) {
+                return Err(anyhow!(
+                    "[static_analysis] can't disable `{}`, it's neither a rule set ({}) nor a built-in rule",
+                    name,
+                    RULE_SETS.join(", ")
+                ));
+            }
+        }
+        let disabled = |set: &str, name: &str| config.disable.iter().any(|d| d == set || d == name);
+
+        for name in &config.deny {
+            let own = config.banned.contains(name) || config.rules.contains_key(name);
+            if !own && !RULE_SETS.contains(&name.as_str()) && !UNSAFE_NAMES.contains(&name.as_str()) && !LINTS.contains(&name.as_str()) {
+                return Err(anyhow!(
+                    "[static_analysis] can't deny `{}`, it's neither a rule set ({}) nor a rule",
+                    name,
+                    RULE_SETS.join(", ")
+                ));
+            }
+        }
+
+        // The project's rules take precedence over the built-in ones for the same function
+        let mut rules: Vec<Rule> = vec![];
+        for (name, msg) in &config.rules {
+            rules.push(Rule {
+                name: Cow::Owned(name.clone()),
+                kind: WarningType::CustomRule,
+                msg: Cow::Owned(msg.clone()),
+            });
+        }
+        for name in &config.banned {
+            rules.push(Rule {
+                name: Cow::Owned(name.clone()),
+                kind: WarningType::BannedFunction,
+                msg: Cow::Owned(format!("{}() is banned in this project", name)),
+            });
+        }
+        for &(func, safe_fn) in &UNSAFE_FUNCTIONS {
+            if !disabled("unsafe_functions", func) {
+                rules.push(unsafe_function(func, safe_fn));
+            }
+        }
+
+        let mut seen = std::collections::HashSet::new();
+        rules.retain(|r| seen.insert(r.name.clone()));
+        if rules.len() >= u16::MAX as usize {
+            return Err(anyhow!("[static_analysis] has too many rules ({})", rules.len()));
+        }
+
+        let names: Vec<&str> = rules.iter().map(|r| r.name.as_ref()).collect();
+        let (buckets, len) = table_size(names.len());
+        let (mut displacements, mut slots) = (vec![0u16; buckets], vec![0u16; len]);
+        let (mut order, mut starts) = (vec![0u16; names.len()], vec![0u16; buckets]);
+        let seed = (0..)
+            .find(|&seed| build_table(&names, seed, &mut displacements, &mut slots, &mut order, &mut starts))
+            .unwrap();
+
+        Ok(Self {
+            rules,
+            seed,
+            displacements: Cow::Owned(displacements),
+            slots: Cow::Owned(slots),
+            lints: LINTS.into_iter().filter(|lint| !disabled("performance", lint)).collect(),
+            denied: config.deny.clone(),
+        })
+    }
+
+    /// The rule for calls to `name`, if any
+    pub fn lookup(&self, name: &str) -> Option<&Rule> {
+        let hash = hash(name.as_bytes(), self.seed);
+        let displacement = self.displacements[bucket(hash, self.displacements.len())];
+        let rule = &self.rules[(self.slots[slot(hash, displacement, self.slots.len())] as usize).checked_sub(1)?];
+        (rule.name == name).then_some(rule)
+    }
+
+    pub fn lint_enabled(&self, lint: &str) -> bool {
+        self.lints.contains(&lint)
+    }
+
+    /// Whether the built-in rule or lint for `name` (a pot warning found with the
+    /// built-in rules) is still on
+    pub fn keeps(&self, kind: &WarningType, name: &str) -> bool {
+        match kind {
+            WarningType::PerfHazard => self.lint_enabled(name),
+            _ => self.lookup(name).is_some_and(|rule| rule.kind == *kind),
+        }
+    }
+
+    /// Whether `warning` is an error, by its rule or the rule set it's from
+    pub fn is_error(&self, warning: &Warning) -> bool {
+        let set = match warning.warning_type {
+            WarningType::UnsafeFunction => "unsafe_functions",
+            WarningType::PerfHazard => "performance",
+            WarningType::BannedFunction | WarningType::CustomRule => "",
+            WarningType::PaddedStruct => return false,
+        };
+        self.denied.iter().any(|d| *d == set || *d == warning.subject)
+    }
+
+    /// Identifies the rules, so warnings found with other ones aren't reused
+    pub fn fingerprint(&self) -> u64 {
+        let mut text = String::new();
+        for rule in &self.rules {
+            text.push_str(&format!("{}\0{:?}\0{}\0", rule.name, rule.kind, rule.msg));
+        }
+        text.push_str(&self.lints.join("\0"));
+        utils::content_hash(text.as_bytes())
+    }
+}
+
+fn unsafe_function(func: &'static str, safe_fn: &'static str) -> Rule {
+    Rule {
+        name: Cow::Borrowed(func),
+        kind: WarningType::UnsafeFunction,
+        msg: Cow::Owned(format!("{}() is an unsafe function. Consuder using {}() instead", func, safe_fn)),
+    }
+}
+
+/// FNV-1a of `bytes`, starting from a seeded basis
+const fn hash(bytes: &[u8], seed: u64) -> u64 {
+    let mut hash = 0xcbf29ce484222325 ^ seed.wrapping_mul(0x9e3779b97f4a7c15);
+    let mut i = 0;
+    while i < bytes.len() {
+        hash ^= bytes[i] as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+        i += 1;
+    }
+    // FNV's low bits mix poorly, fold the high ones in
+    hash ^ (hash >> 29)
+}
+
+/// Buckets and slots of the table for `n` names: a few names per bucket, and at most half
+/// of the slots taken, so each bucket finds a displacement within a few tries
+const fn table_size(n: usize) -> (usize, usize) {
+    let slots = (n * 2).next_power_of_two();
+    ((n / 4).next_power_of_two(), if slots < 8 { 8 } else { slots })
+}
+
+const fn bucket(hash: u64, buckets: usize) -> usize {
+    (hash >> 48) as usize & (buckets - 1)
+}
+
+/// Slot of a name in a bucket with `displacement`. The step is odd, so the displacements
+/// take each name through every slot.
+const fn slot(hash: u64, displacement: u16, len: usize) -> usize {
+    hash.wrapping_add((displacement as u64).wrapping_mul((hash >> 24) | 1)) as usize & (len - 1)
+}
+
+/// Builds the table for `names` under `seed` with hash-and-displace (CHD): every name
+/// hashes to a bucket, and each bucket, biggest first, gets the first displacement that
+/// puts all of its names into free slots. `order` and `starts` are scratch space as long
+/// as `names` and `displacements`. False if a bucket doesn't fit anywhere.
+const fn build_table(
+    names: &[&str],
+    seed: u64,
+    displacements: &mut [u16],
+    slots: &mut [u16],
+    order: &mut [u16],
+    starts: &mut [u16],
+) -> bool {
+    let buckets = displacements.len();
+    fill(starts, 0);
+    fill(slots, 0);
+
+    // Sort the names by bucket: `starts` first counts them, then holds where each bucket
+    // begins in `order`, with `displacements` as the write cursors
+    let mut i = 0;
+    while i < names.len() {
+        starts[bucket(hash(names[i].as_bytes(), seed), buckets)] += 1;
+        i += 1;
+    }
+    let (mut begin, mut largest, mut b) = (0, 0, 0);
+    while b < buckets {
+        let size = starts[b];
+        starts[b] = begin;
+        displacements[b] = begin;
+        begin += size;
+        if size > largest {
+            largest = size;
+        }
+        b += 1;
+    }
+    i = 0;
+    while i < names.len() {
+        let b = bucket(hash(names[i].as_bytes(), seed), buckets);
+        order[displacements[b] as usize] = i as u16;
+        displacements[b] += 1;
+        i += 1;
+    }
+    fill(displacements, 0);
+
+    let mut size = largest as usize;
+    while size > 0 {
+        b = 0;
+        while b < buckets {
+            let end = if b + 1 < buckets { starts[b + 1] as usize } else { names.len() };
+            if end - starts[b] as usize == size {
+                let members = (&*order).split_at(end).0.split_at(starts[b] as usize).1;
+                match displace(names, seed, members, slots) {
+                    Some(displacement) => displacements[b] = displacement,
+                    None => return false,
+                }
+            }
+            b += 1;
+        }
+        size -= 1;
+    }
+    true
+}
+
+/// Finds the first displacement that puts every name of `members` (indexes into `names`)
+/// into a free slot, and takes those slots
+const fn displace(names: &[&str], seed: u64, members: &[u16], slots: &mut [u16]) -> Option<u16> {
+    let mut displacement = 0u16;
+    loop {
+        let mut placed = 0;
+        while placed < members.len() {
+            let i = members[placed] as usize;
+            let slot = slot(hash(names[i].as_bytes(), seed), displacement, slots.len());
+            if slots[slot] != 0 {
+                break;
+            }
+            slots[slot] = i as u16 + 1;
+            placed += 1;
+        }
+        if placed == members.len() {
+            return Some(displacement);
+        }
+
+        // Give back the slots this displacement took
+        while placed > 0 {
+            placed -= 1;
+            let i = members[placed] as usize;
+            slots[slot(hash(names[i].as_bytes(), seed), displacement, slots.len())] = 0;
+        }
+        if displacement == u16::MAX {
+            return None;
+        }
+        displacement += 1;
+    }
+}
+
+/// `build_table` for a table whose size is known at compile time
+const fn perfect_table<const K: usize, const B: usize, const N: usize>(
+    names: &[&str; K],
+) -> (u64, [u16; B], [u16; N]) {
+    assert!(B == table_size(K).0 && N == table_size(K).1);
+    let (mut displacements, mut slots) = ([0u16; B], [0u16; N]);
+    let (mut order, mut starts) = ([0u16; K], [0u16; B]);
+    let mut seed = 0;
+    while !build_table(names, seed, &mut displacements, &mut slots, &mut order, &mut starts) {
+        seed += 1;
+    }
+    (seed, displacements, slots)
+}
+
+const fn fill(values: &mut [u16], value: u16) {
+    let mut i = 0;
+    while i < values.len() {
+        values[i] = value;
+        i += 1;
+    }
+}
+
+#[cfg(test)]
+mod rules_tests {
+    use super::*;
+
+    #[test]
+    fn test_lookup() {
+        let builtin = RuleSet::builtin();
+        for (func, _) in UNSAFE_FUNCTIONS {
+            assert_eq!(builtin.lookup(func).unwrap().name, func);
+        }
+        assert!(builtin.lookup("strncpy").is_none() && builtin.lookup("").is_none());
+
+        let config = StaticAnalysisConfig {
+            disable: vec!["atoi".to_string()],
+            banned: vec!["system".to_string()],
+            rules: [("malloc".to_string(), "use arena_alloc()".to_string())].into(),
+            deny: vec!["system".to_string(), "performance".to_string()],
+        };
+        let rules = RuleSet::new(&config).unwrap();
+        assert!(rules.lookup("atoi").is_none());
+        assert_eq!(rules.lookup("atol").unwrap().kind, WarningType::UnsafeFunction);
+        assert_eq!(rules.lookup("system").unwrap().kind, WarningType::BannedFunction);
+        assert_eq!(rules.lookup("malloc").unwrap().msg, "use arena_alloc()");
+        assert_ne!(rules.fingerprint(), builtin.fingerprint());
+
+        let warning = |kind, subject: &str| Warning {
+            msg: String::new(),
+            filename: "a.c".to_string(),
+            line: 1,
+            warning_type: kind,
+            subject: subject.to_string(),
+        };
+        assert!(rules.is_error(&warning(WarningType::BannedFunction, "system")));
+        assert!(rules.is_error(&warning(WarningType::PerfHazard, "alloc_in_loop")));
+        assert!(!rules.is_error(&warning(WarningType::UnsafeFunction, "atol")));
+        assert!(!builtin.is_error(&warning(WarningType::BannedFunction, "system")));
+
+        let all_off = StaticAnalysisConfig {
+            disable: vec!["unsafe_functions".to_string()],
+            ..Default::default()
+        };
+        let all_off = RuleSet::new(&all_off).unwrap();
+        assert!(all_off.lookup("gets").is_none() && all_off.lint_enabled("alloc_in_loop"));
+        let perf = StaticAnalysisConfig {
+            disable: vec!["endl_in_loop".to_string()],
+            ..Default::default()
+        };
+        let perf = RuleSet::new(&perf).unwrap();
+        assert!(!perf.keeps(&WarningType::PerfHazard, "endl_in_loop") && perf.keeps(&WarningType::PerfHazard, "alloc_in_loop"));
+        assert_ne!(perf.fingerprint(), builtin.fingerprint());
+        let typo = StaticAnalysisConfig {
+            disable: vec!["unsafe_function".to_string()],
+            ..Default::default()
+        };
+        assert!(RuleSet::new(&typo).is_err());
+    }
+
+    #[test]
+    fn test_many_rules() {
+        let config = StaticAnalysisConfig {
+            banned: (0..400).map(|i| format!("banned_{}", i)).collect(),
+            rules: (0..300).map(|i| (format!("legacy_api_{}", i), format!("use api_{}", i))).collect(),
+            ..Default::default()
+        };
+        let rules = RuleSet::new(&config).unwrap();
+        for i in 0..400 {
+            assert_eq!(rules.lookup(&format!("banned_{}", i)).unwrap().kind, WarningType::BannedFunction);
+        }
+        for i in 0..300 {
+            assert_eq!(rules.lookup(&format!("legacy_api_{}", i)).unwrap().msg, format!("use api_{}", i));
+        }
+        assert_eq!(rules.lookup("gets").unwrap().kind, WarningType::UnsafeFunction);
+        assert!(rules.lookup("banned_400").is_none() && rules.lookup("api_1").is_none());
+    }
+}
@@ -1,135 +1,115 @@
-use crate::lexer_c;
+use crate::source_index::FileEntry;
+use crate::utils;
 
-use anyhow::{anyhow, Result};
-use std::{
-    collections::HashMap,
-    env,
-    fmt::Debug,
-    fs,
-    sync::{Arc, Mutex},
-};
+use super::rules::RuleSet;
 
-/// This checks if unsafe functions exist within a line using general string parsing
-/// This is messy and prone to false positives.
-/// TODO: Create a lexer to better perform static analysis
-struct FunctionMap {
-    map: HashMap<String, String>,
-}
-
-impl FunctionMap {
-    fn new() -> Self {
-        let map: HashMap<String, String> = [
-            // String Functions
-            ("strcpy".to_string(), "strncpy".to_string()),
-            ("strcat".to_string(), "strncat".to_string()),
-            ("strtok".to_string(), "strtok_r".to_string()),
-            ("vsprintf".to_string(), "vsnprintf".to_string()),
-            // I/O Functions
-            ("gets".to_string(), "fgets".to_string()),
-            ("sprintf".to_string(), "snprintf".to_string()),
-            // DType conversions
-            ("atoi".to_string(), "strtol".to_string()),
-            ("atol".to_string(), "strtol".to_string()),
-            ("atoll".to_string(), "strtoll".to_string()),
-            ("atof".to_string(), "strtof".to_string()),
-            // Time related functions
-            ("gmtime".to_string(), "gmtime_r".to_string()),
-            ("localtime".to_string(), "localtime_r".to_string()),
-            ("ctime".to_string(), "ctime_r".to_string()),
-            ("asctime".to_string(), "asctime_r".to_string()),
-        ]
-        .into_iter()
-        .collect();
+use serde::{Deserialize, Serialize};
+use std::{fmt::Debug, thread};
 
-        Self { map }
-    }
-}
+/// Version of the checks below. Bump it when they change, so warnings stored by the
+/// previous ones (build/analysis-cache.json, pot analyses) are found again.
+pub const RULES_VERSION: u32 = 3;
 
-#[derive(Debug)]
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 pub enum WarningType {
     UnsafeFunction,
+    BannedFunction,
+    CustomRule,
+    PaddedStruct,
+    PerfHazard,
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 pub struct Warning {
     pub msg: String,
     pub filename: String,
     pub line: usize,
     pub warning_type: WarningType,
+    /// What the warning is about: the called function, the struct, ...
+    #[serde(default)]
+    pub subject: String,
 }
 
-pub fn check_files(source_type: &str) -> Result<Vec<Warning>> {
-    let mut warnings = vec![];
-    let mut source_dir = env::current_dir()?;
-    source_dir.push("src");
-
-    if !source_dir.exists() {
-        return Err(anyhow!("src/ does not exist."));
-    } else if !source_dir.is_dir() {
-        return Err(anyhow!("src is not a directory."));
-    }
-
-    let func_map = FunctionMap::new();
+/// Matches every call in `files` (name and source index entry) against `rules` and
+/// reports the hazards of the lints that are on, with the files checked in parallel
+pub fn check_files<'a>(files: impl Iterator<Item = (&'a str, &'a FileEntry)>, rules: &RuleSet) -> Vec<Warning> {
+    let files: Vec<_> = files.collect();
 
-    for path in fs::read_dir(source_dir)? {
-        if let Ok(path) = path {
-            let path = path.path();
-            let name = path.file_name().unwrap().to_str().unwrap().to_string();
-            if !name.ends_with(source_type) {
-                continue;
+    check_parallel(&files, |&(filename, entry), warnings| {
+        for call in &entry.calls {
+            if let Some(rule) = rules.lookup(&call.name) {
+                warnings.push(Warning {
+                    msg: rule.msg.to_string(),
+                    filename: filename.to_string(),
+                    line: call.line,
+                    warning_type: rule.kind.clone(),
+                    subject: call.name.clone(),
+                });
             }
-
-            let source_code = fs::read_to_string(path)?;
-            let mut curr_warnings = scan_file(&name, &source_code, &func_map);
-
-            warnings.append(&mut curr_warnings);
         }
-    }
-
-    Ok(warnings)
+        for hazard in entry.hazards.iter().filter(|h| rules.lint_enabled(&h.lint)) {
+            warnings.push(Warning {
+                msg: format!("{} [{}]", hazard.msg, hazard.lint),
+                filename: filename.to_string(),
+                line: hazard.line,
+                warning_type: WarningType::PerfHazard,
+                subject: hazard.lint.clone(),
+            });
+        }
+    })
 }
 
-#[allow(unused)]
-pub fn check_files_threaded(source_type: &str, warn_buff: Arc<Mutex<Vec<Warning>>>) -> Result<()> {
-    let mut warnings = check_files(source_type)?;
-
-    let mut lock = warn_buff.lock().unwrap();
-    lock.append(&mut warnings);
+/// Runs `check` over `items` on the thread pool of `utils::par_map`. The items are split
+/// into a few batches per thread, so a thread that draws cheap ones takes more of them,
+/// and each batch fills its own buffer. The buffers are concatenated and sorted by file,
+/// line and message, so the order never depends on the scheduling.
+fn check_parallel<T: Sync>(items: &[T], check: impl Fn(&T, &mut Vec<Warning>) + Sync) -> Vec<Warning> {
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+    let batch = items.len().div_ceil(threads * 4).max(1);
+    let batches: Vec<_> = items.chunks(batch).collect();
+
+    let mut warnings: Vec<Warning> = utils::par_map(&batches, |batch| {
+        let mut warnings = vec![];
+        for item in *batch {
+            check(item, &mut warnings);
+        }
+        warnings
+    })
+    .into_iter()
+    .flatten()
+    .collect();
 
-    Ok(())
+    warnings.sort_by(|a, b| (&a.filename, a.line, &a.msg).cmp(&(&b.filename, b.line, &b.msg)));
+    warnings
 }
 
-fn scan_file(filename: &str, source_code: &str, func_map: &FunctionMap) -> Vec<Warning> {
-    let mut warnings = vec![];
-
-    let tokens = lexer_c::tokenize(source_code)
-        .unwrap();
-
-    for (token_num, token) in tokens.iter().enumerate() {
-        if tokens[token_num..].len() < 3 {
-            continue;
-        }
-
-        if let lexer_c::Token::Object(obj) = token {
-            if tokens[token_num + 1] != lexer_c::Token::OpenParen {
-                continue;
-            }
-            if let Some(safe_fn) = func_map.map.get(*obj) {
-                let warning = Warning {
-                    warning_type: WarningType::UnsafeFunction,
-                    msg: format!(
-                        "{}() is an unsafe function. Consuder using {}() instead",
-                        obj, safe_fn
-                    ),
-                    filename: filename.to_string(),
-                    line: token_num + 1,
+#[cfg(test)]
+mod safety_tests {
+    use super::*;
+    use crate::source_index::CallSite;
+
+    #[test]
+    fn test_check_files_is_ordered() {
+        let call = |name: &str, line| CallSite {
+            name: name.to_string(),
+            token: 0,
+            line,
+        };
+        let entries: Vec<_> = (0..200)
+            .map(|i| {
+                let entry = FileEntry {
+                    calls: vec![call("strcpy", 9), call("printf", 3), call("atoi", 9), call("gets", 1)],
+                    ..Default::default()
                 };
-
-                warnings.push(warning);
-            }
-        }
-        
+                (format!("file{:03}.c", 199 - i), entry)
+            })
+            .collect();
+
+        let rules = RuleSet::builtin();
+        let warnings = check_files(entries.iter().map(|(name, entry)| (name.as_str(), entry)), &rules);
+        assert_eq!(warnings.len(), 600);
+        assert_eq!(warnings[0].filename, "file000.c");
+        let first: Vec<_> = warnings[..3].iter().map(|w| (w.line, w.msg.split('(').next().unwrap())).collect();
+        assert_eq!(first, vec![(1, "gets"), (9, "atoi"), (9, "strcpy")]);
     }
-
-    warnings
-}
\ No newline at end of file
+}
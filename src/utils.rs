@@ -1,11 +1,14 @@
-use std::collections::HashSet;
 use std::fs;
+use std::io::Write;
 use std::path::{Path, PathBuf};
 use std::process::{self, Command};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
 
 use anyhow::{anyhow, Result};
 use colored::*;
 
+
 #[derive(Debug, Clone, Copy, PartialEq, serde::Serialize, serde::Deserialize, clap::ValueEnum)]
 pub enum Language {
     C,
@@ -106,33 +109,6 @@ impl CompilerVersions {
     }
 }
 
-/// Returns a vector of the included statements
-/// Ex) `["stdio.h", "<math.h>"]`
-pub fn extract_include_statements(path: &Path) -> Vec<String> {
-    let mut path = path.to_path_buf();
-    path.push("src");
-
-    let mut includes = HashSet::new();
-
-    for p in path.read_dir().unwrap() {
-        let p = p.unwrap();
-
-        let text = fs::read_to_string(p.path()).unwrap();
-
-        let local_include = text
-            .split("\n")
-            .map(|s| s.trim())
-            .filter(|s| s.starts_with("#include") && s.ends_with(">"))
-            .map(|s| format!("<{}", s.split_once("<").unwrap().1));
-
-        for inc in local_include {
-            includes.insert(inc);
-        }
-    }
-
-    includes.into_iter().collect()
-}
-
 #[allow(unused)]
 pub fn expand_user(path: &str) -> String {
     if path.starts_with("~/") {
@@ -156,11 +132,32 @@ pub fn print_warning(
     line: &str,
     warning_type: &str,
     msg: &str,
+) {
+    print_finding(warning_source, "Warning", filename, line, warning_type, msg);
+}
+
+pub fn print_error(
+    warning_source: &str,
+    filename: &str,
+    line: &str,
+    warning_type: &str,
+    msg: &str,
+) {
+    print_finding(warning_source, "Error", filename, line, warning_type, msg);
+}
+
+fn print_finding(
+    warning_source: &str,
+    severity: &str,
+    filename: &str,
+    line: &str,
+    warning_type: &str,
+    msg: &str,
 ) {
     let err_msg = format!(
-        "{} {} [src/{} | Line {} ]: {:?}\n{}",
+        "{} {} [{} | Line {} ]: {:?}\n{}",
         warning_source.red().bold(),
-        "Warning".red().bold(),
+        severity.red().bold(),
         filename,
         line,
         warning_type,
@@ -176,3 +173,92 @@ pub fn join_rel_path(abs_path: impl AsRef<Path>, rel_path: &str) -> PathBuf {
         _ => path.join(rel_path),
     }
 }
+
+/// Runs `f` on every item using a pool of scoped threads and returns the results in
+/// the same order as `items`. Workers claim the next unprocessed item from a shared
+/// atomic counter, so a few large items don't hold up the rest of the queue.
+pub fn par_map<T, R, F>(items: &[T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    let num_threads = thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(items.len());
+
+    if num_threads <= 1 {
+        return items.iter().map(f).collect();
+    }
+
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<(usize, R)> = thread::scope(|s| {
+        let handles: Vec<_> = (0..num_threads)
+            .map(|_| {
+                s.spawn(|| {
+                    let mut done = vec![];
+                    loop {
+                        let idx = next.fetch_add(1, Ordering::Relaxed);
+                        if idx >= items.len() {
+                            break;
+                        }
+                        done.push((idx, f(&items[idx])));
+                    }
+                    done
+                })
+            })
+            .collect();
+
+        handles
+            .into_iter()
+            .flat_map(|h| h.join().unwrap())
+            .collect()
+    });
+
+    results.sort_unstable_by_key(|r| r.0);
+    results.into_iter().map(|r| r.1).collect()
+}
+
+/// Writes `contents` to a temporary file next to `path` and renames it over `path`,
+/// so readers (and interrupted runs) never see a partially written file
+pub fn write_atomic(path: &Path, contents: impl AsRef<[u8]>) -> Result<()> {
+    let dir = match path.parent() {
+        Some(dir) if !dir.as_os_str().is_empty() => dir,
+        _ => Path::new("."),
+    };
+
+    let mut file = tempfile::NamedTempFile::new_in(dir)
+        .map_err(|e| anyhow!("Failed to create temporary file in {:?}: {}", dir, e))?;
+    file.write_all(contents.as_ref())
+        .map_err(|e| anyhow!("Failed to write {:?}: {}", path, e))?;
+
+    // Temporary files are created owner-only; keep the permissions of the file being
+    // replaced, or the usual rw-r--r-- for a new one
+    let permissions = match fs::metadata(path) {
+        Ok(meta) => Some(meta.permissions()),
+        #[cfg(unix)]
+        Err(_) => Some(std::os::unix::fs::PermissionsExt::from_mode(0o644)),
+        #[cfg(not(unix))]
+        Err(_) => None,
+    };
+    if let Some(permissions) = permissions {
+        file.as_file()
+            .set_permissions(permissions)
+            .map_err(|e| anyhow!("Failed to write {:?}: {}", path, e))?;
+    }
+    file.persist(path)
+        .map_err(|e| anyhow!("Failed to write {:?}: {}", path, e.error))?;
+
+    Ok(())
+}
+
+/// 64 bit FNV-1a hash of `bytes`. Stable across runs and platforms, so it can be
+/// persisted in build manifests.
+pub fn content_hash(bytes: &[u8]) -> u64 {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for &b in bytes {
+        hash ^= b as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    hash
+}